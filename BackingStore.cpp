@@ -0,0 +1,399 @@
+#include "BackingStore.h"
+
+#include <new>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BACKING_STORE_HAS_MMAP 1
+#else
+#define BACKING_STORE_HAS_MMAP 0
+#endif
+
+// glibc 2.35 registers an rseq area per thread and exports where it is.
+#if BACKING_STORE_HAS_MMAP && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35)
+#define BACKING_STORE_HAS_RSEQ 1
+#endif
+#endif
+#endif
+#ifndef BACKING_STORE_HAS_RSEQ
+#define BACKING_STORE_HAS_RSEQ 0
+#endif
+
+#include "common.h"
+#define TAG_LOG BackingStore
+
+static inline size_t alignUp(size_t n, size_t alignment) {
+  return (n + alignment - 1) & ~(alignment - 1);
+}
+
+BackingStore::BackingStore(BackingKind kind, size_t regionSize)
+  : mKind(BACKING_STORE_HAS_MMAP ? kind : BackingKind::heap)
+  , mRegionSize(alignUp(regionSize, HUGE_PAGE_SIZE)) {}
+
+BackingStore::~BackingStore() {
+  std::lock_guard<std::mutex> _l(mMutex);
+  Region* region = mRegions.exchange(nullptr, std::memory_order_relaxed);
+  while (region) {
+    Region* next = region->mNext;
+    unmapRegion(region);
+    region = next;
+  }
+  mFreeBlocks = nullptr;
+}
+
+void* BackingStore::allocate(size_t size, size_t alignment) {
+  if (mKind == BackingKind::heap) {
+    return ::operator new(size, std::align_val_t(alignment), std::nothrow);
+  }
+  std::lock_guard<std::mutex> _l(mMutex);
+  if (void* p = takeFreeBlock(size, alignment)) {
+    return p;
+  }
+  for (Region* region = mRegions.load(std::memory_order_relaxed); region;
+       region = region->mNext) {
+    if (void* p = carve(region, size, alignment)) {
+      return p;
+    }
+  }
+  Region* region = mapRegion(sizeof(Region) + alignment + size);
+  if (!region) {
+    return nullptr;
+  }
+  return carve(region, size, alignment);
+}
+
+void BackingStore::deallocate(void* p, size_t size, size_t alignment) {
+  if (!p) {
+    return;
+  }
+  if (mKind == BackingKind::heap) {
+    ::operator delete(p, std::align_val_t(alignment));
+    return;
+  }
+  // the address range is only given back to the kernel with its region,
+  // drop the pages and keep the block for the next arena of the same size.
+  discard(static_cast<unsigned char*>(p) + sizeof(FreeBlock),
+          size - sizeof(FreeBlock));
+  std::lock_guard<std::mutex> _l(mMutex);
+  FreeBlock* block = new (p) FreeBlock();
+  block->mSize = size;
+  block->mNext = mFreeBlocks;
+  mFreeBlocks = block;
+}
+
+size_t BackingStore::discard(void* p, size_t size) {
+#if BACKING_STORE_HAS_MMAP
+  // only whole pages inside the range, the partial ones at both ends may
+  // hold someone else's bytes.
+  const size_t pageSize = getPageSize();
+  uintptr_t start = alignUp(reinterpret_cast<uintptr_t>(p), pageSize);
+  uintptr_t end = (reinterpret_cast<uintptr_t>(p) + size) & ~(pageSize - 1);
+  if (end <= start) {
+    return 0;
+  }
+  if (::madvise(reinterpret_cast<void*>(start), end - start,
+                MADV_DONTNEED) != 0) {
+    MY_LOGD("ERROR, madvise(0x%p, %zu) failed",
+            reinterpret_cast<void*>(start), end - start);
+    return 0;
+  }
+  return end - start;
+#else
+  (void)p;
+  (void)size;
+  return 0;
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+void BackingStore::prefault(void* p, size_t size) {
+  if (size == 0) {
+    return;
+  }
+#if BACKING_STORE_HAS_MMAP && defined(MADV_POPULATE_WRITE)
+  const size_t pageSize = getPageSize();
+  uintptr_t start = reinterpret_cast<uintptr_t>(p) & ~(pageSize - 1);
+  uintptr_t end = alignUp(reinterpret_cast<uintptr_t>(p) + size, pageSize);
+  if (::madvise(reinterpret_cast<void*>(start), end - start,
+                MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+  // kernels before 5.14, touch the pages ourselves.
+#endif  // BACKING_STORE_HAS_MMAP && MADV_POPULATE_WRITE
+  volatile unsigned char* bytes = static_cast<unsigned char*>(p);
+  for (size_t offset = 0; offset < size; offset += getPageSize()) {
+    bytes[offset] = bytes[offset];
+  }
+  bytes[size - 1] = bytes[size - 1];
+}
+
+void* BackingStore::mapPages(size_t size) {
+#if BACKING_STORE_HAS_MMAP
+  void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    MY_LOGD("ERROR, mmap of %zu bytes failed", size);
+    return nullptr;
+  }
+  return p;
+#else
+  return ::operator new(size, std::align_val_t(getPageSize()), std::nothrow);
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+void BackingStore::unmapPages(void* p, size_t size) {
+#if BACKING_STORE_HAS_MMAP
+  ::munmap(p, size);
+#else
+  (void)size;
+  ::operator delete(p, std::align_val_t(getPageSize()));
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+size_t BackingStore::getPageSize() {
+#if BACKING_STORE_HAS_MMAP
+  static const size_t sPageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return sPageSize;
+#else
+  return 4096;
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+#if BACKING_STORE_HAS_MMAP
+// number of ids in a sysfs id list like "0-3" or "0,2", the highest one
+// decides. read without stdio, this may run inside malloc.
+static uint32_t readIdListCount(const char* path) {
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 1;
+  }
+  char buf[256];
+  ssize_t len = ::read(fd, buf, sizeof(buf) - 1);
+  ::close(fd);
+  uint32_t maxId = 0;
+  uint32_t id = 0;
+  for (ssize_t i = 0; i < len; ++i) {
+    if (buf[i] >= '0' && buf[i] <= '9') {
+      id = id * 10 + static_cast<uint32_t>(buf[i] - '0');
+      maxId = std::max(maxId, id);
+    } else {
+      id = 0;
+    }
+  }
+  return maxId + 1;
+}
+#endif  // BACKING_STORE_HAS_MMAP
+
+uint32_t BackingStore::getNumaNodeCount() {
+#if BACKING_STORE_HAS_MMAP
+  static const uint32_t sNodeCount =
+      readIdListCount("/sys/devices/system/node/online");
+  return sNodeCount;
+#else
+  return 1;
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+uint32_t BackingStore::getCurrentNumaNode(uint32_t* cpu) {
+  unsigned int cpuId = 0;
+  unsigned int node = 0;
+#if BACKING_STORE_HAS_MMAP
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+  // vDSO, no system call.
+  if (::getcpu(&cpuId, &node) != 0) {
+    cpuId = node = 0;
+  }
+#else
+  if (::syscall(SYS_getcpu, &cpuId, &node, nullptr) != 0) {
+    cpuId = node = 0;
+  }
+#endif  // __GLIBC__
+#endif  // BACKING_STORE_HAS_MMAP
+  if (cpu) {
+    *cpu = cpuId;
+  }
+  return node;
+}
+
+uint32_t BackingStore::getCpuCount() {
+#if BACKING_STORE_HAS_MMAP
+  // possible rather than online, a cpu brought up later keeps its id.
+  static const uint32_t sCpuCount =
+      readIdListCount("/sys/devices/system/cpu/possible");
+  return sCpuCount;
+#else
+  return 1;
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+uint32_t BackingStore::getCurrentCpu() {
+#if BACKING_STORE_HAS_RSEQ
+  // glibc registered an rseq area for the thread, the kernel keeps cpu_id
+  // in it up to date. a plain load, no system call.
+  if (__rseq_size > 0) {
+    const volatile struct rseq* area =
+        reinterpret_cast<const volatile struct rseq*>(
+            static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+    int32_t cpu = static_cast<int32_t>(area->cpu_id);
+    if (cpu >= 0) {
+      return static_cast<uint32_t>(cpu);
+    }
+  }
+#endif  // BACKING_STORE_HAS_RSEQ
+#if BACKING_STORE_HAS_MMAP
+  int cpu = ::sched_getcpu();
+  return cpu < 0 ? 0 : static_cast<uint32_t>(cpu);
+#else
+  return 0;
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+bool BackingStore::bindToNumaNode(void* p, size_t size, uint32_t node) {
+#if BACKING_STORE_HAS_MMAP && defined(SYS_mbind)
+  // MPOL_PREFERRED of <numaif.h>, without depending on libnuma.
+  constexpr int MPOL_PREFERRED_MODE = 1;
+  constexpr unsigned long MAX_NODE_BITS = sizeof(unsigned long) * 8;
+  if (node >= MAX_NODE_BITS) {
+    return false;
+  }
+  unsigned long nodeMask = 1UL << node;
+  if (::syscall(SYS_mbind, p, size, MPOL_PREFERRED_MODE, &nodeMask,
+                MAX_NODE_BITS, 0) != 0) {
+    MY_LOGD("ERROR, mbind(0x%p, %zu, node=%u) failed", p, size, node);
+    return false;
+  }
+  return true;
+#else
+  (void)p;
+  (void)size;
+  (void)node;
+  return false;
+#endif  // BACKING_STORE_HAS_MMAP && SYS_mbind
+}
+
+size_t BackingStore::getMappedBytes() const {
+  std::lock_guard<std::mutex> _l(mMutex);
+  size_t bytes = 0;
+  for (Region* region = mRegions.load(std::memory_order_relaxed); region;
+       region = region->mNext) {
+    bytes += region->mSize;
+  }
+  return bytes;
+}
+
+bool BackingStore::contains(const void* p) const {
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+  for (const Region* region = mRegions.load(std::memory_order_acquire);
+       region; region = region->mNext) {
+    const uintptr_t start = reinterpret_cast<uintptr_t>(region);
+    if (addr >= start && addr - start < region->mSize) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void* BackingStore::takeFreeBlock(size_t size, size_t alignment) {
+  FreeBlock** link = &mFreeBlocks;
+  while (*link) {
+    FreeBlock* block = *link;
+    if (block->mSize == size &&
+        (reinterpret_cast<uintptr_t>(block) & (alignment - 1)) == 0) {
+      *link = block->mNext;
+      return block;
+    }
+    link = &block->mNext;
+  }
+  return nullptr;
+}
+
+void* BackingStore::carve(Region* region, size_t size, size_t alignment) {
+  uintptr_t cursor = reinterpret_cast<uintptr_t>(region->mCursor);
+  unsigned char* p = reinterpret_cast<unsigned char*>(alignUp(cursor, alignment));
+  if (p + size > region->mEnd) {
+    return nullptr;
+  }
+  region->mCursor = p + size;
+  return p;
+}
+
+BackingStore::Region* BackingStore::mapRegion(size_t minSize) {
+#if BACKING_STORE_HAS_MMAP
+  const size_t pageSize = getPageSize();
+  const bool huge = mKind != BackingKind::mmap;
+  size_t size = alignUp(std::max(minSize, mRegionSize),
+                        huge ? HUGE_PAGE_SIZE : pageSize);
+  void* base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (mKind == BackingKind::mmap_hugetlb && !mHugeTlbFailed) {
+    base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) {
+      // no reserved huge pages, stop asking and use THP from now on.
+      MY_LOGD("MAP_HUGETLB of %zu bytes failed, fall back to THP", size);
+      mHugeTlbFailed = true;
+    }
+  }
+#endif  // MAP_HUGETLB
+  if (base == MAP_FAILED) {
+    // over-reserve so the region can start at a huge page boundary, then
+    // trim the unaligned head and tail.
+    size_t reserveSize = huge ? size + HUGE_PAGE_SIZE : size;
+    void* raw = ::mmap(nullptr, reserveSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+      MY_LOGD("ERROR, mmap of %zu bytes failed", reserveSize);
+      return nullptr;
+    }
+    uintptr_t rawStart = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t start = huge ? alignUp(rawStart, HUGE_PAGE_SIZE) : rawStart;
+    if (start > rawStart) {
+      ::munmap(raw, start - rawStart);
+    }
+    if (rawStart + reserveSize > start + size) {
+      ::munmap(reinterpret_cast<void*>(start + size),
+               rawStart + reserveSize - (start + size));
+    }
+    base = reinterpret_cast<void*>(start);
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+      ::madvise(base, size, MADV_HUGEPAGE);
+    }
+#endif  // MADV_HUGEPAGE
+  }
+  // bound before the first touch, the pages are placed on fault.
+  if (mNumaNode >= 0) {
+    bindToNumaNode(base, size, static_cast<uint32_t>(mNumaNode));
+  }
+  MY_LOGD("map region kind=%d node=%d addr:0x%p - 0x%p size=%zu",
+          static_cast<int>(mKind), mNumaNode, base,
+          static_cast<unsigned char*>(base) + size, size);
+
+  Region* region = new (base) Region();
+  region->mSize = size;
+  region->mCursor = static_cast<unsigned char*>(base) + sizeof(Region);
+  region->mEnd = static_cast<unsigned char*>(base) + size;
+  region->mNext = mRegions.load(std::memory_order_relaxed);
+  // published after the region is set up, contains() reads without the lock.
+  mRegions.store(region, std::memory_order_release);
+  return region;
+#else
+  (void)minSize;
+  return nullptr;
+#endif  // BACKING_STORE_HAS_MMAP
+}
+
+void BackingStore::unmapRegion(Region* region) {
+#if BACKING_STORE_HAS_MMAP
+  ::munmap(region, region->mSize);
+#else
+  (void)region;
+#endif  // BACKING_STORE_HAS_MMAP
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+#include "common.h"
+
+/**
+ * Where the memory of an arena comes from.
+ *   heap         : aligned operator new, one heap chunk per arena
+ *   mmap         : arenas are carved out of large anonymous mappings
+ *   mmap_thp     : like mmap, regions are 2MB aligned and advised with
+ *                  MADV_HUGEPAGE so the kernel backs them by huge pages
+ *   mmap_hugetlb : regions come from MAP_HUGETLB (reserved huge pages), falls
+ *                  back to mmap_thp when no huge page is reserved
+ * On platforms without mmap every kind behaves as heap.
+ */
+enum class BackingKind : uint8_t {
+  heap,
+  mmap,
+  mmap_thp,
+  mmap_hugetlb,
+};
+
+class BackingStore {
+ public:
+  constexpr static size_t HUGE_PAGE_SIZE = 2 << 20;  // 2MB
+  constexpr static size_t DEFAULT_REGION_SIZE = 32 << 20;  // 32MB
+
+  explicit BackingStore(BackingKind kind,
+                        size_t regionSize = DEFAULT_REGION_SIZE);
+  // unmaps every region, all arenas carved from it must be gone already.
+  ~BackingStore();
+  BackingStore(const BackingStore&) = delete;
+  BackingStore& operator=(const BackingStore&) = delete;
+
+  // memory is zero filled when it is fresh from the kernel, but a block
+  // reused from the free list keeps its old content.
+  void* allocate(size_t size, size_t alignment);
+  void deallocate(void* p, size_t size, size_t alignment);
+
+  // give the physical pages inside [p, p+size) back to the OS, the range
+  // stays mapped and reads as zero afterwards. works on any anonymous
+  // memory we own, not only on memory of a BackingStore.
+  static size_t discard(void* p, size_t size);
+  // fault in every page of [p, p+size) now, so the first touch later does
+  // not pay the page fault. the content is kept.
+  static void prefault(void* p, size_t size);
+  // a private mapping of its own for one large allocation, page aligned.
+  // size must be a multiple of getPageSize().
+  static void* mapPages(size_t size);
+  static void unmapPages(void* p, size_t size);
+  static size_t getPageSize();
+
+  // NUMA nodes of the machine and the node the calling thread runs on. 1
+  // and 0 where it is unknown, e.g. without mmap. `cpu` receives the cpu
+  // the node was read on.
+  static uint32_t getNumaNodeCount();
+  static uint32_t getCurrentNumaNode(uint32_t* cpu = nullptr);
+  // prefer `node` for the pages of [p, p+size), which must be page aligned.
+  // they are still taken from another node when this one is out of memory.
+  static bool bindToNumaNode(void* p, size_t size, uint32_t node);
+  // cpus of the machine and the one the calling thread runs on, read from
+  // the rseq area where glibc registered one, sched_getcpu() otherwise.
+  static uint32_t getCpuCount();
+  static uint32_t getCurrentCpu();
+  // regions mapped from now on are bound to `node`, -1 leaves them to the
+  // first touch. set it before the first allocate.
+  void setNumaNode(int node) { mNumaNode = node; }
+
+  BackingKind getKind() const { return mKind; }
+  size_t getMappedBytes() const;
+  // whether `p` lies in one of the regions mapped so far. takes no lock,
+  // regions are only added until the store is gone. a heap store maps
+  // none and owns nothing.
+  bool contains(const void* p) const;
+
+ private:
+  // a region is one mapping, the bookkeeping lives at its start so no
+  // allocation happens outside of the mapped memory.
+  struct Region {
+    Region* mNext = nullptr;
+    size_t mSize = 0;
+    unsigned char* mCursor = nullptr;
+    unsigned char* mEnd = nullptr;
+  };
+  // a returned block, kept in the block itself until it is reused.
+  struct FreeBlock {
+    FreeBlock* mNext = nullptr;
+    size_t mSize = 0;
+  };
+
+  void* takeFreeBlock(size_t size, size_t alignment);
+  void* carve(Region* region, size_t size, size_t alignment);
+  Region* mapRegion(size_t minSize);
+  void unmapRegion(Region* region);
+
+ private:
+  const BackingKind mKind;
+  const size_t mRegionSize;
+  mutable std::mutex mMutex;
+  // pushed to the front under mMutex, read without it by contains().
+  std::atomic<Region*> mRegions = nullptr;
+  FreeBlock* mFreeBlocks = nullptr;
+  bool mHugeTlbFailed = false;
+  int mNumaNode = -1;
+};
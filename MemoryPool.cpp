@@ -2,6 +2,7 @@
 
 #include <cstring>
 #include <memory>
+#include <new>
 
 #include "common.h"
 #define TAG_LOG MemoryPool
@@ -14,10 +15,14 @@
 #define BYTE_ALIGNMENT 8
 #define VALID_ARENA_HEADER_MARKER 0x0123ABCD0123ABCD
 #define VALID_CELL_HEADER_MARKER 0xEEEEFFFFDDDD0123
+#define CELL_HEADER_SIZE (HEADERLESS_CELL ? 0 : sizeof(CellHeader))
+#ifndef MAX_EMPTY_ARENAS
+#define MAX_EMPTY_ARENAS 1 /* empty arenas kept per collection, one more is freed. keeps a size class hovering around an arena boundary from freeing and allocating the same arena all the time */
+#endif
 
 #define COUNT_NUM_TRAILING_ZEROES_UINT32(bits) __builtin_ctz(bits)
-#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctz(bits)
-#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clzl(bits)
+#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctzll(bits)
+#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clz(bits)
 #define COUNT_NUM_LEADING_ZEROES_UINT64(bits) __builtin_clzll(bits)
 
 #define TO_POW2_UINT32(n)  \
@@ -31,30 +36,44 @@ void* MemoryPool::allocate(size_t size) {
     MY_LOGD("zero size allocation is invalid");
     return nullptr;
   }
+  if (size > MAX_CELL_SIZE) {
+    // too large for any arena, give it a chunk of its own marked as such.
+    CellHeader* cell_header = reinterpret_cast<CellHeader*>(
+        ::operator new(sizeof(CellHeader) + size, std::nothrow));
+    if (!cell_header) {
+      MY_LOGD("ERROR, allocate %zu bytes failed", size);
+      return nullptr;
+    }
+    cell_header->mArena = nullptr;
+    cell_header->mGuard = OUTSIDE_SYSTEM_MARKER;
+    MY_LOGD("outside system allocation 0x%p, size=%zu", cell_header + 1, size);
+    return cell_header + 1;
+  }
   GlobalState& gState = getGlobalState();
   unsigned int cellSize_wo_header = 0;
   unsigned int arenaIdx = 0;
   cellSize_wo_header = calcCellSizeAndArenaIndex(size, arenaIdx);
 
   ArenaCollection* arenaCollection = gState.mArenaCollections[arenaIdx];
-  ArenaHeader* arena_header = nullptr;
   if (!arenaCollection) {
     arenaCollection = reinterpret_cast<ArenaCollection*>(
         calloc(1, sizeof(ArenaCollection)));
     arenaCollection->mCellSizeInBytes = cellSize_wo_header;
     gState.mArenaCollections[arenaIdx] = arenaCollection;
+  }
+
+  // take the first arena with unoccupied cells, no need to walk full ones.
+  ArenaHeader* arena_header = arenaCollection->mFirstAvail;
+  if (!arena_header) {
+    // all arenas are occupied, allocate a new one.
     arena_header = allocateArenaOfMemory(cellSize_wo_header, BYTE_ALIGNMENT, arenaCollection);
+    arena_header->mNext = arenaCollection->mFirst;
     arenaCollection->mFirst = arena_header;
+    arenaCollection->mFirstAvail = arena_header;
+    arenaCollection->mNumEmptyArenas++;
   }
-  arena_header = arenaCollection->mFirst;
-
-  // now we're not ready to know if the arena is usable or not.
-  while (arena_header->mNumOccupiedCells >= arena_header->mCellCapacity) {
-    // all cells in the arena are occupied, allocate a new one.
-    if (!arena_header->mNext) {
-      arena_header->mNext = allocateArenaOfMemory(cellSize_wo_header, BYTE_ALIGNMENT, arenaCollection);
-    }
-    arena_header = arena_header->mNext;
+  if (arena_header->mNumOccupiedCells == 0) {
+    arenaCollection->mNumEmptyArenas--;
   }
 
   // now an arena with unoccupied cells is found. find the cell and occupy it.
@@ -62,10 +81,16 @@ void* MemoryPool::allocate(size_t size) {
       static_cast<unsigned int>(COUNT_NUM_TRAILING_ZEROES_UINT64(~arena_header->mOccupationBits));
   arena_header->mNumOccupiedCells++;
   arena_header->mOccupationBits |= (1ULL << cell_index);
+  if (arena_header->mNumOccupiedCells >= arena_header->mCellCapacity) {
+    // the arena is full now, it leaves the available list until a cell of
+    // it is deallocated.
+    arenaCollection->mFirstAvail = arena_header->mNextAvail;
+    arena_header->mNextAvail = nullptr;
+  }
 
   unsigned char* ptr = arena_header->mArenaStart
-                     + (cell_index * (sizeof(CellHeader) + arena_header->mCellSizeInBytes))
-                     + sizeof(CellHeader);
+                     + (cell_index * (CELL_HEADER_SIZE + arena_header->mCellSizeInBytes))
+                     + CELL_HEADER_SIZE;
   MY_LOGD("ptr=%p", ptr);
   print(*arena_header);
   return reinterpret_cast<void*>(ptr);
@@ -76,29 +101,59 @@ void MemoryPool::deallocate(void* data, size_t size) {
     MY_LOGD("null data is invalid");
     return;
   }
-  // TODO() : identify if this is an outside system allocation.
-  // free it if yse.
   MY_LOGD("deallocate 0x%p, size=%zu", data, size);
-  MemoryPool::GlobalState& gState = getGlobalState();
   unsigned char* data_char = reinterpret_cast<unsigned char*>(data);
-  CellHeader *cell_header = reinterpret_cast<CellHeader*>(data_char - sizeof(CellHeader));
+  // outside system allocations always carry a header, even without cell
+  // headers, and are the only ones larger than MAX_CELL_SIZE.
+  if (size > MAX_CELL_SIZE) {
+    CellHeader *cell_header = reinterpret_cast<CellHeader*>(data_char - sizeof(CellHeader));
+    if (cell_header->mGuard != OUTSIDE_SYSTEM_MARKER) {
+      MY_LOGD("0x%p is not an outside system allocation", data);
+      return;
+    }
+    ::operator delete(cell_header);
+    return;
+  }
   ArenaHeader *arena_header = nullptr;
+#if HEADERLESS_CELL
+  // no cell header, the arena is aligned to its size rounded up to a power
+  // of two, so masking the pointer leads to the arena header.
+  unsigned int arenaIdx = 0;
+  unsigned int cellSize_wo_header = calcCellSizeAndArenaIndex(size, arenaIdx);
+  uint64_t arena_mask = ~(static_cast<uint64_t>(calcArenaAlignment(cellSize_wo_header)) - 1);
+  arena_header = reinterpret_cast<ArenaHeader*>(reinterpret_cast<uint64_t>(data) & arena_mask);
+#else
+  CellHeader *cell_header = reinterpret_cast<CellHeader*>(data_char - sizeof(CellHeader));
   if (cell_header->mGuard == VALID_CELL_HEADER_MARKER) {
     arena_header = cell_header->mArena;
   }
+#endif  // HEADERLESS_CELL
   if (!arena_header || arena_header->mGuard != VALID_ARENA_HEADER_MARKER) {
-    MY_LOGD("arena_heap = %p, guard=%llu", arena_header, arena_header->mGuard);
+    MY_LOGD("arena_heap = %p is invalid", arena_header);
     return;
   }
 
   // here we have a valid arena header. and we could reset occupy state
-  unsigned int cellSize_w_header = (sizeof(CellHeader) + arena_header->mCellSizeInBytes);
-  unsigned char* cell_start = reinterpret_cast<unsigned char*>(data) - sizeof(CellHeader);
+  unsigned int cellSize_w_header = (CELL_HEADER_SIZE + arena_header->mCellSizeInBytes);
+  unsigned char* cell_start = data_char - CELL_HEADER_SIZE;
   unsigned int bit_position_for_cell = static_cast<unsigned int>((cell_start - arena_header->mArenaStart) / cellSize_w_header);
   unsigned long long bit = ~(1ULL << bit_position_for_cell);
+  if (arena_header->mNumOccupiedCells >= arena_header->mCellCapacity) {
+    // the arena was full, make it available again.
+    ArenaCollection* collection = arena_header->mCollection;
+    arena_header->mNextAvail = collection->mFirstAvail;
+    collection->mFirstAvail = arena_header;
+  }
   arena_header->mOccupationBits &= bit;
   arena_header->mNumOccupiedCells--;
   print(*arena_header);
+  if (arena_header->mNumOccupiedCells == 0) {
+    ArenaCollection* collection = arena_header->mCollection;
+    collection->mNumEmptyArenas++;
+    if (collection->mNumEmptyArenas > MAX_EMPTY_ARENAS) {
+      releaseArena(collection, arena_header);
+    }
+  }
 }
 
 void MemoryPool::shutdown() {
@@ -109,21 +164,48 @@ void MemoryPool::shutdown() {
       continue;
     }
     ArenaHeader* arena_header = collection->mFirst;
-    collection->mFirst = nullptr;
     while (arena_header) {
+      ArenaHeader* next_arena_header = arena_header->mNext;
       if (arena_header->mNumOccupiedCells == 0) {
         // destroy the arena
-        ArenaHeader* next_arena_header = arena_header->mNext;
-        delete(arena_header);
-        arena_header = next_arena_header;
+        releaseArena(collection, arena_header);
       } else {
         // encounter some derelict memory. someone did not deallocate before
-        // shutdown.
+        // shutdown, leave the arena to the user.
         MY_LOGD("meet derelict memory, check user");
       }
+      arena_header = next_arena_header;
     }
     // ensure the terminating arena
+    if (!collection->mFirst) {
+      free(collection);
+      gState.mArenaCollections[i] = nullptr;
+    }
+  }
+}
+
+void MemoryPool::releaseArena(ArenaCollection* collection,
+                              ArenaHeader* arena_header) {
+  // unlink it from both lists, an empty arena is always in the available one
+  ArenaHeader** link = &collection->mFirst;
+  while (*link != arena_header) {
+    link = &(*link)->mNext;
+  }
+  *link = arena_header->mNext;
+  link = &collection->mFirstAvail;
+  while (*link && *link != arena_header) {
+    link = &(*link)->mNextAvail;
   }
+  if (*link) {
+    *link = arena_header->mNextAvail;
+  }
+  collection->mNumArenas--;
+  collection->mNumEmptyArenas--;
+  MY_LOGD("free arena 0x%p, cell size=%u",
+          arena_header, arena_header->mCellSizeInBytes);
+  size_t arena_alignment = calcArenaAlignment(arena_header->mCellSizeInBytes);
+  arena_header->mGuard = 0;
+  ::operator delete(arena_header, std::align_val_t(arena_alignment));
 }
 
 inline unsigned int MemoryPool::calcCellSizeAndArenaIndex(
@@ -149,6 +231,31 @@ MemoryPool::calcCellCapacity(unsigned int cell_size,
                   max_cells_per_arena);
 }
 
+inline size_t
+MemoryPool::calcArenaSize(size_t cellSize_wo_header,
+                          size_t alignment_bytes) {
+  unsigned int cellCapacity = calcCellCapacity(cellSize_wo_header, MAX_ARENA_SIZE, MAX_CELLS_PER_ARENA);
+  return sizeof(ArenaHeader) +
+         alignment_bytes +
+         ((CELL_HEADER_SIZE + cellSize_wo_header) * cellCapacity);
+}
+
+inline size_t
+MemoryPool::calcArenaAlignment(size_t cellSize_wo_header) {
+#if HEADERLESS_CELL
+  // the whole arena must fit in one aligned block for pointer masking
+  size_t arena_size = calcArenaSize(cellSize_wo_header, BYTE_ALIGNMENT);
+  size_t alignment = BYTE_ALIGNMENT;
+  while (alignment < arena_size) {
+    alignment <<= 1;
+  }
+  return alignment;
+#else
+  (void)cellSize_wo_header;
+  return BYTE_ALIGNMENT;
+#endif  // HEADERLESS_CELL
+}
+
 inline MemoryPool::ArenaHeader*
 MemoryPool::allocateArenaOfMemory(size_t cellSize_wo_header,
                                   size_t alignment_bytes,
@@ -158,15 +265,16 @@ MemoryPool::allocateArenaOfMemory(size_t cellSize_wo_header,
 
   unsigned int cellCapacity = calcCellCapacity(cellSize_wo_header, MAX_ARENA_SIZE, MAX_CELLS_PER_ARENA);
   // calculate total size of an arena and allocate memory
-  size_t arena_size = header_size +
-                      alignment_bytes +
-                      ((sizeof(CellHeader) + cellSize_wo_header) * cellCapacity);
+  size_t arena_size = calcArenaSize(cellSize_wo_header, alignment_bytes);
+  size_t arena_alignment = calcArenaAlignment(cellSize_wo_header);
   unsigned char* raw_arena = reinterpret_cast<unsigned char*>(
-      calloc(1, sizeof(arena_size)));
+      ::operator new(arena_size, std::align_val_t(arena_alignment)));
+  memset(raw_arena, 0, arena_size);
   MY_LOGD("allocate a raw_arena, addr=0x%p, size of arena=%zu "
-          "(%zu+%zu+(%zu+%zu)*%u)",
+          "(%zu+%zu+(%zu+%zu)*%u), alignment=%zu",
           raw_arena, arena_size,
-          header_size, alignment_bytes, sizeof(CellHeader), cellSize_wo_header, cellCapacity);
+          header_size, alignment_bytes, CELL_HEADER_SIZE, cellSize_wo_header, cellCapacity,
+          arena_alignment);
   // memset((void*)raw_arena, 0, header_size);
   // set Arena Header
   ArenaHeader *arena_header = reinterpret_cast<ArenaHeader*>(raw_arena);
@@ -185,9 +293,10 @@ MemoryPool::allocateArenaOfMemory(size_t cellSize_wo_header,
                             + header_size
                             + arena_header->mPaddingSizeInBytes;
   arena_header->mArenaEnd = arena_header->mArenaStart
-                          + ((sizeof(CellHeader) + cellSize_wo_header)*cellCapacity)
+                          + ((CELL_HEADER_SIZE + cellSize_wo_header)*cellCapacity)
                           - 1;
   arena_header->mGuard = VALID_ARENA_HEADER_MARKER;
+#if !HEADERLESS_CELL
   // set Cell Header
   for (uint_fast16_t i = 0; i < cellCapacity; ++i) {
     unsigned char* raw_cell_header = arena_header->mArenaStart
@@ -196,6 +305,7 @@ MemoryPool::allocateArenaOfMemory(size_t cellSize_wo_header,
     cell_header->mArena = arena_header;
     cell_header->mGuard = VALID_CELL_HEADER_MARKER;
   }
+#endif  // !HEADERLESS_CELL
   // set Arena Collection
   collection->mNumArenas++;
   return arena_header;
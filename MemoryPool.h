@@ -18,6 +18,11 @@ class MemoryPool {
     unsigned int mNumArenas;
     // pointer to the first arena in the link-list
     ArenaHeader* mFirst;
+    // pointer to the first arena which still has unoccupied cells, arenas
+    // with free cells are chained by ArenaHeader::mNextAvail.
+    ArenaHeader* mFirstAvail;
+    // number of arenas without any occupied cell
+    unsigned int mNumEmptyArenas;
   };
 
   // A contiguous chunk of memory which contains individual cell of memory
@@ -38,8 +43,10 @@ class MemoryPool {
     unsigned char* mArenaStart;
     // point to the last byte of the last cell in the arena.
     unsigned char* mArenaEnd;
-    // the
+    // the next arena in the collection
     ArenaHeader* mNext;
+    // the next arena with unoccupied cells, valid only when not full
+    ArenaHeader* mNextAvail;
     // just occupy 8bytes as a guard
     unsigned long long mGuard;
   };
@@ -87,6 +94,14 @@ class MemoryPool {
   calcCellCapacity(unsigned int cell_size,
                    unsigned int max_arena_size,
                    unsigned int max_cells_per_arena);
+  static size_t
+  calcArenaSize(size_t cellSize_wo_header,
+                size_t alignment_bytes);
+  static size_t
+  calcArenaAlignment(size_t cellSize_wo_header);
+  static void
+  releaseArena(ArenaCollection* collection,
+               ArenaHeader* arena_header);
 
  private:
   static inline void print(const ArenaHeader& in) {
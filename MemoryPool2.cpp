@@ -3,6 +3,7 @@
 #include <cstring>
 #include <memory>
 #include <cassert>
+#include <new>
 
 #include "common.h"
 #define TAG_LOG MemoryPool2
@@ -17,8 +18,8 @@
 // #define VALID_CELL_HEADER_MARKER 0xEEEEFFFFDDDD0123
 
 #define COUNT_NUM_TRAILING_ZEROES_UINT32(bits) __builtin_ctz(bits)
-#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctz(bits)
-#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clzl(bits)
+#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctzll(bits)
+#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clz(bits)
 #define COUNT_NUM_LEADING_ZEROES_UINT64(bits) __builtin_clzll(bits)
 
 #define TO_POW2_UINT32(n)  \
@@ -33,6 +34,19 @@ void* MemoryPool2::allocate(size_t size) {
     MY_LOGD("zero size allocation is not reasonable, return nullptr");
     return nullptr;
   }
+  if (size > MAX_CELL_SIZE) {
+    // too large for any arena, give it a chunk of its own marked as such.
+    CellHeader* cellHeader = reinterpret_cast<CellHeader*>(
+        ::operator new(sizeof(CellHeader) + size, std::nothrow));
+    if (!cellHeader) {
+      MY_LOGD("ERROR, allocate %zu bytes failed", size);
+      return nullptr;
+    }
+    cellHeader->mpArena = nullptr;
+    cellHeader->mGuard = OUTSIDE_SYSTEM_MARKER;
+    MY_LOGD("outside system allocation 0x%p, size=%zu", cellHeader + 1, size);
+    return cellHeader + 1;
+  }
   uint32_t cellSizeNoHeader = 0;
   uint32_t arenaIdx = 0;
   cellSizeNoHeader = callCellSizeAndArenaIdx(size, arenaIdx);
@@ -43,25 +57,21 @@ void* MemoryPool2::allocate(size_t size) {
   GlobalState& state = getGlobalState();
   auto& arenaCollection = state.mArenaCollections[arenaIdx];
 
-  // allocate an arena of memory if there still no allocated memory.
-  auto& arenaHeader = arenaCollection.mRootArena;
+  // take the first arena with unoccupied cells. if all cells are occupied,
+  // allocate another arena and link it in front of the collection.
+  ArenaHeader* arenaHeader = arenaCollection.mAvailArena;
   if (!arenaHeader) {
     // std::unique_lock<std::mutex> _l(state.mMutex);
     arenaHeader = allocateArenaOfMemory(
         cellSizeNoHeader, BYTE_ALIGNMENT, &arenaCollection);
     arenaCollection.mCellSizeInBytes = cellSizeNoHeader;
+    arenaHeader->mNextArena = arenaCollection.mRootArena;
     arenaCollection.mRootArena = arenaHeader;
+    arenaCollection.mAvailArena = arenaHeader;
+    arenaCollection.mNumEmptyArenas++;
   }
-
-  // all cells inside the arena are occupied, allocate another one and use
-  // link-list to make connection.
-  while (arenaHeader->mNumOccupiedCells >= arenaHeader->mCellCapacity) {
-    // std::unique_lock<std::mutex> _l(state.mMutex);
-    if (!arenaHeader->mNextArena) {
-      arenaHeader->mNextArena = allocateArenaOfMemory(
-          cellSizeNoHeader, BYTE_ALIGNMENT, &arenaCollection);
-    }
-    arenaHeader = arenaHeader->mNextArena;
+  if (arenaHeader->mNumOccupiedCells == 0) {
+    arenaCollection.mNumEmptyArenas--;
   }
 
   // an arena with unoccupied cells is found. find the cell and occupy it.
@@ -69,6 +79,11 @@ void* MemoryPool2::allocate(size_t size) {
       static_cast<uint32_t>(COUNT_NUM_TRAILING_ZEROES_UINT64(~arenaHeader->mOccupationBits));
   arenaHeader->mOccupationBits |= (1ULL << cellIndex);
   arenaHeader->mNumOccupiedCells++;
+  if (arenaHeader->mNumOccupiedCells >= arenaHeader->mCellCapacity) {
+    // full arena leaves the available list until one of its cells is freed.
+    arenaCollection.mAvailArena = arenaHeader->mNextAvail;
+    arenaHeader->mNextAvail = nullptr;
+  }
   // unsigned char* ptr =
   //     arenaHeader->mArenaStart +
   //     (cellIndex * (sizeof(CellHeader) + arenaHeader->mCellSizeInBytes)) +
@@ -76,17 +91,19 @@ void* MemoryPool2::allocate(size_t size) {
 
   unsigned char* cellHeader_char =
       arenaHeader->mArenaStart +
-      (cellIndex * (sizeof(CellHeader) + arenaHeader->mCellSizeInBytes));
-  CellHeader* cellHeader = reinterpret_cast<CellHeader*>(cellHeader_char);
-  unsigned char* cellBody_char = cellHeader_char + sizeof(CellHeader);
+      (cellIndex * (CELL_HEADER_SIZE + arenaHeader->mCellSizeInBytes));
+  unsigned char* cellBody_char = cellHeader_char + CELL_HEADER_SIZE;
   {
-    MY_LOGD("return cell[H:p=0x%p/guard=%llX][B:p=0x%p/id:%u/size:%u], occupy(%llX/num=%u(%p)), arena.guard=%llX",
-            cellHeader, cellHeader->mGuard,
+    MY_LOGD("return cell[H:p=0x%p][B:p=0x%p/id:%u/size:%u], occupy(%llX/num=%u(%p)), arena.guard=%llX",
+            cellHeader_char,
             cellBody_char, cellIndex, arenaHeader->mCellSizeInBytes,
             arenaHeader->mOccupationBits, arenaHeader->mNumOccupiedCells,
             std::addressof(arenaHeader->mNumOccupiedCells),
             arenaHeader->mGuard);
+#if !HEADERLESS_CELL
+    CellHeader* cellHeader = reinterpret_cast<CellHeader*>(cellHeader_char);
     assertm(cellHeader->mGuard == VALID_CELL_HEADER_MARKER, "cell guard is wrong");
+#endif  // !HEADERLESS_CELL
     assertm(arenaHeader->mGuard == VALID_ARENA_HEADER_MARKER, "arena guard is wrong");
   }
   return reinterpret_cast<void*>(cellBody_char);
@@ -99,8 +116,29 @@ void MemoryPool2::deallocate(void* data, size_t size) {
   }
 
   // check the cell and arena are both valid
-  GlobalState& state = getGlobalState();
   unsigned char* data_char = reinterpret_cast<unsigned char*>(data);
+  // outside system allocations always carry a header, even without cell
+  // headers, and are the only ones larger than MAX_CELL_SIZE.
+  if (size > MAX_CELL_SIZE) {
+    CellHeader* cellHeader =
+        reinterpret_cast<CellHeader*>(data_char - sizeof(CellHeader));
+    if (cellHeader->mGuard != OUTSIDE_SYSTEM_MARKER) {
+      MY_LOGD("ERROR, 0x%p is not an outside system allocation", data);
+      return;
+    }
+    ::operator delete(cellHeader);
+    return;
+  }
+#if HEADERLESS_CELL
+  // arenas are aligned to their size rounded up to a power of two, masking
+  // the pointer gives the arena header of the size class.
+  uint32_t arenaIdx = 0;
+  uint32_t cellSizeNoHeader = callCellSizeAndArenaIdx(size, arenaIdx);
+  uint64_t arenaMask =
+      ~(static_cast<uint64_t>(calcArenaAlignment(cellSizeNoHeader)) - 1);
+  ArenaHeader* arenaHeader = reinterpret_cast<ArenaHeader*>(
+      reinterpret_cast<uint64_t>(data) & arenaMask);
+#else
   CellHeader* cellHeader =
       reinterpret_cast<CellHeader*>(data_char - sizeof(CellHeader));
   if (cellHeader->mGuard != VALID_CELL_HEADER_MARKER) {
@@ -108,6 +146,7 @@ void MemoryPool2::deallocate(void* data, size_t size) {
     return;
   }
   ArenaHeader* arenaHeader = cellHeader->mpArena;
+#endif  // HEADERLESS_CELL
   if (!arenaHeader || arenaHeader->mGuard != VALID_ARENA_HEADER_MARKER) {
     MY_LOGD("ERROR, arena guard not match");
     return;
@@ -115,16 +154,29 @@ void MemoryPool2::deallocate(void* data, size_t size) {
 
   // reset occupy status of the cell
   uint32_t cellSizeWithHeader =
-      sizeof(CellHeader) + arenaHeader->mCellSizeInBytes;
-  unsigned char* cellStart = data_char - sizeof(CellHeader);
+      CELL_HEADER_SIZE + arenaHeader->mCellSizeInBytes;
+  unsigned char* cellStart = data_char - CELL_HEADER_SIZE;
   uint32_t bitPosOfCell =
       static_cast<uint32_t>((cellStart - arenaHeader->mArenaStart) / cellSizeWithHeader);
   uint64_t bit = ~(1ULL << bitPosOfCell);
+  if (arenaHeader->mNumOccupiedCells >= arenaHeader->mCellCapacity) {
+    // the arena was full, put it back to the available list.
+    ArenaCollection* collection = arenaHeader->mpCollection;
+    arenaHeader->mNextAvail = collection->mAvailArena;
+    collection->mAvailArena = arenaHeader;
+  }
   arenaHeader->mOccupationBits &= bit;
   arenaHeader->mNumOccupiedCells--;
   MY_LOGD("user(data=0x%p/size=%zu), cell[header_ptr=0x%x], occupy(%llX/num=%u)",
           data, size, cellStart,
           arenaHeader->mOccupationBits, arenaHeader->mNumOccupiedCells);
+  if (arenaHeader->mNumOccupiedCells == 0) {
+    ArenaCollection* collection = arenaHeader->mpCollection;
+    collection->mNumEmptyArenas++;
+    if (collection->mNumEmptyArenas > MAX_EMPTY_ARENAS) {
+      releaseArena(collection, arenaHeader);
+    }
+  }
 }
 
 void MemoryPool2::shutdown() {
@@ -135,13 +187,41 @@ void MemoryPool2::shutdown() {
     while (arenaHeader) {
       ArenaHeader* temp = arenaHeader;
       arenaHeader = arenaHeader->mNextArena;
-      size_t heapSize = temp->mArenaSizeInBytes;
-      // ::operator delete(temp);
-      temp = nullptr;
+      if (temp->mNumOccupiedCells == 0) {
+        releaseArena(&collection, temp);
+      } else {
+        // someone did not deallocate before shutdown, leave it to the user.
+        MY_LOGD("ERROR, derelict arena 0x%p, %u cells still occupied",
+                temp, temp->mNumOccupiedCells);
+      }
     }
   }
   MY_LOGD("----");
 }
+
+void MemoryPool2::releaseArena(ArenaCollection* collection,
+                               ArenaHeader* arenaHeader) {
+  // unlink it from both lists, an empty arena is always in the available one
+  ArenaHeader** link = &collection->mRootArena;
+  while (*link != arenaHeader) {
+    link = &(*link)->mNextArena;
+  }
+  *link = arenaHeader->mNextArena;
+  link = &collection->mAvailArena;
+  while (*link && *link != arenaHeader) {
+    link = &(*link)->mNextAvail;
+  }
+  if (*link) {
+    *link = arenaHeader->mNextAvail;
+  }
+  collection->mNumArenas--;
+  collection->mNumEmptyArenas--;
+  MY_LOGD("free arena 0x%p, size=%zu", arenaHeader,
+          arenaHeader->mArenaSizeInBytes);
+  size_t arenaAlignment = arenaHeader->mArenaAlignment;
+  arenaHeader->mGuard = 0;
+  ::operator delete(arenaHeader, std::align_val_t(arenaAlignment));
+}
 uint32_t MemoryPool2::callCellSizeAndArenaIdx(
     size_t allocSize, uint32_t& arenaIdx) {
   if (allocSize < BYTE_ALIGNMENT) {
@@ -165,23 +245,24 @@ MemoryPool2::ArenaHeader* MemoryPool2::allocateArenaOfMemory(
   uint32_t cellCapacity = calcCellCapacity(cellSizeNoHeader, MAX_ARENA_SIZE,
                                            MAX_CELLS_PER_ARENA);
   // calculate total size of arena and allocate it.
-  size_t arenaSize =
-      headerSize + byte_alignment +
-      ((sizeof(CellHeader) + cellSizeNoHeader) * cellCapacity);
-  unsigned char* rawArena =
-      reinterpret_cast<unsigned char*>(calloc(1, sizeof(arenaSize)));
+  size_t arenaSize = calcArenaSize(cellSizeNoHeader, byte_alignment);
+  size_t arenaAlignment = calcArenaAlignment(cellSizeNoHeader);
+  unsigned char* rawArena = reinterpret_cast<unsigned char*>(
+      ::operator new(arenaSize, std::align_val_t(arenaAlignment), std::nothrow));
   if (rawArena == nullptr) {
-    MY_LOGD("ERROR: calloc failed");
+    MY_LOGD("ERROR: allocate arena failed");
+    return nullptr;
   }
-  MY_LOGD("allocate arena of memory size: %zu+%zu+(%zu+%zu)*%u=%u "
-          "arena addr:0x%p - 0x%p",
-          headerSize, byte_alignment, sizeof(CellHeader),
+  memset(rawArena, 0, arenaSize);
+  MY_LOGD("allocate arena of memory size: %zu+%zu+(%zu+%zu)*%u=%zu "
+          "arena addr:0x%p - 0x%p, alignment=%zu",
+          headerSize, byte_alignment, CELL_HEADER_SIZE,
           cellSizeNoHeader, cellCapacity, arenaSize,
-          rawArena, rawArena+arenaSize);
+          rawArena, rawArena+arenaSize, arenaAlignment);
   // inplacement new ArenaHeader
   ArenaHeader* arenaHeader = reinterpret_cast<ArenaHeader*>(rawArena);
   arenaHeader->mpCollection = collection;
-  arenaHeader->mCellCapacity = reinterpret_cast<uint32_t>(cellCapacity);
+  arenaHeader->mCellCapacity = static_cast<uint32_t>(cellCapacity);
   arenaHeader->mCellSizeInBytes = static_cast<uint32_t>(cellSizeNoHeader);
 
   // calculate padding size
@@ -196,13 +277,16 @@ MemoryPool2::ArenaHeader* MemoryPool2::allocateArenaOfMemory(
   arenaHeader->mOccupationBits = 0;
   arenaHeader->mNumOccupiedCells = 0;
   arenaHeader->mArenaSizeInBytes = arenaSize;
+  arenaHeader->mArenaAlignment = arenaAlignment;
   arenaHeader->mArenaStart = rawArena + headerSize + arenaHeader->mPaddingSizeInBytes;
   arenaHeader->mArenaEnd =
       arenaHeader->mArenaStart +
-      ((sizeof(CellHeader) + cellSizeNoHeader) * cellCapacity) - 1;
+      ((CELL_HEADER_SIZE + cellSizeNoHeader) * cellCapacity) - 1;
   arenaHeader->mNextArena = nullptr;
+  arenaHeader->mNextAvail = nullptr;
   arenaHeader->mGuard = VALID_ARENA_HEADER_MARKER;
 
+#if !HEADERLESS_CELL
   // set CellHeader
   for (uint32_t i = 0; i < cellCapacity; ++i) {
     unsigned char* rawCell =
@@ -211,6 +295,7 @@ MemoryPool2::ArenaHeader* MemoryPool2::allocateArenaOfMemory(
     cellHeader->mpArena = arenaHeader;
     cellHeader->mGuard = VALID_CELL_HEADER_MARKER;
   }
+#endif  // !HEADERLESS_CELL
 
   // update cellection
   collection->mNumArenas++;
@@ -218,6 +303,29 @@ MemoryPool2::ArenaHeader* MemoryPool2::allocateArenaOfMemory(
 }
 
 
+size_t MemoryPool2::calcArenaSize(
+    size_t cellSizeNoHeader, size_t byte_alignment) {
+  uint32_t cellCapacity = calcCellCapacity(cellSizeNoHeader, MAX_ARENA_SIZE,
+                                           MAX_CELLS_PER_ARENA);
+  return sizeof(ArenaHeader) + byte_alignment +
+         ((CELL_HEADER_SIZE + cellSizeNoHeader) * cellCapacity);
+}
+
+size_t MemoryPool2::calcArenaAlignment(size_t cellSizeNoHeader) {
+#if HEADERLESS_CELL
+  // the whole arena must fit in one aligned block for pointer masking
+  size_t arenaSize = calcArenaSize(cellSizeNoHeader, BYTE_ALIGNMENT);
+  size_t alignment = BYTE_ALIGNMENT;
+  while (alignment < arenaSize) {
+    alignment <<= 1;
+  }
+  return alignment;
+#else
+  (void)cellSizeNoHeader;
+  return BYTE_ALIGNMENT;
+#endif  // HEADERLESS_CELL
+}
+
 inline uint32_t
 MemoryPool2::calcCellCapacity(
     uint32_t cellSize, uint32_t maxArenaSize, uint32_t maxCellsPerArena) {
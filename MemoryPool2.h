@@ -5,8 +5,8 @@
 #define TAG_LOG MemoryPool2
 
 #define COUNT_NUM_TRAILING_ZEROES_UINT32(bits) __builtin_ctz(bits)
-#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctz(bits)
-#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clzl(bits)
+#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctzll(bits)
+#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clz(bits)
 #define COUNT_NUM_LEADING_ZEROES_UINT64(bits) __builtin_clzll(bits)
 
 class MemoryPool2 {
@@ -15,6 +15,9 @@ class MemoryPool2 {
   const static uint32_t MAX_CELL_SIZE_POW2_BASE = 23;
   const static uint64_t MAX_CELL_SIZE = 1ULL << 23;
   const static uint64_t MAX_ARENA_SIZE = 1ULL << 23;
+  // empty arenas kept per collection before freeing one, hysteresis for a
+  // size class hovering around an arena boundary.
+  const static uint32_t MAX_EMPTY_ARENAS = 1;
   const static uint64_t OUTSIDE_SYSTEM_MARKER = 0x0123ABCD0123ABCD;
   const static uint64_t VALID_CELL_HEADER_MARKER = 0xEEEEFFFFDDDD0123;
   const static uint64_t VALID_ARENA_HEADER_MARKER = 0x0123ABCD0123ABCD;
@@ -29,6 +32,9 @@ class MemoryPool2 {
     uint32_t mNumArenas = 0;
     // std::mutex mMutex;
     ArenaHeader* mRootArena = nullptr;
+    // arenas with unoccupied cells, chained by ArenaHeader::mNextAvail
+    ArenaHeader* mAvailArena = nullptr;
+    uint32_t mNumEmptyArenas = 0;
   };
 
   struct ArenaHeader {
@@ -38,10 +44,12 @@ class MemoryPool2 {
     uint64_t mOccupationBits = 0;
     uint32_t mNumOccupiedCells = 0;
     size_t mArenaSizeInBytes = 0;  // for free memory
+    size_t mArenaAlignment = 0;  // for free memory
     unsigned char* mArenaStart = nullptr;
     unsigned char* mArenaEnd = nullptr;
     ArenaCollection* mpCollection = nullptr;
     ArenaHeader* mNextArena = nullptr;
+    ArenaHeader* mNextAvail = nullptr;
     uint64_t mGuard = VALID_ARENA_HEADER_MARKER;
   };
 
@@ -49,6 +57,9 @@ class MemoryPool2 {
     ArenaHeader* mpArena = nullptr;
     uint64_t mGuard = VALID_CELL_HEADER_MARKER;
   };
+  // headerless cells are packed back-to-back, see HEADERLESS_CELL
+  const static size_t CELL_HEADER_SIZE =
+      HEADERLESS_CELL ? 0 : sizeof(CellHeader);
 
   struct GlobalState {
     GlobalState() = default;
@@ -74,5 +85,10 @@ class MemoryPool2 {
   static uint32_t calcCellCapacity(
       uint32_t cellSizeNoHeader, uint32_t maxArenaSize,
       uint32_t maxCellsPerArena);
+  static size_t calcArenaSize(
+      size_t cellSizeNoHeader, size_t byte_alignment);
+  static size_t calcArenaAlignment(size_t cellSizeNoHeader);
+  static void releaseArena(ArenaCollection* collection,
+                           ArenaHeader* arenaHeader);
 };
 
@@ -27,9 +27,9 @@ void* MemoryPool3::allocate(size_t size) {
   // std::unique_lock<std::mutex> _l(state.sMutex);
   auto &dataInfo = state.map[size];
   if (!dataInfo.mMemory) {
-    size_t mem_size = static_cast<size_t>(dataInfo.mCellSizeInBytes * CELL_NUMS);
     // set data info
     dataInfo.mCellSizeInBytes = size;
+    size_t mem_size = static_cast<size_t>(dataInfo.mCellSizeInBytes * CELL_NUMS);
     dataInfo.mOccupationBits = 0;
     dataInfo.mNumOccupiedCells = 0;
     dataInfo.mMemory = std::make_unique<uint8_t[]>(mem_size);
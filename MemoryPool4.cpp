@@ -4,13 +4,16 @@
 #include <memory>
 #include <cassert>
 #include <sstream>
+#include <algorithm>
+#include <new>
 
 #include "common.h"
+#include "PoolTrace.h"
 #define TAG_LOG MemoryPool4
 
 #define COUNT_NUM_TRAILING_ZEROES_UINT32(bits) __builtin_ctz(bits)
-#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctz(bits)
-#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clzl(bits)
+#define COUNT_NUM_TRAILING_ZEROES_UINT64(bits) __builtin_ctzll(bits)
+#define COUNT_NUM_LEADING_ZEROES_UINT32(bits) __builtin_clz(bits)
 #define COUNT_NUM_LEADING_ZEROES_UINT64(bits) __builtin_clzll(bits)
 
 #define TO_POW2_UINT32(n)  \
@@ -19,95 +22,163 @@
   n == 1 ? 1 : 1 << (64 - COUNT_NUM_LEADING_ZEROES_UINT64(n-1));
 
 
-const char* getTid() {
-  auto myid = std::this_thread::get_id();
-  std::stringstream ss;
-  ss << myid;
-  // std::string mystring = ss.str();
-  return ss.str().c_str();
+// index of size class <-> its cell body size, see GlobalMemPool
+static constexpr uint32_t calcSizeClass(size_t size) {
+  if (size <= 32) {
+    return size == 0 ? 0 : static_cast<uint32_t>((size - 1) >> 3);
+  }
+  // e = log2 of the power of two below size, the 2 bits after it pick one
+  // of the 4 classes of the doubling.
+  uint32_t e = 63 - COUNT_NUM_LEADING_ZEROES_UINT64(size - 1);
+  return static_cast<uint32_t>((e - 5) * 4 + ((size - 1) >> (e - 2)));
+}
+
+static constexpr uint32_t calcSizeOfClass(uint32_t sizeClass) {
+  if (sizeClass < 4) {
+    return (sizeClass + 1) << 3;
+  }
+  uint32_t e = (sizeClass >> 2) + 4;
+  return (1u << e) + (((sizeClass & 3) + 1) << (e - 2));
+}
+
+struct SizeClassTable {
+  constexpr SizeClassTable() : mSmallClass(), mClassSize() {
+    for (size_t i = 0; i < mSmallClass.size(); ++i) {
+      mSmallClass[i] = static_cast<uint8_t>(calcSizeClass(i << 3));
+    }
+    for (uint32_t i = 0; i < mClassSize.size(); ++i) {
+      mClassSize[i] = calcSizeOfClass(i);
+    }
+  }
+  // size class of (size + 7) / 8 for sizes up to SMALL_SIZE_LIMIT
+  std::array<uint8_t, (1024 >> 3) + 1> mSmallClass;
+  std::array<uint32_t, 72> mClassSize;
 };
+static constexpr SizeClassTable sSizeClassTable;
 
+static size_t roundUpPow2(size_t n) {
+  size_t pow2 = 1;
+  while (pow2 < n) {
+    pow2 <<= 1;
+  }
+  return pow2;
+}
+
+// offset of the first cell in an arena, past the header and leaf words.
+static inline size_t calcCellStartOffset(uint32_t leafCount) {
+  const size_t alignment = MemoryPool4::CELL_START_ALIGNMENT;
+  return (sizeof(MemoryPool4::ArenaHeader) + sizeof(uint64_t) * leafCount +
+          alignment - 1) & ~(alignment - 1);
+}
 
 AllocInfo::AllocInfo(uint32_t cellBodySize,
-                     uint32_t maxCellCountPerArena)
-  : mCellBodySize(cellBodySize)
+                     uint32_t maxCellCountPerArena,
+                     bool headerless,
+                     BackingStore* backingStore,
+                     bool alignedArena)
+  : mCellBodySize((cellBodySize + MemoryPool4::BYTE_ALIGNMENT - 1) &
+                  ~(MemoryPool4::BYTE_ALIGNMENT - 1))
   , mMaxCellCountPerArena(
       calcMaxCellCountPerArena(mCellBodySize, maxCellCountPerArena))
-  , mInvalidCellIdx(mMaxCellCountPerArena)
-  , mFullCellBit((1UL << mMaxCellCountPerArena) - 1)
-  , mInvalidOccupyBit((1UL << mMaxCellCountPerArena)) {}
+  , mLeafCount((mMaxCellCountPerArena + sCellsPerLeaf - 1) / sCellsPerLeaf)
+  , mLastLeafInitBits(
+      (mMaxCellCountPerArena % sCellsPerLeaf) ?
+      ~((1ULL << (mMaxCellCountPerArena % sCellsPerLeaf)) - 1) : 0)
+  , mSummaryInitBits(
+      (mLeafCount % sMaxLeafCount) ?
+      ~((1ULL << (mLeafCount % sMaxLeafCount)) - 1) : 0)
+  , mHeaderless(headerless)
+  , mAlignedArena(headerless || alignedArena)
+  , mCellStride(static_cast<uint32_t>(
+      (headerless ? 0 : sizeof(MemoryPool4::CellHeader)) + mCellBodySize))
+  , mArenaSize(calcCellStartOffset(mLeafCount)
+               + static_cast<size_t>(mCellStride) * mMaxCellCountPerArena)
+  , mArenaAlignment(mAlignedArena ? roundUpPow2(mArenaSize) :
+                    alignof(MemoryPool4::ArenaHeader))
+  , mpBackingStore(backingStore) {}
 
 uint32_t AllocInfo::calcMaxCellCountPerArena(uint32_t cellBodySize,
                                              uint32_t countPerArena) {
   uint32_t size_align8 = (cellBodySize + 7) & (~7);
-  return ((size_align8 * countPerArena) / sMinMemoryChunk) > 0 ?
-          countPerArena : (sMinMemoryChunk / cellBodySize);
+  uint32_t count = ((size_align8 * countPerArena) / sMinMemoryChunk) > 0 ?
+                   countPerArena : (sMinMemoryChunk / cellBodySize);
+  return std::min(std::max(count, 1u), sMaxCellCountPerArena);
 }
 
 void* MemoryPool4::allocate(const AllocInfo& info,
                             ArenaCollection& collection) {
-  // double-checked lock pattern - avoid allocate twice.
-  if (!collection.mRootArena) {
-    std::unique_lock<std::mutex> _l(collection.mMutex);
-    if (!collection.mRootArena) {
-      collection.mRootArena = allocateArenaOfMemory(info, collection);
-      collection.mCellBodySize = info.mCellBodySize;
-      collection.mNumArenas++;
-    }
-  }
-
   ArenaHeader* arenaHeader =
-      reinterpret_cast<ArenaHeader*>(collection.mRootArena.get());
-  uint32_t cellIdx = info.mInvalidCellIdx;
-  uint32_t oldOccupyBit = info.mInvalidOccupyBit;
-  uint32_t newOccupyBit = info.mInvalidCellIdx;
-  do {
-    oldOccupyBit = arenaHeader->mOccupationBits.load(std::memory_order_acquire);
-
-    // all cells inside the arena are occupied, allocate another one and use
-    // link-list to make connection.
-    while (oldOccupyBit == info.mFullCellBit) {
-      if (!arenaHeader->mNextArena) {
-        std::unique_lock<std::mutex> _l(collection.mMutex);
-        if (!arenaHeader->mNextArena) {
-          arenaHeader->mNextArena = allocateArenaOfMemory(info, collection);
-        }
-        arenaHeader =
-            reinterpret_cast<ArenaHeader*>(collection.mRootArena.get());
-        oldOccupyBit = 0;
+      collection.mpAvailArena.load(std::memory_order_acquire);
+  uint32_t cellIdx = info.mMaxCellCountPerArena;
+  uint64_t newOccupyBit = FULL_OCCUPY_BITS;
+  bool claimed = false;
+  uint32_t casRetries = 0;
+  while (!claimed) {
+    uint64_t fullLeafBits = FULL_OCCUPY_BITS;
+    if (arenaHeader) {
+      fullLeafBits = arenaHeader->mFullLeafBits.load(std::memory_order_acquire);
+    }
+    // the available arena is full (or not created yet), switch to another
+    // one with free cells instead of walking the whole arena chain.
+    if (fullLeafBits == FULL_OCCUPY_BITS) {
+      arenaHeader = refillAvailArena(info, collection, arenaHeader);
+      if (!arenaHeader) {
+        return nullptr;
       }
+      continue;
     }
 
-    cellIdx = COUNT_NUM_TRAILING_ZEROES_UINT32(~oldOccupyBit);
-    newOccupyBit = oldOccupyBit | (1UL << cellIdx);
+    // the summary word points to a leaf with free cells, claim one of them.
+    uint32_t leafIdx = COUNT_NUM_TRAILING_ZEROES_UINT64(~fullLeafBits);
+    std::atomic<uint64_t>& leaf = arenaHeader->getOccupationBits()[leafIdx];
+    uint64_t oldOccupyBit = leaf.load(std::memory_order_acquire);
+    while (oldOccupyBit != FULL_OCCUPY_BITS) {
+      uint32_t bitIdx = COUNT_NUM_TRAILING_ZEROES_UINT64(~oldOccupyBit);
+      newOccupyBit = oldOccupyBit | (1ULL << bitIdx);
+      if (leaf.compare_exchange_weak(oldOccupyBit, newOccupyBit,
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+        cellIdx = leafIdx * AllocInfo::sCellsPerLeaf + bitIdx;
+        claimed = true;
+        break;
+      }
+      casRetries++;
+    }
 #ifdef DEBUG_ENABLE
-    assertm(cellIdx != INVALID_CELL_INDEX, "invalid cell index");
-    assertm(oldOccupyBit | INVALID_OCCUPY_BIT, "invalid old occupy bit");
-    assertm(newOccupyBit | INVALID_OCCUPY_BIT, "invalid old occupy bit");
+    assertm(!claimed || cellIdx < arenaHeader->mCellCapacity,
+            "invalid cell index");
 #endif  // DEBUG_ENABLE
-  } while (!arenaHeader->mOccupationBits.compare_exchange_weak(
-            oldOccupyBit, newOccupyBit, std::memory_order_release));
-
-  // now we get a valid cell index
-  unsigned char* cellHeader_char =
-      arenaHeader->mCellStart +
-      (CellHeaderSize + arenaHeader->mCellBodySize) * cellIdx;
-  CellHeader* cellHeader = reinterpret_cast<CellHeader*>(cellHeader_char);
-  unsigned char* cellBody_char = cellHeader_char + CellHeaderSize;
-  MY_LOGI(" %d return cell[id=%u/size=%u][Header:p=0x%p][Body:p=0x%p] "
-          "occupy(0x%lX/nums=%u)",
-          getTid(), cellIdx, arenaHeader->mCellBodySize, cellHeader, cellBody_char,
-          newOccupyBit, arenaHeader->getNumOccupiedCells());
+    // we took the last cell of the leaf, or the summary word is stale.
+    if (newOccupyBit == FULL_OCCUPY_BITS || !claimed) {
+      markLeafFull(arenaHeader, leafIdx);
+    }
+  }
+  if (casRetries && collection.mpStats) {
+    collection.mpStats->add(PoolStats::CAS_RETRIES, casRetries);
+  }
+
+  // now we get a valid cell index, the body follows the optional header.
+  unsigned char* cellBody_char = getCellBody(arenaHeader, cellIdx);
+  POOL_TRACE_EVENT(PoolTrace::ALLOCATE, arenaHeader->mCellBodySize, cellIdx,
+                   cellBody_char);
 #ifdef DEBUG_ENABLE
-  assertm(cellHeader->mGuard == VALID_CELL_HEADER_MARKER, "cell guard is wrong");
+  if (!info.mHeaderless) {
+    CellHeader* cellHeader = reinterpret_cast<CellHeader*>(
+        cellBody_char - (arenaHeader->mCellStride - arenaHeader->mCellBodySize));
+    assertm(cellHeader->mGuard == VALID_CELL_HEADER_MARKER, "cell guard is wrong");
+  }
   assertm(arenaHeader->mGuard == VALID_ARENA_HEADER_MARKER, "arena guard is wrong");
 #endif  // DEBUG_ENABLE
   return reinterpret_cast<void*>(cellBody_char);
 }
 
-void MemoryPool4::deallocate(void* p, size_t size) {
+void MemoryPool4::deallocate(void* p, size_t /*size*/) {
   unsigned char* p_char = reinterpret_cast<unsigned char*>(p);
   CellHeader* cellHeader = reinterpret_cast<CellHeader*>(p_char - CellHeaderSize);
+  if (cellHeader->mGuard == OUTSIDE_SYSTEM_MARKER) {
+    MY_LOGD("ERROR, 0x%p is a large allocation of GlobalMemPool", p);
+    return;
+  }
   if (cellHeader->mGuard != VALID_CELL_HEADER_MARKER) {
     MY_LOGD("ERROR, cell guard not match");
     return;
@@ -117,82 +188,637 @@ void MemoryPool4::deallocate(void* p, size_t size) {
     MY_LOGD("ERROR, arena guard not match");
     return;
   }
+  releaseCell(arenaHeader, p_char - CellHeaderSize);
+}
 
-  uint32_t cellFullSize = CellHeaderSize + arenaHeader->mCellBodySize;
-  unsigned char* cellHeader_char = p_char - CellHeaderSize;
-  uint32_t bitPosOfCell = static_cast<uint32_t>((cellHeader_char - arenaHeader->mCellStart) / cellFullSize);
-  uint32_t bit = ~(1UL << bitPosOfCell);
-  arenaHeader->mOccupationBits &= bit;
-  {
-    uint32_t occupyBit = arenaHeader->mOccupationBits.load(std::memory_order_acquire);
-    MY_LOGI(" %d user(data=0x%p/size=%zu), cell[header_ptr=0x%p/id=%lu], occupy(0x%lX/num=%u)",
-            getTid(), p, size, cellHeader_char, bitPosOfCell,
-            occupyBit, arenaHeader->getNumOccupiedCells());
+void MemoryPool4::deallocate(const AllocInfo& info, void* p) {
+  if (!info.mAlignedArena) {
+    deallocate(p, info.mCellBodySize);
+    return;
+  }
+  unsigned char* cell = nullptr;
+  ArenaHeader* arenaHeader = findArena(info, p, cell);
+  if (!arenaHeader) {
+    return;
+  }
+  releaseCell(arenaHeader, cell);
+}
+
+// the lowest `count` free bits of a leaf.
+static inline uint64_t lowestFreeBits(uint64_t occupyBits, size_t count) {
+  uint64_t freeBits = ~occupyBits;
+  if (count >= AllocInfo::sCellsPerLeaf) {
+    return freeBits;
+  }
+  uint64_t bits = 0;
+  for (; freeBits && count > 0; --count) {
+    uint64_t lowest = freeBits & (0 - freeBits);
+    bits |= lowest;
+    freeBits ^= lowest;
   }
+  return bits;
+}
+
+size_t MemoryPool4::allocateBulk(const AllocInfo& info,
+                                 ArenaCollection& collection,
+                                 void** out, size_t count) {
+  ArenaHeader* arenaHeader =
+      collection.mpAvailArena.load(std::memory_order_acquire);
+  size_t claimedCount = 0;
+  uint32_t casRetries = 0;
+  while (claimedCount < count) {
+    uint64_t fullLeafBits = FULL_OCCUPY_BITS;
+    if (arenaHeader) {
+      fullLeafBits = arenaHeader->mFullLeafBits.load(std::memory_order_acquire);
+    }
+    if (fullLeafBits == FULL_OCCUPY_BITS) {
+      arenaHeader = refillAvailArena(info, collection, arenaHeader);
+      if (!arenaHeader) {
+        break;
+      }
+      continue;
+    }
+
+    // same as allocate(), but take as many free bits of the leaf as needed
+    // with one CAS.
+    uint32_t leafIdx = COUNT_NUM_TRAILING_ZEROES_UINT64(~fullLeafBits);
+    std::atomic<uint64_t>& leaf = arenaHeader->getOccupationBits()[leafIdx];
+    uint64_t oldOccupyBit = leaf.load(std::memory_order_acquire);
+    uint64_t claimedBits = 0;
+    while (oldOccupyBit != FULL_OCCUPY_BITS) {
+      uint64_t bits = lowestFreeBits(oldOccupyBit, count - claimedCount);
+      if (leaf.compare_exchange_weak(oldOccupyBit, oldOccupyBit | bits,
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire)) {
+        claimedBits = bits;
+        break;
+      }
+      casRetries++;
+    }
+    if (!claimedBits || (oldOccupyBit | claimedBits) == FULL_OCCUPY_BITS) {
+      markLeafFull(arenaHeader, leafIdx);
+    }
+#if POOL_TRACE
+    if (claimedBits) {
+      const uint32_t cellIdx = leafIdx * AllocInfo::sCellsPerLeaf +
+                               COUNT_NUM_TRAILING_ZEROES_UINT64(claimedBits);
+      PoolTrace::record(PoolTrace::ALLOCATE_BULK, info.mCellBodySize, cellIdx,
+                        getCellBody(arenaHeader, cellIdx),
+                        __builtin_popcountll(claimedBits));
+    }
+#endif  // POOL_TRACE
+    while (claimedBits) {
+      uint32_t bitIdx = COUNT_NUM_TRAILING_ZEROES_UINT64(claimedBits);
+      claimedBits &= claimedBits - 1;
+      out[claimedCount++] = getCellBody(
+          arenaHeader, leafIdx * AllocInfo::sCellsPerLeaf + bitIdx);
+    }
+  }
+  if (casRetries && collection.mpStats) {
+    collection.mpStats->add(PoolStats::CAS_RETRIES, casRetries);
+  }
+  MY_LOGD("claimed %zu/%zu cells of size %u",
+          claimedCount, count, info.mCellBodySize);
+  return claimedCount;
+}
+
+void MemoryPool4::deallocateBulk(const AllocInfo& info,
+                                 void** data, size_t count) {
+  // the cells of a leaf are neighbours in memory, sorted by address they
+  // come in runs which are released together.
+  std::sort(data, data + count);
+  ArenaHeader* runArena = nullptr;
+  uint32_t runLeafIdx = 0;
+  uint64_t runBits = 0;
+  for (size_t i = 0; i < count; ++i) {
+    unsigned char* cell = nullptr;
+    ArenaHeader* arenaHeader = data[i] ? findArena(info, data[i], cell) :
+                                         nullptr;
+    if (!arenaHeader) {
+      continue;
+    }
+    uint32_t bitPosOfCell = static_cast<uint32_t>(
+        (cell - arenaHeader->mCellStart) / arenaHeader->mCellStride);
+    uint32_t leafIdx = bitPosOfCell / AllocInfo::sCellsPerLeaf;
+    if (arenaHeader != runArena || leafIdx != runLeafIdx) {
+      if (runBits) {
+        releaseCells(runArena, runLeafIdx, runBits);
+      }
+      runArena = arenaHeader;
+      runLeafIdx = leafIdx;
+      runBits = 0;
+    }
+    runBits |= 1ULL << (bitPosOfCell % AllocInfo::sCellsPerLeaf);
+  }
+  if (runBits) {
+    releaseCells(runArena, runLeafIdx, runBits);
+  }
+}
+
+MemoryPool4::ArenaHeader* MemoryPool4::findArena(const AllocInfo& info,
+                                                 void* p,
+                                                 unsigned char*& cell) {
+  if (!info.mAlignedArena) {
+    cell = reinterpret_cast<unsigned char*>(p) - CellHeaderSize;
+    CellHeader* cellHeader = reinterpret_cast<CellHeader*>(cell);
+    if (cellHeader->mGuard != VALID_CELL_HEADER_MARKER) {
+      MY_LOGD("ERROR, cell guard not match");
+      return nullptr;
+    }
+    ArenaHeader* arenaHeader = cellHeader->mpArena;
+    if (!arenaHeader || arenaHeader->mGuard != VALID_ARENA_HEADER_MARKER) {
+      MY_LOGD("ERROR, arena guard not match");
+      return nullptr;
+    }
+    return arenaHeader;
+  }
+  // arenas are aligned to mArenaAlignment, masking any cell pointer of an
+  // arena leads to its header. the size class is trusted, the guards are
+  // only read by debug builds so a free touches no cold header line.
+  uintptr_t arenaMask = ~(static_cast<uintptr_t>(info.mArenaAlignment) - 1);
+  ArenaHeader* arenaHeader = reinterpret_cast<ArenaHeader*>(
+      reinterpret_cast<uintptr_t>(p) & arenaMask);
+  cell = reinterpret_cast<unsigned char*>(p) -
+         (info.mHeaderless ? 0 : CellHeaderSize);
+#ifdef DEBUG_ENABLE
+  assertm(arenaHeader->mGuard == VALID_ARENA_HEADER_MARKER,
+          "arena guard is wrong");
+  assertm(info.mHeaderless || reinterpret_cast<CellHeader*>(cell)->mGuard ==
+          VALID_CELL_HEADER_MARKER, "cell guard is wrong");
+  assertm(arenaHeader->mCellBodySize == info.mCellBodySize,
+          "cell freed with the wrong size");
+#endif  // DEBUG_ENABLE
+  return arenaHeader;
+}
+
+const MemoryPool4::ArenaCollection* MemoryPool4::getCollection(
+    const AllocInfo& info, void* data) {
+  unsigned char* cell = nullptr;
+  ArenaHeader* arenaHeader = findArena(info, data, cell);
+  return arenaHeader ? arenaHeader->mpCollection : nullptr;
+}
+
+unsigned char* MemoryPool4::getCellBody(ArenaHeader* arenaHeader,
+                                        uint32_t cellIdx) {
+  return arenaHeader->mCellStart + arenaHeader->mCellStride * cellIdx +
+      (arenaHeader->mCellStride - arenaHeader->mCellBodySize);
+}
+
+void MemoryPool4::releaseCell(ArenaHeader* arenaHeader, unsigned char* cell) {
+  uint32_t bitPosOfCell = static_cast<uint32_t>(
+      (cell - arenaHeader->mCellStart) / arenaHeader->mCellStride);
+  uint32_t leafIdx = bitPosOfCell / AllocInfo::sCellsPerLeaf;
+  releaseCells(arenaHeader, leafIdx,
+               1ULL << (bitPosOfCell % AllocInfo::sCellsPerLeaf));
+}
 
+void MemoryPool4::releaseCells(ArenaHeader* arenaHeader, uint32_t leafIdx,
+                               uint64_t bits) {
+  std::atomic<uint64_t>& leaf = arenaHeader->getOccupationBits()[leafIdx];
+  uint64_t oldOccupyBit = leaf.fetch_and(~bits);
+  if (oldOccupyBit == FULL_OCCUPY_BITS) {
+    markLeafNotFull(arenaHeader, leafIdx);
+  }
+#if POOL_TRACE
+  const uint32_t cellIdx = leafIdx * AllocInfo::sCellsPerLeaf +
+                           COUNT_NUM_TRAILING_ZEROES_UINT64(bits);
+  const uint32_t count = __builtin_popcountll(bits);
+  PoolTrace::record(count == 1 ? PoolTrace::DEALLOCATE :
+                                 PoolTrace::DEALLOCATE_BULK,
+                    arenaHeader->mCellBodySize, cellIdx,
+                    getCellBody(arenaHeader, cellIdx), count);
+#endif  // POOL_TRACE
 #ifdef DEBUG_ENABLE
-  assertm(cellHeader->mGuard == VALID_CELL_HEADER_MARKER, "cell guard is wrong");
   assertm(arenaHeader->mGuard == VALID_ARENA_HEADER_MARKER, "arena guard is wrong");
 #endif  // DEBUG_ENABLE
 }
 
-std::unique_ptr<uint8_t[]> MemoryPool4::allocateArenaOfMemory(
-    const AllocInfo& info, const ArenaCollection& collection) {
-  size_t memSize = ArenaHeaderSize
-                  + (CellHeaderSize + info.mCellBodySize) * MAX_CELLS_PER_ARENA;
-  std::unique_ptr<uint8_t[]> memory = std::make_unique<uint8_t[]>(memSize);
-  if (!memory) {
-    MY_LOGD("ERROR, failed to make_unique");
+MemoryPool4::ArenaHeader* MemoryPool4::refillAvailArena(
+    const AllocInfo& info, ArenaCollection& collection,
+    ArenaHeader* fullArena) {
+  std::unique_lock<std::mutex> _l(collection.mMutex);
+  ArenaHeader* current =
+      collection.mpAvailArena.load(std::memory_order_acquire);
+  if (current != fullArena) {
+    // another thread already replaced the full arena.
+    return current;
+  }
+  ArenaHeader* arenaHeader = popAvailArena(collection);
+  if (!arenaHeader && collection.mpReleasedList) {
+    // reuse the address range of a released arena before asking for more.
+    arenaHeader = collection.mpReleasedList;
+    collection.mpReleasedList = arenaHeader->mNextReleased;
+    collection.mNumReleasedArenas--;
+    reviveArena(info, arenaHeader);
+  }
+  if (!arenaHeader) {
+    ArenaMemory memory = allocateArenaOfMemory(info, collection);
+    if (!memory) {
+      return nullptr;
+    }
+    arenaHeader = reinterpret_cast<ArenaHeader*>(memory.get());
+    arenaHeader->mNextArena = std::move(collection.mRootArena);
+    collection.mRootArena = std::move(memory);
+    collection.mCellBodySize = info.mCellBodySize;
+    collection.mNumArenas++;
+    POOL_TRACE_EVENT(PoolTrace::ARENA_CREATED, info.mCellBodySize, 0,
+                     arenaHeader, arenaHeader->mCellCapacity);
+    if (collection.mpStats) {
+      // the pool only grows when it runs out of cells, a good moment to
+      // sample its high-water mark.
+      collection.mpStats->add(PoolStats::ARENAS_CREATED);
+      collection.mpStats->sampleLive();
+    }
+  }
+  collection.mpAvailArena.store(arenaHeader, std::memory_order_release);
+  return arenaHeader;
+}
+
+MemoryPool4::ArenaHeader* MemoryPool4::popAvailArena(
+    ArenaCollection& collection) {
+  ArenaHeader* head = collection.mpAvailList.load(std::memory_order_acquire);
+  while (head) {
+    if (!collection.mpAvailList.compare_exchange_weak(
+            head, head->mNextAvail, std::memory_order_acq_rel,
+            std::memory_order_acquire)) {
+      continue;
+    }
+    // clear the flag before looking at the bits, a concurrent deallocate
+    // either sees the flag cleared and pushes again, or we see its free cell.
+    head->mInAvailList.store(false);
+    if (head->mFullLeafBits.load() != FULL_OCCUPY_BITS) {
+      return head;
+    }
+    head = collection.mpAvailList.load(std::memory_order_acquire);
+  }
+  return nullptr;
+}
+
+void MemoryPool4::pushAvailArena(ArenaHeader* arenaHeader) {
+  ArenaCollection* collection = arenaHeader->mpCollection;
+  ArenaHeader* head = collection->mpAvailList.load(std::memory_order_relaxed);
+  do {
+    arenaHeader->mNextAvail = head;
+  } while (!collection->mpAvailList.compare_exchange_weak(
+               head, arenaHeader, std::memory_order_release,
+               std::memory_order_relaxed));
+}
+
+size_t MemoryPool4::decay(const AllocInfo& info,
+                          ArenaCollection& collection) {
+  std::unique_lock<std::mutex> _l(collection.mMutex);
+  ArenaHeader* availArena =
+      collection.mpAvailArena.load(std::memory_order_acquire);
+  uint32_t numKeptEmpty = 0;
+  size_t releasedBytes = 0;
+  for (ArenaHeader* arenaHeader =
+           reinterpret_cast<ArenaHeader*>(collection.mRootArena.get());
+       arenaHeader;
+       arenaHeader =
+           reinterpret_cast<ArenaHeader*>(arenaHeader->mNextArena.get())) {
+    if (arenaHeader->mReleased) {
+      continue;
+    }
+    if (arenaHeader->getNumOccupiedCells() != 0) {
+      arenaHeader->mEmptyTicks = 0;
+      continue;
+    }
+    // never release the arena allocate() works on, and keep the newest
+    // empty ones as a cushion for the next burst.
+    if (arenaHeader == availArena ||
+        numKeptEmpty < info.mRetainEmptyArenas) {
+      numKeptEmpty++;
+      continue;
+    }
+    if (++arenaHeader->mEmptyTicks < info.mDecayTicks ||
+        !sealEmptyArena(info, arenaHeader)) {
+      continue;
+    }
+    // the header and leaf words stay resident, only cell pages are dropped.
+    size_t bytes = BackingStore::discard(
+        arenaHeader->mCellStart,
+        arenaHeader->mCellEnd + 1 - arenaHeader->mCellStart);
+    MY_LOGD("release arena 0x%p, cellBodySize=%u, %zu bytes",
+            arenaHeader, arenaHeader->mCellBodySize, bytes);
+    releasedBytes += bytes;
+    arenaHeader->mReleased = true;
+    arenaHeader->mNextReleased = collection.mpReleasedList;
+    collection.mpReleasedList = arenaHeader;
+    collection.mNumReleasedArenas++;
+    POOL_TRACE_EVENT(PoolTrace::ARENA_RELEASED, info.mCellBodySize, 0,
+                     arenaHeader, arenaHeader->mCellCapacity);
+    if (collection.mpStats) {
+      collection.mpStats->add(PoolStats::ARENAS_RELEASED);
+    }
+  }
+  return releasedBytes;
+}
+
+size_t MemoryPool4::getReservedBytes(const AllocInfo& info,
+                                     ArenaCollection& collection) {
+  std::unique_lock<std::mutex> _l(collection.mMutex);
+  return static_cast<size_t>(collection.mNumArenas -
+                             collection.mNumReleasedArenas) * info.mArenaSize;
+}
+
+bool MemoryPool4::sealEmptyArena(const AllocInfo& info,
+                                 ArenaHeader* arenaHeader) {
+  // mark every cell occupied so no allocate() can claim one while the pages
+  // are gone. a thread may still hold the arena from the time it was the
+  // available one, so this has to race against its claims.
+  std::atomic<uint64_t>* leaves = arenaHeader->getOccupationBits();
+  for (uint32_t i = 0; i < info.mLeafCount; ++i) {
+    uint64_t emptyBits = i + 1 == info.mLeafCount ? info.mLastLeafInitBits : 0;
+    if (!leaves[i].compare_exchange_strong(emptyBits, FULL_OCCUPY_BITS)) {
+      // lost against a claim, give the leaves sealed so far back.
+      for (uint32_t j = 0; j < i; ++j) {
+        leaves[j].store(0);
+        markLeafNotFull(arenaHeader, j);
+      }
+      return false;
+    }
+  }
+  arenaHeader->mFullLeafBits.store(FULL_OCCUPY_BITS);
+  return true;
+}
+
+void MemoryPool4::reviveArena(const AllocInfo& info,
+                              ArenaHeader* arenaHeader) {
+  // cell pages read as zero again, the cell headers must be back before
+  // the leaves make any cell claimable.
+  initCellHeaders(info, arenaHeader);
+  std::atomic<uint64_t>* leaves = arenaHeader->getOccupationBits();
+  for (uint32_t i = 0; i < info.mLeafCount; ++i) {
+    leaves[i].store(i + 1 == info.mLeafCount ? info.mLastLeafInitBits : 0);
+  }
+  arenaHeader->mEmptyTicks = 0;
+  arenaHeader->mReleased = false;
+  arenaHeader->mNextReleased = nullptr;
+  arenaHeader->mFullLeafBits.store(info.mSummaryInitBits);
+  MY_LOGD("revive arena 0x%p, cellBodySize=%u",
+          arenaHeader, arenaHeader->mCellBodySize);
+}
+
+void MemoryPool4::markLeafFull(ArenaHeader* arenaHeader, uint32_t leafIdx) {
+  arenaHeader->mFullLeafBits.fetch_or(1ULL << leafIdx);
+  // a cell may have been freed before the summary bit became visible, the
+  // freeing thread found the bit still clear, so undo it here.
+  if (arenaHeader->getOccupationBits()[leafIdx].load() != FULL_OCCUPY_BITS) {
+    markLeafNotFull(arenaHeader, leafIdx);
+  }
+}
+
+void MemoryPool4::markLeafNotFull(ArenaHeader* arenaHeader, uint32_t leafIdx) {
+  uint64_t oldFullLeafBits =
+      arenaHeader->mFullLeafBits.fetch_and(~(1ULL << leafIdx));
+  // the arena just got its first free cell, publish it so allocate can find
+  // it again. the flag keeps an arena from being pushed twice.
+  if (oldFullLeafBits == FULL_OCCUPY_BITS &&
+      !arenaHeader->mInAvailList.exchange(true)) {
+    pushAvailArena(arenaHeader);
+  }
+}
+
+MemoryPool4::ArenaMemory MemoryPool4::allocateArenaOfMemory(
+    const AllocInfo& info, ArenaCollection& collection) {
+  const size_t memSize = info.mArenaSize;
+  const size_t alignment = std::max<size_t>(info.mArenaAlignment,
+                                            __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+  void* raw = info.mpBackingStore ?
+      info.mpBackingStore->allocate(memSize, alignment) :
+      ::operator new(memSize, std::align_val_t(alignment), std::nothrow);
+  if (!raw) {
+    MY_LOGD("ERROR, failed to allocate arena");
     return nullptr;
   }
-  unsigned char* p = reinterpret_cast<unsigned char*>(memory.get());
+  initArena(info, collection, static_cast<unsigned char*>(raw),
+            memSize, alignment);
+  return ArenaMemory(static_cast<uint8_t*>(raw));
+}
+
+bool MemoryPool4::reserve(const AllocInfo& info, ArenaCollection& collection,
+                          uint32_t arenaCount, bool prefault) {
+  if (arenaCount == 0) {
+    return true;
+  }
+  const size_t alignment = std::max<size_t>(info.mArenaAlignment,
+                                            __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+  const size_t stride = (info.mArenaSize + alignment - 1) & ~(alignment - 1);
+  const size_t memSize = stride * arenaCount;
+  void* raw = info.mpBackingStore ?
+      info.mpBackingStore->allocate(memSize, alignment) :
+      ::operator new(memSize, std::align_val_t(alignment), std::nothrow);
+  if (!raw) {
+    MY_LOGD("ERROR, failed to reserve %u arenas (%zu bytes)",
+            arenaCount, memSize);
+    return false;
+  }
+  if (prefault) {
+    BackingStore::prefault(raw, memSize);
+  }
+  std::unique_lock<std::mutex> _l(collection.mMutex);
+  for (uint32_t i = 0; i < arenaCount; ++i) {
+    unsigned char* p = static_cast<unsigned char*>(raw) + stride * i;
+    // the first arena owns the whole chunk. it is linked first, so it ends
+    // up behind the others in the chain and is destroyed last.
+    ArenaHeader* arenaHeader = initArena(info, collection, p,
+                                         i == 0 ? memSize : 0, alignment);
+    arenaHeader->mNextArena = std::move(collection.mRootArena);
+    collection.mRootArena = ArenaMemory(reinterpret_cast<uint8_t*>(p));
+    collection.mNumArenas++;
+    POOL_TRACE_EVENT(PoolTrace::ARENA_CREATED, info.mCellBodySize, 0,
+                     arenaHeader, arenaHeader->mCellCapacity);
+    arenaHeader->mInAvailList.store(true);
+    pushAvailArena(arenaHeader);
+  }
+  collection.mCellBodySize = info.mCellBodySize;
+  if (collection.mpStats) {
+    collection.mpStats->add(PoolStats::ARENAS_CREATED, arenaCount);
+  }
+  return true;
+}
+
+MemoryPool4::ArenaHeader* MemoryPool4::initArena(
+    const AllocInfo& info, ArenaCollection& collection, unsigned char* p,
+    size_t memSize, size_t alignment) {
+  const size_t leafBitsSize = sizeof(uint64_t) * info.mLeafCount;
   {
-    MY_LOGD("allocate arena of memory size: %zu+(%zu+%u)*%u=%zu "
-            "arena addr:0x%p - 0x%p",
-            ArenaHeaderSize, CellHeaderSize, info.mCellBodySize, MAX_CELLS_PER_ARENA,
-            memSize, p, p + memSize);
+    MY_LOGD("allocate arena of memory size: %zu+%zu+%u*%u=%zu "
+            "arena addr:0x%p - 0x%p, alignment=%zu",
+            ArenaHeaderSize, leafBitsSize, info.mCellStride,
+            info.mMaxCellCountPerArena,
+            info.mArenaSize, p, p + info.mArenaSize, alignment);
   }
   // set arena header
-  ArenaHeader* arenaHeader = reinterpret_cast<ArenaHeader*>(p);
+  ArenaHeader* arenaHeader = new (p) ArenaHeader();
   arenaHeader->mCellCapacity = info.mMaxCellCountPerArena;
   arenaHeader->mCellBodySize = info.mCellBodySize;
-  arenaHeader->mOccupationBits = 0;
+  arenaHeader->mLeafCount = info.mLeafCount;
+  arenaHeader->mCellStride = info.mCellStride;
+  arenaHeader->mArenaSize = memSize;
+  arenaHeader->mArenaAlignment = alignment;
+  arenaHeader->mpBackingStore = info.mpBackingStore;
+  arenaHeader->mFullLeafBits = info.mSummaryInitBits;
   arenaHeader->mpCollection = &collection;
-  arenaHeader->mCellStart = p + ArenaHeaderSize;
+  arenaHeader->mCellStart = p + calcCellStartOffset(info.mLeafCount);
   arenaHeader->mCellEnd = arenaHeader->mCellStart
-                        + (CellHeaderSize + info.mCellBodySize) * arenaHeader->mCellCapacity
+                        + info.mCellStride * arenaHeader->mCellCapacity
                         - 1;
   arenaHeader->mNextArena = nullptr;
   arenaHeader->mGuard = VALID_ARENA_HEADER_MARKER;
 
+  // set occupation bits, padding bits of the last leaf stay occupied
+  std::atomic<uint64_t>* leaves = arenaHeader->getOccupationBits();
+  for (uint32_t i = 0; i < info.mLeafCount; ++i) {
+    new (&leaves[i]) std::atomic<uint64_t>(
+        i + 1 == info.mLeafCount ? info.mLastLeafInitBits : 0);
+  }
+
   // set cell
+  initCellHeaders(info, arenaHeader);
+  return arenaHeader;
+}
+
+void MemoryPool4::initCellHeaders(const AllocInfo& info,
+                                  ArenaHeader* arenaHeader) {
+  if (info.mHeaderless) {
+    return;
+  }
   for (size_t i = 0; i < arenaHeader->mCellCapacity; ++i) {
-    unsigned char* cellRaw = arenaHeader->mCellStart
-                           + (CellHeaderSize + info.mCellBodySize) * i;
+    unsigned char* cellRaw = arenaHeader->mCellStart + info.mCellStride * i;
     CellHeader* cellHeader = reinterpret_cast<CellHeader*>(cellRaw);
-    cellHeader->mpArena = reinterpret_cast<ArenaHeader*>(p);
+    cellHeader->mpArena = arenaHeader;
     cellHeader->mGuard = VALID_CELL_HEADER_MARKER;
   }
-  return std::move(memory);
+}
+
+void MemoryPool4::ArenaDeleter::operator()(uint8_t* p) const {
+  ArenaHeader* arenaHeader = reinterpret_cast<ArenaHeader*>(p);
+  if (arenaHeader->mArenaSize == 0) {
+    // carved from a reserved chunk, the chunk's first arena frees it.
+    return;
+  }
+  if (arenaHeader->mpBackingStore) {
+    arenaHeader->mpBackingStore->deallocate(p, arenaHeader->mArenaSize,
+                                            arenaHeader->mArenaAlignment);
+    return;
+  }
+  ::operator delete(p, std::align_val_t(arenaHeader->mArenaAlignment));
+}
+
+MemoryPool4::ArenaCollection::~ArenaCollection() {
+  // arena headers live inside raw memory, unlink the chain by hand so every
+  // arena is released and not only the root one.
+  ArenaMemory arena = std::move(mRootArena);
+  while (arena) {
+    ArenaHeader* arenaHeader = reinterpret_cast<ArenaHeader*>(arena.get());
+    arena = std::move(arenaHeader->mNextArena);
+  }
 }
 
 ////////////////////////////////////////////////////////////
 
+thread_local GlobalMemPool::ThreadCache GlobalMemPool::sThreadCache;
+
+GlobalMemPool::ThreadCache::~ThreadCache() {
+  // thread is leaving, give cached cells back or they leak with the thread.
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  for (uint32_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+    pool.flushBin(i, mBins[i], mBins[i].mCount);
+  }
+}
+
 GlobalMemPool& GlobalMemPool::getInstance() {
+#ifdef GLOBAL_MEM_POOL_IMMORTAL
+  // never destroyed, when the pool backs malloc itself memory is still
+  // freed by exit handlers and static destructors running after ours.
+  alignas(GlobalMemPool) static unsigned char sStorage[sizeof(GlobalMemPool)];
+  static GlobalMemPool* spPool = new (sStorage) GlobalMemPool();
+  return *spPool;
+#else
   static GlobalMemPool gPool;
   return gPool;
+#endif  // GLOBAL_MEM_POOL_IMMORTAL
 }
 
-GlobalMemPool::GlobalMemPool() {
-  uint32_t cellBodySize = 8;
-  uint32_t cellCountPerArena = 8;
+GlobalMemPool::NodeArenas::NodeArenas()
+  : mDenseStore(DENSE_BACKING_KIND)
+  , mSparseStore(SPARSE_BACKING_KIND) {}
+
+GlobalMemPool::GlobalMemPool()
+  : mNumNodes(std::min(BackingStore::getNumaNodeCount(), MAX_NUMA_NODES)) {
+  static_assert(sSizeClassTable.mSmallClass.size() ==
+                (SMALL_SIZE_LIMIT >> 3) + 1, "size class table");
+  static_assert(sSizeClassTable.mClassSize.size() == MAX_ARENA_COUNT,
+                "size class table");
+  static_assert(calcSizeOfClass(MAX_ARENA_COUNT - 1) == MAX_CELL_BODY_SIZE,
+                "size class table");
+  const size_t cellHeaderSize =
+      HEADERLESS_CELL ? 0 : sizeof(MemoryPool4::CellHeader);
+  // leave room for the headers so small arenas keep within the target size
+  // and its power-of-two alignment.
+  const size_t arenaHeadersSize =
+      calcCellStartOffset(AllocInfo::sMaxLeafCount);
+  for (uint32_t n = 0; n < mNumNodes; ++n) {
+    NodeArenas& node = mNodes[n];
+    if (mNumNodes > 1) {
+      node.mDenseStore.setNumaNode(static_cast<int>(n));
+      node.mSparseStore.setNumaNode(static_cast<int>(n));
+    }
+    for (size_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+      uint32_t cellBodySize = sSizeClassTable.mClassSize[i];
+      uint32_t cellCountPerArena = static_cast<uint32_t>(
+          (ARENA_TARGET_SIZE - arenaHeadersSize) /
+          (cellHeaderSize + cellBodySize));
+      BackingStore* store = cellBodySize <= DENSE_MAX_CELL_BODY_SIZE ?
+                            &node.mDenseStore : &node.mSparseStore;
+      // aligned arenas, deallocate() has the size and finds the arena by
+      // masking instead of reading the cell header.
+      node.mAllocInfo[i] = AllocInfo(cellBodySize, cellCountPerArena,
+                                     HEADERLESS_CELL, store, true);
+      node.mArenaCollections[i].mpStats = &mStats[i];
+    }
+  }
   for (size_t i = 0; i < MAX_ARENA_COUNT; ++i) {
-    mAllocInfo[i] = AllocInfo(cellBodySize, cellCountPerArena);
-    cellBodySize <<= 1;
+    uint32_t cellBodySize = sSizeClassTable.mClassSize[i];
+    mThreadCacheLimit[i] = static_cast<uint32_t>(std::min<size_t>(
+        THREAD_CACHE_CAPACITY, THREAD_CACHE_MAX_BIN_BYTES / cellBodySize));
+    if (mThreadCacheLimit[i] < 2) {
+      mThreadCacheLimit[i] = 0;
+    }
   }
+#if GLOBAL_MEM_POOL_PER_CPU
+  // mapped rather than new'd, the pool may be what operator new runs on.
+  const uint32_t numCpus = BackingStore::getCpuCount();
+  const size_t pageSize = BackingStore::getPageSize();
+  mCpuShardsBytes = (sizeof(CpuShard) * numCpus + pageSize - 1) &
+                    ~(pageSize - 1);
+  void* p = BackingStore::mapPages(mCpuShardsBytes);
+  if (!p) {
+    MY_LOGD("ERROR, failed to map %u cpu shards", numCpus);
+    return;
+  }
+  mpCpuShards = static_cast<CpuShard*>(p);
+  for (uint32_t cpu = 0; cpu < numCpus; ++cpu) {
+    CpuShard* shard = new (&mpCpuShards[cpu]) CpuShard();
+    for (size_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+      shard->mArenaCollections[i].mpStats = &mStats[i];
+    }
+  }
+  mNumCpus = numCpus;
+#endif  // GLOBAL_MEM_POOL_PER_CPU
 }
 
 GlobalMemPool::~GlobalMemPool() {
+  stopDecayThread();
+  trimLargeCache();
+  // the shards own arenas of the node stores, they go first.
+  for (uint32_t cpu = 0; cpu < mNumCpus; ++cpu) {
+    mpCpuShards[cpu].~CpuShard();
+  }
+  if (mpCpuShards) {
+    BackingStore::unmapPages(mpCpuShards, mCpuShardsBytes);
+  }
 }
 
 void* GlobalMemPool::allocate(size_t size) {
@@ -200,28 +826,504 @@ void* GlobalMemPool::allocate(size_t size) {
     MY_LOGD("zero size allocation is invalid");
     return nullptr;
   }
+  if (size > MAX_CELL_BODY_SIZE) {
+    void* p = allocateLarge(size);
+    if (p) {
+      POOL_RECORD_EVENT(PoolRecord::ALLOCATE, PoolRecord::GLOBAL_MEM_POOL,
+                        size, p);
+    }
+    return p;
+  }
   uint32_t cellBodySize = 0;
   uint32_t arenaId = 0;
   cellBodySize = calcCellSizeAndArenaId(size, arenaId);
-  return MemoryPool4::allocate(mAllocInfo[arenaId], mArenaCollections[arenaId]);
+#if GLOBAL_MEM_POOL_PER_CPU
+  CpuShard* shard = getLocalShard();
+  void* p = nullptr;
+  if (shard) {
+    p = MemoryPool4::allocate(getShardNode(*shard).mAllocInfo[arenaId],
+                              shard->mArenaCollections[arenaId]);
+  } else {
+    // no shards when mapping them failed, the node collections serve
+    // every cpu instead.
+    NodeArenas& node = getLocalNode();
+    p = MemoryPool4::allocate(node.mAllocInfo[arenaId],
+                              node.mArenaCollections[arenaId]);
+  }
+#else
+  ThreadCache::Bin& bin = sThreadCache.mBins[arenaId];
+  if (bin.mCount > 0 || refillBin(arenaId, bin)) {
+    countInBin(arenaId, bin, 1, 0, size);
+    void* p = bin.mCells[--bin.mCount];
+    POOL_RECORD_EVENT(PoolRecord::ALLOCATE, PoolRecord::GLOBAL_MEM_POOL,
+                      size, p);
+    return p;
+  }
+  NodeArenas& node = getLocalNode();
+  void* p = MemoryPool4::allocate(node.mAllocInfo[arenaId],
+                                  node.mArenaCollections[arenaId]);
+#endif  // GLOBAL_MEM_POOL_PER_CPU
+  if (p) {
+    mStats[arenaId].add(PoolStats::ALLOCATIONS);
+    mStats[arenaId].add(PoolStats::BYTES_REQUESTED, size);
+    POOL_RECORD_EVENT(PoolRecord::ALLOCATE, PoolRecord::GLOBAL_MEM_POOL,
+                      size, p);
+  }
+  return p;
 }
 
 void GlobalMemPool::deallocate(void* data, size_t size) {
-  MemoryPool4::deallocate(data, size);
+  if (!data) {
+    return;
+  }
+  POOL_RECORD_EVENT(PoolRecord::DEALLOCATE, PoolRecord::GLOBAL_MEM_POOL, size,
+                    data);
+  if (size > MAX_CELL_BODY_SIZE) {
+    deallocateLarge(data, size);
+    return;
+  }
+  uint32_t arenaId = 0;
+  calcCellSizeAndArenaId(size, arenaId);
+  // the arena layout of a size class is the same on every node, any
+  // node's AllocInfo finds the cell. per cpu, the cell goes back to its
+  // arena whichever shard it came from.
+  const uint32_t limit = mThreadCacheLimit[arenaId];
+  if (GLOBAL_MEM_POOL_PER_CPU || limit == 0) {
+    MemoryPool4::deallocate(mNodes[0].mAllocInfo[arenaId], data);
+    mStats[arenaId].add(PoolStats::FREES);
+    return;
+  }
+  // a cell of another node is not cached, it would be handed to a thread
+  // of this node next.
+  if (mNumNodes > 1) {
+    const NodeArenas& node = mNodes[sThreadCache.mNode];
+    const AllocInfo& info = node.mAllocInfo[arenaId];
+    if (MemoryPool4::getCollection(info, data) !=
+        &node.mArenaCollections[arenaId]) {
+      MemoryPool4::deallocate(info, data);
+      mStats[arenaId].add(PoolStats::FREES);
+      return;
+    }
+  }
+  ThreadCache::Bin& bin = sThreadCache.mBins[arenaId];
+  if (bin.mCount >= limit) {
+    // keep the hot half, give the older half back in one go.
+    flushBin(arenaId, bin, limit / 2);
+  }
+  bin.mCells[bin.mCount++] = data;
+  countInBin(arenaId, bin, 0, 1, 0);
 }
 
-uint32_t GlobalMemPool::calcCellSizeAndArenaId(
-    size_t allocSize, uint32_t& arenaIdx) {
-  if (allocSize < BYTE_ALIGNMENT) {
-    allocSize = BYTE_ALIGNMENT;
+void GlobalMemPool::deallocate(void* data) {
+  if (!data) {
+    return;
   }
-  uint32_t allocSize_mpow2 = static_cast<uint32_t>(allocSize);
-  uint32_t cellBodySize = TO_POW2_UINT32(allocSize_mpow2);
+  size_t size = getUsableSize(data);
+  if (size == 0) {
+    MY_LOGD("ERROR, 0x%p is not allocated by GlobalMemPool", data);
+    return;
+  }
+  deallocate(data, size);
+}
 
+size_t GlobalMemPool::getUsableSize(void* data) {
+#if HEADERLESS_CELL
+  (void)data;
+  MY_LOGD("ERROR, the size of a headerless cell is unknown");
+  return 0;
+#else
+  if (!data) {
+    return 0;
+  }
+  // large and cell headers keep the guard at the same offset.
+  const MemoryPool4::CellHeader* header =
+      reinterpret_cast<const MemoryPool4::CellHeader*>(data) - 1;
+  if (header->mGuard == MemoryPool4::OUTSIDE_SYSTEM_MARKER) {
+    const MemoryPool4::LargeHeader* largeHeader =
+        reinterpret_cast<const MemoryPool4::LargeHeader*>(data) - 1;
+    return largeHeader->mMappedSize - sizeof(MemoryPool4::LargeHeader);
+  }
+  if (header->mGuard != MemoryPool4::VALID_CELL_HEADER_MARKER ||
+      !header->mpArena ||
+      header->mpArena->mGuard != MemoryPool4::VALID_ARENA_HEADER_MARKER) {
+    return 0;
+  }
+  return header->mpArena->mCellBodySize;
+#endif  // HEADERLESS_CELL
+}
+
+bool GlobalMemPool::isInArenas(const void* data) const {
+  for (uint32_t n = 0; n < mNumNodes; ++n) {
+    if (mNodes[n].mDenseStore.contains(data) ||
+        mNodes[n].mSparseStore.contains(data)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t GlobalMemPool::allocateBulk(size_t size, size_t count, void** out) {
+  if (size == 0) {
+    MY_LOGD("zero size allocation is invalid");
+    return 0;
+  }
+  if (size > MAX_CELL_BODY_SIZE) {
+    size_t allocated = 0;
+    for (; allocated < count; ++allocated) {
+      out[allocated] = allocateLarge(size);
+      if (!out[allocated]) {
+        break;
+      }
+      POOL_RECORD_EVENT(PoolRecord::ALLOCATE, PoolRecord::GLOBAL_MEM_POOL,
+                        size, out[allocated]);
+    }
+    return allocated;
+  }
+  uint32_t arenaId = 0;
+  calcCellSizeAndArenaId(size, arenaId);
+#if GLOBAL_MEM_POOL_PER_CPU
+  CpuShard* shard = getLocalShard();
+  NodeArenas& node = shard ? getShardNode(*shard) : getLocalNode();
+  // the node collections stand in for the shards when they are missing.
+  size_t allocated = MemoryPool4::allocateBulk(
+      node.mAllocInfo[arenaId],
+      shard ? shard->mArenaCollections[arenaId] :
+              node.mArenaCollections[arenaId], out, count);
+#else
+  NodeArenas& node = getLocalNode();
+  size_t allocated = MemoryPool4::allocateBulk(
+      node.mAllocInfo[arenaId], node.mArenaCollections[arenaId], out, count);
+#endif  // GLOBAL_MEM_POOL_PER_CPU
+  mStats[arenaId].add(PoolStats::ALLOCATIONS, allocated);
+  mStats[arenaId].add(PoolStats::BYTES_REQUESTED, allocated * size);
+#if POOL_RECORD
+  for (size_t i = 0; i < allocated; ++i) {
+    PoolRecord::record(PoolRecord::ALLOCATE, PoolRecord::GLOBAL_MEM_POOL,
+                       size, out[i]);
+  }
+#endif  // POOL_RECORD
+  return allocated;
+}
+
+void GlobalMemPool::deallocateBulk(void** data, size_t count, size_t size) {
+#if POOL_RECORD
+  for (size_t i = 0; i < count; ++i) {
+    if (data[i]) {
+      PoolRecord::record(PoolRecord::DEALLOCATE, PoolRecord::GLOBAL_MEM_POOL,
+                         size, data[i]);
+    }
+  }
+#endif  // POOL_RECORD
+  if (size > MAX_CELL_BODY_SIZE) {
+    for (size_t i = 0; i < count; ++i) {
+      if (data[i]) {
+        deallocateLarge(data[i], size);
+      }
+    }
+    return;
+  }
+  uint32_t arenaId = 0;
+  calcCellSizeAndArenaId(size, arenaId);
+  // before the call, it moves the null pointers around.
+  const size_t freed = count - std::count(data, data + count, nullptr);
+  MemoryPool4::deallocateBulk(mNodes[0].mAllocInfo[arenaId], data, count);
+  mStats[arenaId].add(PoolStats::FREES, freed);
+}
+
+void GlobalMemPool::flushThreadCache() {
+  if (GLOBAL_MEM_POOL_PER_CPU) {
+    return;
+  }
+  for (uint32_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+    ThreadCache::Bin& bin = sThreadCache.mBins[i];
+    flushBin(i, bin, bin.mCount);
+  }
+}
+
+size_t GlobalMemPool::decay() {
+  size_t releasedBytes = 0;
+  {
+    std::unique_lock<std::mutex> _l(mLargeCacheMutex);
+    releasedBytes += mLargeCacheBytes;
+  }
+  trimLargeCache();
+  for (uint32_t n = 0; n < mNumNodes; ++n) {
+    NodeArenas& node = mNodes[n];
+    for (uint32_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+      releasedBytes += MemoryPool4::decay(node.mAllocInfo[i],
+                                          node.mArenaCollections[i]);
+    }
+  }
+  for (uint32_t cpu = 0; cpu < mNumCpus; ++cpu) {
+    CpuShard& shard = mpCpuShards[cpu];
+    NodeArenas& node = getShardNode(shard);
+    for (uint32_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+      releasedBytes += MemoryPool4::decay(node.mAllocInfo[i],
+                                          shard.mArenaCollections[i]);
+    }
+  }
+  return releasedBytes;
+}
+
+void GlobalMemPool::startDecayThread(std::chrono::milliseconds period) {
+  std::unique_lock<std::mutex> _l(mDecayMutex);
+  if (mDecayThread.joinable()) {
+    return;
+  }
+  mDecayStop = false;
+  mDecayThread = std::thread([this, period]() {
+    std::unique_lock<std::mutex> _l(mDecayMutex);
+    while (!mDecayCond.wait_for(_l, period, [this]() { return mDecayStop; })) {
+      _l.unlock();
+      size_t releasedBytes = decay();
+      if (releasedBytes) {
+        MY_LOGD("decay released %zu bytes", releasedBytes);
+      }
+      _l.lock();
+    }
+  });
+}
+
+void GlobalMemPool::stopDecayThread() {
+  std::thread decayThread;
+  {
+    std::unique_lock<std::mutex> _l(mDecayMutex);
+    mDecayStop = true;
+    decayThread = std::move(mDecayThread);
+  }
+  mDecayCond.notify_all();
+  if (decayThread.joinable()) {
+    decayThread.join();
+  }
+}
+
+void* GlobalMemPool::allocateLarge(size_t size) {
+  static_assert(offsetof(MemoryPool4::LargeHeader, mGuard) ==
+                offsetof(MemoryPool4::CellHeader, mGuard),
+                "guards of large and cell headers must overlap");
+  const size_t pageSize = BackingStore::getPageSize();
+  const size_t mappedSize =
+      (sizeof(MemoryPool4::LargeHeader) + size + pageSize - 1) & ~(pageSize - 1);
+  MemoryPool4::LargeHeader* header = nullptr;
+  {
+    // newest first, the one freed last is the most likely still in cache.
+    std::unique_lock<std::mutex> _l(mLargeCacheMutex);
+    for (uint32_t i = mLargeCacheCount; i-- > 0;) {
+      size_t cachedSize = mLargeCache[i]->mMappedSize;
+      if (cachedSize >= mappedSize && cachedSize - mappedSize <= mappedSize / 4) {
+        header = mLargeCache[i];
+        std::copy(mLargeCache.begin() + i + 1,
+                  mLargeCache.begin() + mLargeCacheCount,
+                  mLargeCache.begin() + i);
+        mLargeCacheCount--;
+        mLargeCacheBytes -= cachedSize;
+        break;
+      }
+    }
+  }
+  if (!header) {
+    void* p = BackingStore::mapPages(mappedSize);
+    if (!p) {
+      return nullptr;
+    }
+    header = new (p) MemoryPool4::LargeHeader();
+    header->mMappedSize = mappedSize;
+    mLargeMappedBytes.fetch_add(mappedSize, std::memory_order_relaxed);
+  }
+  mLargeStats.add(PoolStats::ALLOCATIONS);
+  mLargeStats.add(PoolStats::BYTES_REQUESTED, size);
+  MY_LOGD("large allocation 0x%p, size=%zu mapped=%zu",
+          header + 1, size, header->mMappedSize);
+  return header + 1;
+}
+
+void GlobalMemPool::deallocateLarge(void* data, size_t size) {
+  MemoryPool4::LargeHeader* header =
+      reinterpret_cast<MemoryPool4::LargeHeader*>(data) - 1;
+  if (header->mGuard != MemoryPool4::OUTSIDE_SYSTEM_MARKER) {
+    MY_LOGD("ERROR, 0x%p(size=%zu) is not a large allocation", data, size);
+    return;
+  }
+  MY_LOGD("large deallocation 0x%p, size=%zu mapped=%zu",
+          data, size, header->mMappedSize);
+  mLargeStats.add(PoolStats::FREES);
+  MemoryPool4::LargeHeader* evicted = nullptr;
+  if (header->mMappedSize <= LARGE_CACHE_MAX_BYTES) {
+    std::unique_lock<std::mutex> _l(mLargeCacheMutex);
+    if (mLargeCacheCount == LARGE_CACHE_CAPACITY ||
+        mLargeCacheBytes + header->mMappedSize > LARGE_CACHE_MAX_BYTES) {
+      // make room by dropping the oldest one
+      evicted = mLargeCache[0];
+      std::copy(mLargeCache.begin() + 1,
+                mLargeCache.begin() + mLargeCacheCount,
+                mLargeCache.begin());
+      mLargeCacheCount--;
+      mLargeCacheBytes -= evicted->mMappedSize;
+    }
+    if (mLargeCacheBytes + header->mMappedSize <= LARGE_CACHE_MAX_BYTES) {
+      mLargeCache[mLargeCacheCount++] = header;
+      mLargeCacheBytes += header->mMappedSize;
+      header = nullptr;
+    }
+  }
+  if (evicted) {
+    mLargeMappedBytes.fetch_sub(evicted->mMappedSize, std::memory_order_relaxed);
+    BackingStore::unmapPages(evicted, evicted->mMappedSize);
+  }
+  if (header) {
+    mLargeMappedBytes.fetch_sub(header->mMappedSize, std::memory_order_relaxed);
+    BackingStore::unmapPages(header, header->mMappedSize);
+  }
+}
+
+void GlobalMemPool::trimLargeCache() {
+  std::array<MemoryPool4::LargeHeader*, LARGE_CACHE_CAPACITY> cache;
+  uint32_t count = 0;
+  {
+    std::unique_lock<std::mutex> _l(mLargeCacheMutex);
+    cache = mLargeCache;
+    count = mLargeCacheCount;
+    mLargeCacheCount = 0;
+    mLargeCacheBytes = 0;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    mLargeMappedBytes.fetch_sub(cache[i]->mMappedSize,
+                                std::memory_order_relaxed);
+    BackingStore::unmapPages(cache[i], cache[i]->mMappedSize);
+  }
+}
+
+bool GlobalMemPool::refillBin(uint32_t arenaIdx, ThreadCache::Bin& bin) {
+  const uint32_t limit = mThreadCacheLimit[arenaIdx];
+  const uint32_t batch = std::min(THREAD_CACHE_BATCH, limit / 2);
+  NodeArenas& node = getLocalNode();
+  publishBinStats(arenaIdx, bin);
+  bin.mCount += static_cast<uint32_t>(MemoryPool4::allocateBulk(
+      node.mAllocInfo[arenaIdx], node.mArenaCollections[arenaIdx],
+      bin.mCells + bin.mCount, batch));
+  return bin.mCount > 0;
+}
+
+void GlobalMemPool::flushBin(uint32_t arenaIdx, ThreadCache::Bin& bin,
+                             uint32_t count) {
+  publishBinStats(arenaIdx, bin);
+  // the oldest cells sit at the bottom of the stack, release those first.
+  count = std::min(count, bin.mCount);
+  // cells go back to the arenas they came from, on whichever node.
+  MemoryPool4::deallocateBulk(getLocalNode().mAllocInfo[arenaIdx],
+                              bin.mCells, count);
+  std::memmove(bin.mCells, bin.mCells + count,
+               (bin.mCount - count) * sizeof(void*));
+  bin.mCount -= count;
+}
+
+void GlobalMemPool::countInBin(uint32_t arenaIdx, ThreadCache::Bin& bin,
+                               uint32_t allocs, uint32_t frees, size_t bytes) {
+#if POOL_STATS
+  bin.mPendingAllocs += allocs;
+  bin.mPendingFrees += frees;
+  bin.mPendingBytes += bytes;
+  if (bin.mPendingAllocs + bin.mPendingFrees >= STATS_PUBLISH_INTERVAL) {
+    publishBinStats(arenaIdx, bin);
+  }
+#else
+  (void)arenaIdx;
+  (void)bin;
+  (void)allocs;
+  (void)frees;
+  (void)bytes;
+#endif  // POOL_STATS
+}
+
+void GlobalMemPool::publishBinStats(uint32_t arenaIdx, ThreadCache::Bin& bin) {
+  PoolStats& stats = mStats[arenaIdx];
+  stats.add(PoolStats::ALLOCATIONS, bin.mPendingAllocs);
+  stats.add(PoolStats::FREES, bin.mPendingFrees);
+  stats.add(PoolStats::BYTES_REQUESTED, bin.mPendingBytes);
+  bin.mPendingAllocs = 0;
+  bin.mPendingFrees = 0;
+  bin.mPendingBytes = 0;
+}
+
+std::vector<PoolStatsSnapshot> GlobalMemPool::snapshot() {
+  // at least the calling thread's counts are current.
+  for (uint32_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+    publishBinStats(i, sThreadCache.mBins[i]);
+  }
+  std::vector<PoolStatsSnapshot> snapshots;
+  for (uint32_t i = 0; i < MAX_ARENA_COUNT; ++i) {
+    size_t reserved = 0;
+    for (uint32_t n = 0; n < mNumNodes; ++n) {
+      reserved += MemoryPool4::getReservedBytes(mNodes[n].mAllocInfo[i],
+                                                mNodes[n].mArenaCollections[i]);
+    }
+    for (uint32_t cpu = 0; cpu < mNumCpus; ++cpu) {
+      reserved += MemoryPool4::getReservedBytes(
+          mNodes[0].mAllocInfo[i], mpCpuShards[cpu].mArenaCollections[i]);
+    }
+    // size classes never used are left out.
+    if (reserved == 0 && mStats[i].get(PoolStats::ALLOCATIONS) == 0) {
+      continue;
+    }
+    snapshots.push_back(mStats[i].snapshot(
+        "global", sSizeClassTable.mClassSize[i], mStats[i].sampleLive(),
+        reserved));
+  }
+  if (mLargeStats.get(PoolStats::ALLOCATIONS) != 0) {
+    snapshots.push_back(mLargeStats.snapshot(
+        "global", 0, mLargeStats.sampleLive(),
+        mLargeMappedBytes.load(std::memory_order_relaxed)));
+  }
+  return snapshots;
+}
+
+GlobalMemPool::NodeArenas& GlobalMemPool::getLocalNode() {
+  if (mNumNodes > 1) {
+    // only called on the slow paths, the thread may have moved since.
+    sThreadCache.mNode = BackingStore::getCurrentNumaNode() % mNumNodes;
+  }
+  return mNodes[sThreadCache.mNode];
+}
+
+GlobalMemPool::CpuShard* GlobalMemPool::getLocalShard() {
+  if (mNumCpus == 0) {
+    return nullptr;
+  }
+  return &mpCpuShards[BackingStore::getCurrentCpu() % mNumCpus];
+}
+
+GlobalMemPool::NodeArenas& GlobalMemPool::getShardNode(CpuShard& shard) {
+  if (mNumNodes == 1) {
+    return mNodes[0];
+  }
+  uint32_t node = shard.mNode.load(std::memory_order_relaxed);
+  if (node != NODE_UNKNOWN) {
+    return mNodes[node];
+  }
+  // the thread may have moved to another cpu meanwhile, the node is kept
+  // only when it was read on the shard's own cpu.
+  uint32_t cpu = 0;
+  node = BackingStore::getCurrentNumaNode(&cpu) % mNumNodes;
+  if (&mpCpuShards[cpu % mNumCpus] == &shard) {
+    shard.mNode.store(node, std::memory_order_relaxed);
+  }
+  return mNodes[node];
+}
+
+uint32_t GlobalMemPool::calcCellSizeAndArenaId(
+    size_t allocSize, uint32_t& arenaIdx) {
   // arena index <-> cell size_wo_header =
-  // 0/8, 1/16/ 2/32, ...
-  // arenaIdx = log(size_wo_header) - log(8)
-   arenaIdx = COUNT_NUM_TRAILING_ZEROES_UINT32(cellBodySize) -
-              COUNT_NUM_TRAILING_ZEROES_UINT32(BYTE_ALIGNMENT);
-   return cellBodySize;
-}
\ No newline at end of file
+  // 0/8, 1/16, 2/24, 3/32, 4/40, 5/48, 6/56, 7/64, 8/80, ...
+  arenaIdx = allocSize <= SMALL_SIZE_LIMIT ?
+      sSizeClassTable.mSmallClass[(allocSize + BYTE_ALIGNMENT - 1) >> 3] :
+      calcSizeClass(allocSize);
+  return sSizeClassTable.mClassSize[arenaIdx];
+}
+
+size_t GlobalMemPool::getCellSize(size_t size) {
+  if (size == 0 || size > MAX_CELL_BODY_SIZE) {
+    return 0;
+  }
+  uint32_t arenaIdx = 0;
+  return calcCellSizeAndArenaId(size, arenaIdx);
+}
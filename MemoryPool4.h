@@ -1,8 +1,16 @@
+#pragma once
+
 #include <mutex>
 #include <array>
 #include <atomic>
+#include <cstddef>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
 
 #include "common.h"
+#include "PoolStats.h"
+#include "PoolRecord.h"
 #define TAG_LOG MemoryPool4
 
 /**
@@ -14,29 +22,72 @@ struct AllocInfo {
   // only used when allocate arena
   uint32_t mCellBodySize;
   uint32_t mMaxCellCountPerArena;
-  uint32_t mFullCellBit;
-  uint32_t mInvalidOccupyBit;
-  uint32_t mInvalidCellIdx;
+  // occupation bits are kept in 64-bit leaf words, one bit per cell. the
+  // arena also has a summary word with one bit per leaf marking it full.
+  uint32_t mLeafCount;
+  // initial value of the last leaf word and of the summary word. bits past
+  // the capacity are set, so they look permanently occupied and a full
+  // leaf/arena is always all ones.
+  uint64_t mLastLeafInitBits;
+  uint64_t mSummaryInitBits;
+  // cells are packed without CellHeader, the arena is found by masking.
+  bool mHeaderless;
+  // arenas are aligned like headerless ones, so a sized deallocate finds
+  // the arena by masking and never reads the cell header. always set when
+  // headerless.
+  bool mAlignedArena;
+  // distance between two cells, (CellHeader +) body
+  uint32_t mCellStride;
+  // bytes of an arena including its headers, and the alignment of its start
+  // address. headerless and aligned arenas are aligned to their size rounded
+  // up to a power of two, so any cell pointer masked by it yields the
+  // ArenaHeader.
+  size_t mArenaSize;
+  size_t mArenaAlignment;
+  // where arenas are carved from, nullptr takes them from the heap.
+  BackingStore* mpBackingStore = nullptr;
+  // an arena found empty by mDecayTicks consecutive decay() passes gives
+  // its cell pages back to the OS. the newest mRetainEmptyArenas empty
+  // arenas are kept, so a pool oscillating around an arena boundary does
+  // not release and fault in the same pages over and over.
+  uint32_t mDecayTicks = 2;
+  uint32_t mRetainEmptyArenas = 1;
 
   constexpr static size_t sMinMemoryChunk = 1 << 7;  // 128bytes
+  constexpr static uint32_t sCellsPerLeaf = 64;
+  constexpr static uint32_t sMaxLeafCount = 64;
+  constexpr static uint32_t sMaxCellCountPerArena =
+      sCellsPerLeaf * sMaxLeafCount;
   static uint32_t calcMaxCellCountPerArena(uint32_t cellBodySize,
                                            uint32_t userCount);
 
   AllocInfo() {}
   AllocInfo(uint32_t mCellBodySize,
-            uint32_t maxCellCountPerArena);
+            uint32_t maxCellCountPerArena,
+            bool headerless = false,
+            BackingStore* backingStore = nullptr,
+            bool alignedArena = false);
   void print() const {
-    MY_LOGD("cellBoldySize=%u mMaxCellCountPerArena=%u mFullCellBit=0x%lx "
-            "mInvalidOccupyBit=0x%lx, mInvalidCellIdx=%u",
-            mCellBodySize, mMaxCellCountPerArena, mFullCellBit,
-            mInvalidOccupyBit, mInvalidCellIdx);
+    MY_LOGD("cellBoldySize=%u mMaxCellCountPerArena=%u mLeafCount=%u "
+            "mLastLeafInitBits=0x%llx, mSummaryInitBits=0x%llx "
+            "mHeaderless=%d mAlignedArena=%d mCellStride=%u mArenaSize=%zu "
+            "mArenaAlignment=%zu",
+            mCellBodySize, mMaxCellCountPerArena, mLeafCount,
+            (unsigned long long)mLastLeafInitBits,
+            (unsigned long long)mSummaryInitBits,
+            mHeaderless, mAlignedArena, mCellStride, mArenaSize,
+            mArenaAlignment);
   }
 };
 
 class MemoryPool4 {
  public:
   const static size_t BYTE_ALIGNMENT = 8;
-  const static uint32_t MAX_CELLS_PER_ARENA = 8;
+  // the first cell of an arena starts at this alignment, so cell bodies whose
+  // size is a multiple of it are aligned like malloc memory.
+  const static size_t CELL_START_ALIGNMENT = alignof(std::max_align_t);
+  const static uint32_t MAX_CELLS_PER_ARENA = AllocInfo::sMaxCellCountPerArena;
+  const static uint64_t FULL_OCCUPY_BITS = ~0ULL;
   const static uint64_t OUTSIDE_SYSTEM_MARKER = 0x1234ABCD1234ABCD;
   const static uint64_t VALID_CELL_HEADER_MARKER = 0xFFFFAAAAFFFFAAAA;
   const static uint64_t VALID_ARENA_HEADER_MARKER = 0xAAAA1111FFFF8888;
@@ -46,25 +97,79 @@ class MemoryPool4 {
   struct ArenaHeader;
   struct CellHeader;
 
+  // arenas come from aligned operator new or a BackingStore, the header
+  // remembers which one together with size and alignment.
+  struct ArenaDeleter {
+    void operator()(uint8_t* p) const;
+  };
+  using ArenaMemory = std::unique_ptr<uint8_t[], ArenaDeleter>;
+
   struct ArenaCollection {
+    ArenaCollection() = default;
+    ~ArenaCollection();
     uint32_t mCellBodySize = 0;
     uint32_t mNumArenas = 0;
+    // guards arena creation and popping from mpAvailList.
     std::mutex mMutex;
-    std::unique_ptr<uint8_t[]> mRootArena = nullptr;
+    // owns every arena of the collection, newest first.
+    ArenaMemory mRootArena = nullptr;
+    // arena allocate() claims cells from, replaced once it is full.
+    std::atomic<ArenaHeader*> mpAvailArena = nullptr;
+    // lock-free stack of arenas which went from full to having a free cell.
+    // pushed by deallocate without lock, popped only under mMutex so the
+    // single popper can not suffer from ABA.
+    std::atomic<ArenaHeader*> mpAvailList = nullptr;
+    // arenas whose cell pages were given back by decay(), guarded by mMutex.
+    // they stay linked in the arena chain and are revived before a new
+    // arena is allocated.
+    ArenaHeader* mpReleasedList = nullptr;
+    uint32_t mNumReleasedArenas = 0;
+    // where CAS retries and arena creation/release are counted, optional.
+    PoolStats* mpStats = nullptr;
   };
 
+  // an arena is laid out as [ArenaHeader][leaf words][padding][cells...]
   struct alignas(BYTE_ALIGNMENT) ArenaHeader {
     uint32_t mCellCapacity = 0;
     uint32_t mCellBodySize = 0;
-    std::atomic<uint32_t> mOccupationBits = 0;
-    const ArenaCollection* mpCollection = nullptr;
+    uint32_t mLeafCount = 0;
+    uint32_t mCellStride = 0;
+    // bytes to free with the arena, the whole chunk for the first arena of
+    // a reserved chunk and 0 for the other arenas of it.
+    size_t mArenaSize = 0;
+    size_t mArenaAlignment = 0;
+    BackingStore* mpBackingStore = nullptr;
+    // bit i is set when leaf word i is full, FULL_OCCUPY_BITS = arena full.
+    std::atomic<uint64_t> mFullLeafBits = 0;
+    ArenaCollection* mpCollection = nullptr;
     unsigned char* mCellStart = nullptr;
     unsigned char* mCellEnd = nullptr;
-    std::unique_ptr<uint8_t[]> mNextArena = nullptr;
+    ArenaMemory mNextArena = nullptr;
+    // link and membership flag of ArenaCollection::mpAvailList
+    ArenaHeader* mNextAvail = nullptr;
+    std::atomic<bool> mInAvailList = false;
+    // decay state, only touched under ArenaCollection::mMutex
+    uint32_t mEmptyTicks = 0;
+    bool mReleased = false;
+    ArenaHeader* mNextReleased = nullptr;
     uint64_t mGuard = VALID_ARENA_HEADER_MARKER;
 
+    // occupation bits of cells, mLeafCount words right after the header.
+    inline std::atomic<uint64_t>* getOccupationBits() {
+      return reinterpret_cast<std::atomic<uint64_t>*>(this + 1);
+    }
+    inline const std::atomic<uint64_t>* getOccupationBits() const {
+      return reinterpret_cast<const std::atomic<uint64_t>*>(this + 1);
+    }
+
     inline size_t getNumOccupiedCells() const {
-      return __builtin_popcountl(mOccupationBits);
+      size_t num = 0;
+      const std::atomic<uint64_t>* leaves = getOccupationBits();
+      for (uint32_t i = 0; i < mLeafCount; ++i) {
+        num += __builtin_popcountll(leaves[i].load(std::memory_order_relaxed));
+      }
+      // padding bits of the last leaf are always set
+      return num - (mLeafCount * AllocInfo::sCellsPerLeaf - mCellCapacity);
     }
   };
 
@@ -75,6 +180,14 @@ class MemoryPool4 {
     std::string printMemory() const;
   };
 
+  // header of an allocation served outside of the arenas by its own
+  // mapping. it sits right before the user data like a CellHeader, the
+  // guard at the same offset tells the two apart.
+  struct alignas(BYTE_ALIGNMENT) LargeHeader {
+    size_t mMappedSize = 0;
+    uint64_t mGuard = OUTSIDE_SYSTEM_MARKER;
+  };
+
  private:
   const static size_t CellHeaderSize = sizeof(CellHeader);
   const static size_t ArenaHeaderSize = sizeof(ArenaHeader);
@@ -83,13 +196,71 @@ class MemoryPool4 {
   static void shutdown();
   static void* allocate(const AllocInfo& info,
                          ArenaCollection& collection);
+  // cell header path, only valid for collections with cell headers.
   static void deallocate(void* data,
                           size_t size);
+  // deallocate a cell of a collection created with `info`, masks the pointer
+  // for aligned arenas and reads the cell header otherwise.
+  static void deallocate(const AllocInfo& info,
+                         void* data);
+  // the collection whose arena holds the cell `data`.
+  static const ArenaCollection* getCollection(const AllocInfo& info,
+                                              void* data);
+  // claim up to `count` cells at once, several bits of a leaf per CAS.
+  // returns how many were stored to `out`, fewer only when out of memory.
+  static size_t allocateBulk(const AllocInfo& info,
+                             ArenaCollection& collection,
+                             void** out,
+                             size_t count);
+  // release `count` cells of a collection created with `info`, the cells of
+  // one leaf are cleared with a single fetch_and. reorders `data`.
+  static void deallocateBulk(const AllocInfo& info,
+                             void** data,
+                             size_t count);
+  // allocate `arenaCount` arenas as one contiguous chunk and make them
+  // available to allocate(), capacity ahead of demand. `prefault` also
+  // faults in the pages of the chunk.
+  static bool reserve(const AllocInfo& info,
+                      ArenaCollection& collection,
+                      uint32_t arenaCount,
+                      bool prefault = false);
+  // one decay pass over the collection, arenas which stayed empty long
+  // enough are sealed and their cell pages dropped. returns bytes released.
+  static size_t decay(const AllocInfo& info,
+                      ArenaCollection& collection);
+  // bytes of the arenas the collection holds now, released ones excluded.
+  static size_t getReservedBytes(const AllocInfo& info,
+                                 ArenaCollection& collection);
 
  private:
-  static std::unique_ptr<uint8_t[]>
+  static ArenaMemory
       allocateArenaOfMemory(const AllocInfo& info,
-                            const ArenaCollection& collection);
+                            ArenaCollection& collection);
+  static ArenaHeader* initArena(const AllocInfo& info,
+                                ArenaCollection& collection,
+                                unsigned char* p,
+                                size_t memSize,
+                                size_t alignment);
+  static ArenaHeader* findArena(const AllocInfo& info,
+                                void* data,
+                                unsigned char*& cell);
+  static unsigned char* getCellBody(ArenaHeader* arenaHeader,
+                                    uint32_t cellIdx);
+  static void releaseCell(ArenaHeader* arenaHeader,
+                          unsigned char* cell);
+  static void releaseCells(ArenaHeader* arenaHeader,
+                           uint32_t leafIdx,
+                           uint64_t bits);
+  static ArenaHeader* refillAvailArena(const AllocInfo& info,
+                                       ArenaCollection& collection,
+                                       ArenaHeader* fullArena);
+  static ArenaHeader* popAvailArena(ArenaCollection& collection);
+  static void pushAvailArena(ArenaHeader* arenaHeader);
+  static bool sealEmptyArena(const AllocInfo& info, ArenaHeader* arenaHeader);
+  static void reviveArena(const AllocInfo& info, ArenaHeader* arenaHeader);
+  static void initCellHeaders(const AllocInfo& info, ArenaHeader* arenaHeader);
+  static void markLeafFull(ArenaHeader* arenaHeader, uint32_t leafIdx);
+  static void markLeafNotFull(ArenaHeader* arenaHeader, uint32_t leafIdx);
 };
 
 struct GlobalMemPool {
@@ -103,22 +274,166 @@ struct GlobalMemPool {
 
   void* allocate(size_t size);
   void deallocate(void* data, size_t size);
+  // free without the size, it is read from the cell header. only with cell
+  // headers (HEADERLESS_CELL 0), pointers not from this pool are ignored.
+  void deallocate(void* data);
+  // bytes usable behind `data`, 0 when it was not allocated by this pool.
+  // needs cell headers like deallocate(data).
+  size_t getUsableSize(void* data);
+  // whether `data` lies in the memory the arenas are carved from, so a
+  // sized deallocate may mask it. large allocations are not in there.
+  bool isInArenas(const void* data) const;
+  // `count` allocations of `size` at once, straight from the arenas with
+  // several cells per CAS. returns how many were stored to `out`, fewer only
+  // when out of memory.
+  size_t allocateBulk(size_t size, size_t count, void** out);
+  // free `count` allocations of `size`, one fetch_and per arena leaf.
+  // reorders `data`.
+  void deallocateBulk(void** data, size_t count, size_t size);
+
+  // return all cells cached by the calling thread back to their arenas.
+  void flushThreadCache();
+  // bytes of the cell a request of `size` gets, 0 when it is not pooled.
+  size_t getCellSize(size_t size);
+  // drop the mappings kept by the large allocation cache.
+  void trimLargeCache();
+
+  // give the pages of idle arenas back to the OS, returns bytes released.
+  // cells cached by other threads keep their arenas alive.
+  size_t decay();
+  // run decay() every `period` on a background thread, so allocate and
+  // deallocate never pay for it. stopped by stopDecayThread() or on exit.
+  void startDecayThread(std::chrono::milliseconds period);
+  void stopDecayThread();
+
+  // counters of every size class in use and of the large mappings. the
+  // counts of a thread cache are published every STATS_PUBLISH_INTERVAL
+  // operations, on refill/flush and when the thread exits, so they lag a
+  // little behind.
+  std::vector<PoolStatsSnapshot> snapshot();
 
  private:
   constexpr static size_t BYTE_ALIGNMENT = (1 << 3);
-  constexpr static size_t MAX_ARENA_COUNT = 20;
-  constexpr static uint64_t MAX_CELL_BODY_SIZE =
-      BYTE_ALIGNMENT << MAX_ARENA_COUNT;
+  // size classes: 8/16/24/32, then 4 classes between two powers of two,
+  // e.g. 40/48/56/64, 80/96/112/128, ... up to 4MB. the worst rounding
+  // waste is 25% instead of 50% with power-of-two classes.
+  constexpr static size_t SIZE_CLASSES_PER_DOUBLING = 4;
+  constexpr static size_t MAX_ARENA_COUNT = 72;
+  constexpr static uint64_t MAX_CELL_BODY_SIZE = 4 << 20;
+  // sizes up to SMALL_SIZE_LIMIT find their class in a table indexed by
+  // size / 8, larger ones compute it from the highest set bit.
+  constexpr static size_t SMALL_SIZE_LIMIT = 1024;
+  // requests above MAX_CELL_BODY_SIZE get a mapping of their own, rounded
+  // to pages only. a few recently freed ones are kept for reuse, as long
+  // as they are not much larger than the request.
+  constexpr static uint32_t LARGE_CACHE_CAPACITY = 4;
+  constexpr static size_t LARGE_CACHE_MAX_BYTES = 64 << 20;
+  // preferred bytes of an arena, small size classes get thousands of cells
+  // per arena while large ones fall back to a single cell.
+  constexpr static size_t ARENA_TARGET_SIZE = 1 << 16;
+  // size classes up to DENSE_MAX_CELL_BODY_SIZE are carved from huge pages,
+  // the sparse larger ones from normal pages to keep their footprint small.
+  constexpr static size_t DENSE_MAX_CELL_BODY_SIZE = 1 << 12;
+  constexpr static BackingKind DENSE_BACKING_KIND = BackingKind::mmap_thp;
+  constexpr static BackingKind SPARSE_BACKING_KIND = BackingKind::mmap;
+
+  // per-thread cache, each size class keeps a small stack of free cells so
+  // the common allocate/deallocate never touch the arena occupation bits.
+  constexpr static uint32_t THREAD_CACHE_CAPACITY = 32;
+  constexpr static uint32_t THREAD_CACHE_BATCH = THREAD_CACHE_CAPACITY / 2;
+  // upper bound of bytes a single bin may hold, larger size classes get a
+  // smaller capacity (or none at all) to limit idle memory per thread.
+  constexpr static size_t THREAD_CACHE_MAX_BIN_BYTES = 1 << 16;
+  // cached allocations and frees are counted in the bin and added to the
+  // shared counters in batches of this many.
+  constexpr static uint32_t STATS_PUBLISH_INTERVAL = 64;
+
+  struct ThreadCache {
+    struct Bin {
+      uint32_t mCount = 0;
+      // counts not yet added to GlobalMemPool::mStats
+      uint32_t mPendingAllocs = 0;
+      uint32_t mPendingFrees = 0;
+      uint64_t mPendingBytes = 0;
+      void* mCells[THREAD_CACHE_CAPACITY];
+    };
+    ThreadCache() = default;
+    ~ThreadCache();
+    ThreadCache(const ThreadCache&) = delete;
+    ThreadCache& operator=(const ThreadCache&) = delete;
+    std::array<Bin, MAX_ARENA_COUNT> mBins;
+    // NUMA node the thread ran on at its last refill or flush.
+    uint32_t mNode = 0;
+  };
+
+  // the arenas of one NUMA node, carved from stores bound to that node. a
+  // thread allocates from the node it runs on, cells freed on another node
+  // go straight back to their arena instead of into the thread cache. a
+  // machine with a single node only uses the first one, unbound.
+  constexpr static uint32_t MAX_NUMA_NODES = 8;
+  struct NodeArenas {
+    NodeArenas();
+    // declared before the collections, so they are unmapped after the arenas.
+    BackingStore mDenseStore;
+    BackingStore mSparseStore;
+    // key = sizeof(cell) align to power of 2
+    std::array<MemoryPool4::ArenaCollection, MAX_ARENA_COUNT> mArenaCollections;
+    std::array<AllocInfo, MAX_ARENA_COUNT> mAllocInfo;
+  };
+
+  // GLOBAL_MEM_POOL_PER_CPU: the collections of one cpu, shared by the
+  // threads running on it in place of their thread caches. the arenas are
+  // taken from the node of the cpu.
+  constexpr static uint32_t NODE_UNKNOWN = ~0u;
+  struct alignas(64) CpuShard {
+    std::array<MemoryPool4::ArenaCollection, MAX_ARENA_COUNT> mArenaCollections;
+    // learned on first use, the cpu does not change its node.
+    std::atomic<uint32_t> mNode = NODE_UNKNOWN;
+  };
 
  private:
   uint32_t calcCellSizeAndArenaId(
       size_t allocSize,
       uint32_t& arenaIdx);
+  bool refillBin(uint32_t arenaIdx, ThreadCache::Bin& bin);
+  void countInBin(uint32_t arenaIdx, ThreadCache::Bin& bin,
+                  uint32_t allocs, uint32_t frees, size_t bytes);
+  void publishBinStats(uint32_t arenaIdx, ThreadCache::Bin& bin);
+  void flushBin(uint32_t arenaIdx, ThreadCache::Bin& bin, uint32_t count);
+  void* allocateLarge(size_t size);
+  void deallocateLarge(void* data, size_t size);
+  // arenas of the node the calling thread runs on, remembered in its cache.
+  NodeArenas& getLocalNode();
+  // shard of the cpu the calling thread runs on and the node it belongs to,
+  // GLOBAL_MEM_POOL_PER_CPU only.
+  CpuShard* getLocalShard();
+  NodeArenas& getShardNode(CpuShard& shard);
 
  private:
   friend class MemoryPool4;
-  // key = sizeof(cell) align to power of 2
-  std::array<MemoryPool4::ArenaCollection, MAX_ARENA_COUNT> mArenaCollections;
-  std::array<AllocInfo, MAX_ARENA_COUNT> mAllocInfo;
+  static thread_local ThreadCache sThreadCache;
+  std::array<NodeArenas, MAX_NUMA_NODES> mNodes;
+  uint32_t mNumNodes = 1;
+  // one per possible cpu, mapped at construction in per-cpu mode.
+  CpuShard* mpCpuShards = nullptr;
+  uint32_t mNumCpus = 0;
+  size_t mCpuShardsBytes = 0;
+  // number of cells a thread may cache per size class, 0 means uncached.
+  std::array<uint32_t, MAX_ARENA_COUNT> mThreadCacheLimit;
+  // per size class, shared by the collections of every node and shard.
+  std::array<PoolStats, MAX_ARENA_COUNT> mStats;
+  PoolStats mLargeStats;
+  // bytes mapped for large allocations, in use or cached.
+  std::atomic<size_t> mLargeMappedBytes = 0;
+  // recently freed large mappings, oldest first
+  std::mutex mLargeCacheMutex;
+  std::array<MemoryPool4::LargeHeader*, LARGE_CACHE_CAPACITY> mLargeCache;
+  uint32_t mLargeCacheCount = 0;
+  size_t mLargeCacheBytes = 0;
+  // background decay
+  std::thread mDecayThread;
+  std::mutex mDecayMutex;
+  std::condition_variable mDecayCond;
+  bool mDecayStop = false;
 };
 
@@ -1,6 +1,15 @@
+#pragma once
+
 #include "MemoryPool4.h"
+#include "PoolConfig.h"
+#include "PoolPtr.h"
 
 #include <memory>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <utility>
 namespace strm {
 
 template<typename T>
@@ -110,27 +119,1003 @@ make_shared2(const Debug& debug, _Args&&... __args) {
   return p;
 }
 struct PoolConfig {
-  uint32_t mCapacity;
+  uint32_t mCapacity;  // objects alive at most
+};
+
+template<class _Tp, class _Spec = default_user_spec,
+         pool_engine _Engine = select_engine<_Spec>()>
+class ObjectPool;
+
+/**
+ * Allocator handed to allocate_shared by ObjectPool. it is rebound to the
+ * control block type, `_Pool` stays the pool type so the cell size of the
+ * pool can be checked against the real control block at compile time.
+ * a pool that took the cell already passes it along, allocate() hands it
+ * out instead of asking the pool.
+ */
+template<typename T, typename _Pool>
+class objectpool_allocator {
+ public:
+  using value_type = T;
+  template<typename U>
+  struct rebind {
+    using other = objectpool_allocator<U, _Pool>;
+  };
+
+  explicit objectpool_allocator(_Pool* pool, void* cell = nullptr) noexcept
+      : mpPool(pool)
+      , mpCell(cell) {}
+
+  template<typename U>
+  objectpool_allocator(const objectpool_allocator<U, _Pool>& other) noexcept
+      : mpPool(other.mpPool)
+      , mpCell(other.mpCell) {}
+
+  [[nodiscard]] T* allocate(size_t n) {
+    static_assert(sizeof(T) <= _Pool::CELL_BODY_SIZE,
+                  "control block does not fit the cell, check shared_node");
+    assertm(n == 1, "objects are allocated one by one");
+    if (mpCell) {
+      return static_cast<T*>(std::exchange(mpCell, nullptr));
+    }
+    return static_cast<T*>(mpPool->allocateCell());
+  }
+
+  void deallocate(T* p, size_t) {
+    mpPool->deallocateCell(p);
+  }
+
+  template<typename U>
+  bool operator==(const objectpool_allocator<U, _Pool>& other) const {
+    return mpPool == other.mpPool;
+  }
+  template<typename U>
+  bool operator!=(const objectpool_allocator<U, _Pool>& other) const {
+    return mpPool != other.mpPool;
+  }
+
+ private:
+  template<typename U, typename _P>
+  friend class objectpool_allocator;
+  _Pool* mpPool;
+  void* mpCell;
 };
-template<class _Tp>
-class ObjectPool {
+
+// layout of the node allocate_shared puts a `_Tp` in: vptr and two counts
+// of the control block, the allocator, then the object itself.
+template<class _Tp, class _Alloc>
+struct shared_node {
+  virtual ~shared_node() = default;
+  int mUseCount;
+  int mWeakCount;
+  _Alloc mAllocator;
+  alignas(_Tp) unsigned char mStorage[sizeof(_Tp)];
+};
+
+// a cell holds either the node of allocate_shared or a pool_node.
+template<class _Tp, class _Alloc, bool _Atomic>
+constexpr size_t pool_cell_size() {
+  return std::max(sizeof(shared_node<_Tp, _Alloc>),
+                  sizeof(pool_node<_Tp, _Atomic>));
+}
+
+// recycling pools (user_spec::is_recycle_object) construct the node of each
+// cell up front and destroy them with the pool. when a constructor throws,
+// the nodes constructed so far are destroyed again.
+template<class _Node, class _CellAt>
+void construct_pool_nodes(size_t count, _CellAt cellAt, pool_owner* owner) {
+  size_t constructed = 0;
+  try {
+    for (; constructed < count; ++constructed) {
+      _Node::create(cellAt(constructed), owner);
+    }
+  } catch (...) {
+    while (constructed > 0) {
+      void* cell = cellAt(--constructed);
+      static_cast<_Node*>(cell)->destroy();
+    }
+    throw;
+  }
+}
+
+template<class _Node, class _CellAt>
+void destroy_pool_nodes(size_t count, _CellAt cellAt) {
+  for (size_t i = 0; i < count; ++i) {
+    void* cell = cellAt(i);
+    static_cast<_Node*>(cell)->destroy();
+  }
+}
+
+/**
+ * Bitmap engine (pool_engine::bitmap), pool of `pool_size` objects in an
+ * arena collection of its own. acquire() hands them out as shared_ptr: the
+ * object is destroyed when the last shared_ptr is gone, its cell returns to
+ * the pool once no weak_ptr is left either. acquire_ptr() hands out the
+ * lighter pool_ptr instead. the cells of `pool_size` (and of every growth)
+ * are reserved and faulted in up front, the first acquires do not pay for
+ * arena creation. with user_spec::is_recycle_object every object is built
+ * once with the pool, releasing a pool_ptr only resets it (recycle_traits).
+ * the pool then holds every cell of its arenas, pool_size rounded up to
+ * whole arenas.
+ *
+ * exhaust_action::wait  acquire() blocks until a cell is released.
+ * exhaust_action::grow  the pool grows by pool_config::grow_policy, each
+ *                       growth is one contiguous chunk of arenas. acquire()
+ *                       only blocks once grow_policy::max_size is reached.
+ *
+ * @warning the pool must outlive every object acquired from it.
+ */
+template<class _Tp, class _Spec, pool_engine _Engine>
+class ObjectPool : public pool_owner {
  public:
+  using allocator_type = objectpool_allocator<_Tp, ObjectPool>;
+  constexpr static bool ATOMIC_REFCOUNT =
+      _Spec::ps_type != ps_type::single_thread;
+  constexpr static bool RECYCLE_OBJECTS = _Spec::is_recycle_object;
+  using ptr_type = pool_ptr<_Tp, ATOMIC_REFCOUNT>;
+  using spec_type = _Spec;
+  constexpr static size_t CELL_BODY_SIZE =
+      pool_cell_size<_Tp, allocator_type, ATOMIC_REFCOUNT>();
 
  public:
-  ObjectPool(const PoolConfig& config)
-      : mAllocInfo(sizeof(_Tp), config.mCapacity) {
+  ObjectPool(const pool_config& config)
+      : mAllocInfo(CELL_BODY_SIZE,
+                   static_cast<uint32_t>(std::clamp<size_t>(
+                       config.pool_size, 1, AllocInfo::sMaxCellCountPerArena)),
+                   HEADERLESS_CELL)
+      , mExhaustAction(config.exhaust_action)
+      , mGrowPolicy(config.grow_policy)
+      , mPoolSize(config.pool_size)
+      , mCapacity(config.pool_size)
+      , mAvailable(config.pool_size) {
+    assertm(config.user_spec == _Spec::value(),
+            "pool_config::user_spec differs from the pool's spec");
     mAllocInfo.print();
+    mArenaCollection.mpStats = &mStats;
+    if (!MemoryPool4::reserve(mAllocInfo, mArenaCollection,
+                              arenasFor(mPoolSize), true)) {
+      MY_LOGD("ERROR, failed to reserve %zu objects, arenas are allocated "
+              "on demand", mPoolSize);
+    }
+    if constexpr (RECYCLE_OBJECTS) {
+      if (mExhaustAction == exhaust_action::grow) {
+        MY_LOGD("recycling pool does not grow, it waits when exhausted");
+      }
+      // the arena allocator hands out any free cell of the reserved arenas,
+      // not only the first pool_size ones, so each of them needs an object.
+      mCapacity = static_cast<size_t>(arenasFor(mPoolSize)) *
+                  mAllocInfo.mMaxCellCountPerArena;
+      mAvailable.store(mCapacity);
+      std::vector<void*> cells = takeFreeCells();
+      try {
+        construct_pool_nodes<typename ptr_type::node_type>(
+            cells.size(), [&cells](size_t i) { return cells[i]; }, this);
+      } catch (...) {
+        giveBackCells(cells);
+        throw;
+      }
+      giveBackCells(cells);
+    }
+  }
+
+  // mCapacity is a hard limit, acquire() waits once it is reached.
+  ObjectPool(const PoolConfig& config)
+      : ObjectPool(pool_config{config.mCapacity, _Spec::value(),
+                               exhaust_action::wait}) {}
+
+  ~ObjectPool() {
+    if (mAvailable.load() != mCapacity) {
+      MY_LOGD("ERROR, %zu objects are still alive",
+              mCapacity - mAvailable.load());
+    }
+    if constexpr (RECYCLE_OBJECTS) {
+      std::vector<void*> cells = takeFreeCells();
+      destroy_pool_nodes<typename ptr_type::node_type>(
+          cells.size(), [&cells](size_t i) { return cells[i]; });
+      giveBackCells(cells);
+    }
   }
 
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  // blocks while the pool is exhausted and can not grow.
   template<typename ..._Args>
   std::shared_ptr<_Tp> acquire(_Args&&... __args) {
-    return std::allocate_shared<_Tp>(sharedpool_allocator<_Tp>(),
+    waitCell();
+    return make(std::forward<_Args>(__args)...);
+  }
+
+  // acquire() and try_acquire() handing out a pool_ptr.
+  template<typename ..._Args>
+  ptr_type acquire_ptr(_Args&&... __args) {
+    waitCell();
+    return makePtr(allocateCell(), std::forward<_Args>(__args)...);
+  }
+  template<typename ..._Args>
+  ptr_type try_acquire_ptr(_Args&&... __args) {
+    if (!takeCell()) {
+      return nullptr;
+    }
+    return makePtr(allocateCell(), std::forward<_Args>(__args)...);
+  }
+
+  // nullptr when the pool is exhausted and can not grow.
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> try_acquire(_Args&&... __args) {
+    if (!takeCell()) {
+      return nullptr;
+    }
+    return make(std::forward<_Args>(__args)...);
+  }
+
+  // nullptr when no cell is released within `timeout`.
+  template<class _Rep, class _Period, typename ..._Args>
+  std::shared_ptr<_Tp> acquire_for(
+      const std::chrono::duration<_Rep, _Period>& timeout,
+      _Args&&... __args) {
+    if (!takeCell()) {
+      std::unique_lock<std::mutex> _l(mMutex);
+      mWaiters.fetch_add(1);
+      bool taken = mCond.wait_for(_l, timeout, [this]() {
+        return takeCellLocked();
+      });
+      mWaiters.fetch_sub(1);
+      if (!taken) {
+        return nullptr;
+      }
+    }
+    return make(std::forward<_Args>(__args)...);
+  }
+
+  // number of objects which can be acquired without blocking or growing.
+  size_t available() const {
+    return mAvailable.load();
+  }
+
+  // objects the pool has grown to so far.
+  size_t capacity() {
+    std::unique_lock<std::mutex> _l(mMutex);
+    return mCapacity;
+  }
+
+  // counters of the pool, reported as `name`. live objects are exact, the
+  // high-water mark is sampled when the pool grows and by snapshot(). only
+  // releases are counted, acquires are releases plus live objects.
+  PoolStatsSnapshot snapshot(std::string name = "objectpool") {
+    const size_t live = capacity() - available();
+    PoolStatsSnapshot snapshot = mStats.snapshot(
+        std::move(name), CELL_BODY_SIZE, live,
+        MemoryPool4::getReservedBytes(mAllocInfo, mArenaCollection));
+    snapshot.mAllocations = snapshot.mFrees + live;
+    snapshot.mBytesRequested = snapshot.mAllocations * sizeof(_Tp);
+    return snapshot;
+  }
+
+ private:
+  template<typename T, typename _P>
+  friend class objectpool_allocator;
+
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> make(_Args&&... __args) {
+    static_assert(!RECYCLE_OBJECTS,
+                  "recycled objects are handed out as pool_ptr only");
+    // the cell taken above is given back by deallocateCell, also when the
+    // constructor throws.
+    return std::allocate_shared<_Tp>(allocator_type(this),
                                      std::forward<_Args>(__args)...);
   }
 
+  template<typename ..._Args>
+  ptr_type makePtr(void* cell, _Args&&... __args) {
+    using node_type = typename ptr_type::node_type;
+    if constexpr (RECYCLE_OBJECTS) {
+      static_assert(sizeof...(_Args) == 0,
+                    "recycled objects are reset, not constructed again");
+      return ptr_type(node_type::reuse(cell));
+    } else {
+      try {
+        return ptr_type(node_type::create(cell, this,
+                                          std::forward<_Args>(__args)...));
+      } catch (...) {
+        deallocateCell(cell);
+        throw;
+      }
+    }
+  }
+
+  void recycle(void* node) override {
+    static_cast<typename ptr_type::node_type*>(node)
+        ->template retire<RECYCLE_OBJECTS>();
+    deallocateCell(node);
+  }
+
+  // recycling only. the free cells hold the kept objects, they are taken
+  // all at once to reach each of them, bypassing the permits.
+  std::vector<void*> takeFreeCells() {
+    std::vector<void*> cells;
+    cells.reserve(mAvailable.load());
+    for (size_t i = mAvailable.load(); i > 0; --i) {
+      void* cell = MemoryPool4::allocate(mAllocInfo, mArenaCollection);
+      if (!cell) {
+        throw std::bad_alloc();
+      }
+      cells.push_back(cell);
+    }
+    return cells;
+  }
+  void giveBackCells(const std::vector<void*>& cells) {
+    for (void* cell : cells) {
+      MemoryPool4::deallocate(mAllocInfo, cell);
+    }
+  }
+
+  void waitCell() {
+    if (!takeCell()) {
+      std::unique_lock<std::mutex> _l(mMutex);
+      mWaiters.fetch_add(1);
+      mCond.wait(_l, [this]() { return takeCellLocked(); });
+      mWaiters.fetch_sub(1);
+    }
+  }
+
+  // takes a cell, grows the pool when it is exhausted (or about to be).
+  bool takeCell() {
+    if (tryTakeCell()) {
+      if (mExhaustAction == exhaust_action::grow &&
+          mGrowPolicy.grow_threshold > 0 &&
+          mAvailable.load() <= mGrowPolicy.grow_threshold) {
+        std::unique_lock<std::mutex> _l(mMutex);
+        growLocked(mGrowPolicy.grow_threshold);
+      }
+      return true;
+    }
+    if (mExhaustAction != exhaust_action::grow) {
+      return false;
+    }
+    std::unique_lock<std::mutex> _l(mMutex);
+    return takeCellLocked();
+  }
+
+  // mMutex is held.
+  bool takeCellLocked() {
+    while (!tryTakeCell()) {
+      if (!growLocked(0)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // mMutex is held. grows one step of the policy unless more than
+  // `threshold` cells are available by now, false when nothing can be added.
+  bool growLocked(size_t threshold) {
+    if (RECYCLE_OBJECTS || mExhaustAction != exhaust_action::grow) {
+      return false;
+    }
+    if (mAvailable.load() > threshold) {
+      return true;  // released or grown by someone else meanwhile
+    }
+    const size_t maxSize = mGrowPolicy.max_size ? mGrowPolicy.max_size :
+                                                  SIZE_MAX;
+    if (mCapacity >= maxSize) {
+      return false;
+    }
+    size_t delta;
+    if (mGrowPolicy.mode == grow_mode::fixed_step) {
+      delta = mGrowPolicy.step ? mGrowPolicy.step : mPoolSize;
+    } else {
+      delta = mCapacity * (std::max<size_t>(mGrowPolicy.factor, 2) - 1);
+    }
+    delta = std::min(std::max<size_t>(delta, 1), maxSize - mCapacity);
+    // whole arenas are reserved anyway, hand out all of their cells unless
+    // it crosses max_size.
+    const uint32_t arenaCount = arenasFor(delta);
+    if (!MemoryPool4::reserve(mAllocInfo, mArenaCollection, arenaCount,
+                              true)) {
+      return false;
+    }
+    delta = std::min<size_t>(
+        static_cast<size_t>(arenaCount) * mAllocInfo.mMaxCellCountPerArena,
+        maxSize - mCapacity);
+    MY_LOGD("grow %zu -> %zu objects, %u arenas",
+            mCapacity, mCapacity + delta, arenaCount);
+    mStats.notePeak(mCapacity - mAvailable.load());
+    mCapacity += delta;
+    mAvailable.fetch_add(delta);
+    mCond.notify_all();
+    return true;
+  }
+
+  uint32_t arenasFor(size_t cells) const {
+    const size_t cellsPerArena = mAllocInfo.mMaxCellCountPerArena;
+    return static_cast<uint32_t>((cells + cellsPerArena - 1) / cellsPerArena);
+  }
+
+  bool tryTakeCell() {
+    size_t available = mAvailable.load();
+    uint32_t casRetries = 0;
+    while (available > 0) {
+      if (mAvailable.compare_exchange_weak(available, available - 1)) {
+        mStats.add(PoolStats::CAS_RETRIES, casRetries);
+        return true;
+      }
+      casRetries++;
+    }
+    mStats.add(PoolStats::CAS_RETRIES, casRetries);
+    return false;
+  }
+
+  void giveBackCell() {
+    // seq_cst pairs with the waiter count, either the waiter sees the cell
+    // when it checks under the lock, or we see the waiter here.
+    mAvailable.fetch_add(1);
+    if (mWaiters.load() > 0) {
+      std::unique_lock<std::mutex> _l(mMutex);
+      mCond.notify_one();
+    }
+  }
+
+  void* allocateCell() {
+    void* p = MemoryPool4::allocate(mAllocInfo, mArenaCollection);
+    if (!p) {
+      giveBackCell();
+      throw std::bad_alloc();
+    }
+    POOL_RECORD_EVENT(PoolRecord::ALLOCATE, PoolRecord::OBJECT_POOL,
+                      CELL_BODY_SIZE, p);
+    return p;
+  }
+
+  void deallocateCell(void* p) {
+    POOL_RECORD_EVENT(PoolRecord::DEALLOCATE, PoolRecord::OBJECT_POOL,
+                      CELL_BODY_SIZE, p);
+    MemoryPool4::deallocate(mAllocInfo, p);
+    mStats.add(PoolStats::FREES);
+    giveBackCell();
+  }
+
  private:
+  PoolStats mStats;
   AllocInfo mAllocInfo;
   MemoryPool4::ArenaCollection mArenaCollection;
+  const exhaust_action mExhaustAction;
+  const grow_policy mGrowPolicy;
+  const size_t mPoolSize;
+  size_t mCapacity;  // guarded by mMutex
+  std::atomic<size_t> mAvailable;
+  std::atomic<uint32_t> mWaiters = 0;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+};
+
+/**
+ * Ring engine (pool_engine::ring), chosen at compile time when the spec
+ * promises one acquiring thread, one releasing thread and release in acquire
+ * order (ps_type::spsc + is_recycle_FIFO). cells are handed out and taken
+ * back in ring order, so the head (producer) and tail (consumer) indexes are
+ * all the state: no bitmap scan and no CAS.
+ *
+ * the ring does not grow, exhaust_action::grow waits like
+ * exhaust_action::wait, spinning with yield as the releasing thread can not
+ * notify without a lock.
+ *
+ * @warning releasing out of acquire order corrupts the ring.
+ */
+template<class _Tp, class _Spec>
+class ObjectPool<_Tp, _Spec, pool_engine::ring> : public pool_owner {
+ public:
+  using allocator_type = objectpool_allocator<_Tp, ObjectPool>;
+  constexpr static bool ATOMIC_REFCOUNT =
+      _Spec::ps_type != ps_type::single_thread;
+  constexpr static bool RECYCLE_OBJECTS = _Spec::is_recycle_object;
+  using ptr_type = pool_ptr<_Tp, ATOMIC_REFCOUNT>;
+  using spec_type = _Spec;
+  constexpr static size_t CELL_BODY_SIZE =
+      pool_cell_size<_Tp, allocator_type, ATOMIC_REFCOUNT>();
+  constexpr static size_t CELL_ALIGNMENT =
+      std::max(alignof(shared_node<_Tp, allocator_type>),
+               alignof(pool_node<_Tp, ATOMIC_REFCOUNT>));
+  constexpr static size_t CACHE_LINE_SIZE = 64;
+
+ public:
+  ObjectPool(const pool_config& config)
+      : mCapacity(roundUpPow2(std::max<size_t>(config.pool_size, 1)))
+      , mpCells(static_cast<unsigned char*>(::operator new(
+            mCapacity * CELL_BODY_SIZE, std::align_val_t(CELL_ALIGNMENT)))) {
+    assertm(config.user_spec == _Spec::value(),
+            "pool_config::user_spec differs from the pool's spec");
+    if (config.exhaust_action == exhaust_action::grow) {
+      MY_LOGD("ring pool does not grow, it waits when exhausted");
+    }
+    BackingStore::prefault(mpCells, mCapacity * CELL_BODY_SIZE);
+    MY_LOGD("ring pool of %zu cells of %zu bytes",
+            mCapacity, CELL_BODY_SIZE);
+    if constexpr (RECYCLE_OBJECTS) {
+      try {
+        construct_pool_nodes<typename ptr_type::node_type>(
+            mCapacity, [this](size_t i) { return cellAt(i); }, this);
+      } catch (...) {
+        ::operator delete(mpCells, std::align_val_t(CELL_ALIGNMENT));
+        throw;
+      }
+    }
+  }
+
+  ~ObjectPool() {
+    if (mHead.load() != mTail.load()) {
+      MY_LOGD("ERROR, %zu objects are still alive",
+              mHead.load() - mTail.load());
+    }
+    if constexpr (RECYCLE_OBJECTS) {
+      destroy_pool_nodes<typename ptr_type::node_type>(
+          mCapacity, [this](size_t i) { return cellAt(i); });
+    }
+    ::operator delete(mpCells, std::align_val_t(CELL_ALIGNMENT));
+  }
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  // producer only. spins while the ring is full.
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> acquire(_Args&&... __args) {
+    waitCell();
+    return make(std::forward<_Args>(__args)...);
+  }
+
+  // acquire() and try_acquire() handing out a pool_ptr.
+  template<typename ..._Args>
+  ptr_type acquire_ptr(_Args&&... __args) {
+    waitCell();
+    return makePtr(allocateCell(), std::forward<_Args>(__args)...);
+  }
+  template<typename ..._Args>
+  ptr_type try_acquire_ptr(_Args&&... __args) {
+    if (!hasFreeCell()) {
+      return nullptr;
+    }
+    return makePtr(allocateCell(), std::forward<_Args>(__args)...);
+  }
+
+  // producer only. nullptr when the ring is full.
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> try_acquire(_Args&&... __args) {
+    if (!hasFreeCell()) {
+      return nullptr;
+    }
+    return make(std::forward<_Args>(__args)...);
+  }
+
+  // producer only. nullptr when no cell is released within `timeout`.
+  template<class _Rep, class _Period, typename ..._Args>
+  std::shared_ptr<_Tp> acquire_for(
+      const std::chrono::duration<_Rep, _Period>& timeout,
+      _Args&&... __args) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!hasFreeCell()) {
+      if (std::chrono::steady_clock::now() >= deadline) {
+        return nullptr;
+      }
+      std::this_thread::yield();
+    }
+    return make(std::forward<_Args>(__args)...);
+  }
+
+  size_t available() const {
+    return mCapacity - (mHead.load() - mTail.load());
+  }
+
+  size_t capacity() const {
+    return mCapacity;
+  }
+
+  // counters of the pool, reported as `name`. the head and tail indexes
+  // already count acquires and releases, the ring keeps no counters.
+  PoolStatsSnapshot snapshot(std::string name = "objectpool") {
+    const size_t tail = mTail.load(std::memory_order_relaxed);
+    const size_t head = mHead.load(std::memory_order_relaxed);
+    PoolStatsSnapshot snapshot = mStats.snapshot(
+        std::move(name), CELL_BODY_SIZE, head > tail ? head - tail : 0,
+        mCapacity * CELL_BODY_SIZE);
+    snapshot.mAllocations = head;
+    snapshot.mFrees = tail;
+    snapshot.mBytesRequested = head * sizeof(_Tp);
+    return snapshot;
+  }
+
+ private:
+  template<typename T, typename _P>
+  friend class objectpool_allocator;
+
+  static size_t roundUpPow2(size_t n) {
+    size_t pow2 = 1;
+    while (pow2 < n) {
+      pow2 <<= 1;
+    }
+    return pow2;
+  }
+
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> make(_Args&&... __args) {
+    static_assert(!RECYCLE_OBJECTS,
+                  "recycled objects are handed out as pool_ptr only");
+    return std::allocate_shared<_Tp>(allocator_type(this),
+                                     std::forward<_Args>(__args)...);
+  }
+
+  template<typename ..._Args>
+  ptr_type makePtr(void* cell, _Args&&... __args) {
+    using node_type = typename ptr_type::node_type;
+    if constexpr (RECYCLE_OBJECTS) {
+      static_assert(sizeof...(_Args) == 0,
+                    "recycled objects are reset, not constructed again");
+      return ptr_type(node_type::reuse(cell));
+    } else {
+      try {
+        return ptr_type(node_type::create(cell, this,
+                                          std::forward<_Args>(__args)...));
+      } catch (...) {
+        deallocateCell(cell);
+        throw;
+      }
+    }
+  }
+
+  void recycle(void* node) override {
+    static_cast<typename ptr_type::node_type*>(node)
+        ->template retire<RECYCLE_OBJECTS>();
+    deallocateCell(node);
+  }
+
+  void waitCell() {
+    while (!hasFreeCell()) {
+      std::this_thread::yield();
+    }
+  }
+
+  unsigned char* cellAt(size_t index) const {
+    return mpCells + (index & (mCapacity - 1)) * CELL_BODY_SIZE;
+  }
+
+  // producer side. the tail is only reloaded when the cached one says full.
+  bool hasFreeCell() {
+    const size_t head = mHead.load(std::memory_order_relaxed);
+    if (head - mTailCache < mCapacity) {
+      return true;
+    }
+    // acquire pairs with the release in deallocateCell, the node in the
+    // cell is destroyed before we hand the cell out again.
+    mTailCache = mTail.load(std::memory_order_acquire);
+    return head - mTailCache < mCapacity;
+  }
+
+  // producer side, hasFreeCell() was true.
+  void* allocateCell() {
+    const size_t head = mHead.load(std::memory_order_relaxed);
+    mHead.store(head + 1, std::memory_order_relaxed);
+    POOL_RECORD_EVENT(PoolRecord::ALLOCATE, PoolRecord::OBJECT_POOL,
+                      CELL_BODY_SIZE, cellAt(head));
+    return cellAt(head);
+  }
+
+  void deallocateCell(void* p) {
+    POOL_RECORD_EVENT(PoolRecord::DEALLOCATE, PoolRecord::OBJECT_POOL,
+                      CELL_BODY_SIZE, p);
+    const size_t tail = mTail.load(std::memory_order_relaxed);
+    if (p == cellAt(tail)) {
+      mTail.store(tail + 1, std::memory_order_release);
+      return;
+    }
+    // the cell of a throwing constructor, given back by the producer before
+    // it was handed out. it is the newest cell, take it back from the head.
+    const size_t head = mHead.load(std::memory_order_relaxed);
+    assertm(p == cellAt(head - 1), "objects are not released in FIFO order");
+    mHead.store(head - 1, std::memory_order_relaxed);
+  }
+
+ private:
+  const size_t mCapacity;  // power of two
+  unsigned char* const mpCells;
+  // only the high-water mark, see snapshot().
+  PoolStats mStats;
+  // producer line: its index and its last look at the consumer's.
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> mHead = 0;
+  size_t mTailCache = 0;
+  // consumer line.
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> mTail = 0;
+};
+
+/**
+ * Free list engine (pool_engine::freelist), for many threads acquiring and
+ * releasing at once (ps_type::spmc, ps_type::mpmc). free cells form a
+ * Treiber stack, acquire pops and release pushes with a single CAS on the
+ * head, no bitmap is scanned. the head packs the top cell index with a
+ * generation which every CAS bumps, so a cell popped and pushed back
+ * meanwhile (ABA) fails the CAS instead of corrupting the stack.
+ *
+ * the links live in an array next to the cells rather than in the cells,
+ * a pop racing with the owner of the cell then never reads user bytes.
+ *
+ * the stack does not grow, exhaust_action::grow waits like
+ * exhaust_action::wait.
+ */
+template<class _Tp, class _Spec>
+class ObjectPool<_Tp, _Spec, pool_engine::freelist>
+    : public pool_owner {
+ public:
+  using allocator_type = objectpool_allocator<_Tp, ObjectPool>;
+  constexpr static bool ATOMIC_REFCOUNT =
+      _Spec::ps_type != ps_type::single_thread;
+  constexpr static bool RECYCLE_OBJECTS = _Spec::is_recycle_object;
+  using ptr_type = pool_ptr<_Tp, ATOMIC_REFCOUNT>;
+  using spec_type = _Spec;
+  constexpr static size_t CELL_BODY_SIZE =
+      pool_cell_size<_Tp, allocator_type, ATOMIC_REFCOUNT>();
+  constexpr static size_t CELL_ALIGNMENT =
+      std::max(alignof(shared_node<_Tp, allocator_type>),
+               alignof(pool_node<_Tp, ATOMIC_REFCOUNT>));
+
+ public:
+  ObjectPool(const pool_config& config)
+      : mCapacity(static_cast<uint32_t>(std::clamp<size_t>(
+            config.pool_size, 1, NIL)))
+      , mpCells(static_cast<unsigned char*>(::operator new(
+            mCapacity * CELL_BODY_SIZE, std::align_val_t(CELL_ALIGNMENT))))
+      , mpNext(new std::atomic<uint32_t>[mCapacity])
+      , mAvailable(mCapacity) {
+    assertm(config.user_spec == _Spec::value(),
+            "pool_config::user_spec differs from the pool's spec");
+    if (config.exhaust_action == exhaust_action::grow) {
+      MY_LOGD("free list pool does not grow, it waits when exhausted");
+    }
+    // cell 0 on top
+    for (uint32_t i = 0; i < mCapacity; ++i) {
+      mpNext[i].store(i + 1 < mCapacity ? i + 1 : NIL,
+                      std::memory_order_relaxed);
+    }
+    mHead.store(pack(0, 0));
+    BackingStore::prefault(mpCells, mCapacity * CELL_BODY_SIZE);
+    if constexpr (RECYCLE_OBJECTS) {
+      try {
+        construct_pool_nodes<typename ptr_type::node_type>(
+            mCapacity, [this](size_t i) { return cellAt(i); }, this);
+      } catch (...) {
+        ::operator delete(mpCells, std::align_val_t(CELL_ALIGNMENT));
+        throw;
+      }
+    }
+  }
+
+  ~ObjectPool() {
+    if (mAvailable.load() != mCapacity) {
+      MY_LOGD("ERROR, %zu objects are still alive",
+              mCapacity - mAvailable.load());
+    }
+    if constexpr (RECYCLE_OBJECTS) {
+      destroy_pool_nodes<typename ptr_type::node_type>(
+          mCapacity, [this](size_t i) { return cellAt(i); });
+    }
+    ::operator delete(mpCells, std::align_val_t(CELL_ALIGNMENT));
+  }
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  // blocks while the pool is exhausted.
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> acquire(_Args&&... __args) {
+    return make(waitCell(), std::forward<_Args>(__args)...);
+  }
+
+  // acquire() and try_acquire() handing out a pool_ptr.
+  template<typename ..._Args>
+  ptr_type acquire_ptr(_Args&&... __args) {
+    return makePtr(takeCell(waitCell()), std::forward<_Args>(__args)...);
+  }
+  template<typename ..._Args>
+  ptr_type try_acquire_ptr(_Args&&... __args) {
+    uint32_t index = pop();
+    if (index == NIL) {
+      return nullptr;
+    }
+    return makePtr(takeCell(index), std::forward<_Args>(__args)...);
+  }
+
+  // nullptr when the pool is exhausted.
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> try_acquire(_Args&&... __args) {
+    uint32_t index = pop();
+    if (index == NIL) {
+      return nullptr;
+    }
+    return make(index, std::forward<_Args>(__args)...);
+  }
+
+  // nullptr when no cell is released within `timeout`.
+  template<class _Rep, class _Period, typename ..._Args>
+  std::shared_ptr<_Tp> acquire_for(
+      const std::chrono::duration<_Rep, _Period>& timeout,
+      _Args&&... __args) {
+    uint32_t index = pop();
+    if (index == NIL) {
+      std::unique_lock<std::mutex> _l(mMutex);
+      mWaiters.fetch_add(1);
+      bool taken = mCond.wait_for(_l, timeout, [this, &index]() {
+        return (index = pop()) != NIL;
+      });
+      mWaiters.fetch_sub(1);
+      if (!taken) {
+        return nullptr;
+      }
+    }
+    return make(index, std::forward<_Args>(__args)...);
+  }
+
+  // a snapshot, other threads may change it right away.
+  size_t available() const {
+    return mAvailable.load(std::memory_order_relaxed);
+  }
+
+  size_t capacity() const {
+    return mCapacity;
+  }
+
+  // counters of the pool, reported as `name`. like the bitmap engine only
+  // releases are counted.
+  PoolStatsSnapshot snapshot(std::string name = "objectpool") {
+    const size_t available = mAvailable.load(std::memory_order_relaxed);
+    const size_t live = available < mCapacity ? mCapacity - available : 0;
+    PoolStatsSnapshot snapshot = mStats.snapshot(
+        std::move(name), CELL_BODY_SIZE, live,
+        static_cast<size_t>(mCapacity) * CELL_BODY_SIZE);
+    snapshot.mAllocations = snapshot.mFrees + live;
+    snapshot.mBytesRequested = snapshot.mAllocations * sizeof(_Tp);
+    return snapshot;
+  }
+
+ private:
+  template<typename T, typename _P>
+  friend class objectpool_allocator;
+
+  constexpr static uint32_t NIL = UINT32_MAX;
+
+  static uint64_t pack(uint32_t generation, uint32_t index) {
+    return (static_cast<uint64_t>(generation) << 32) | index;
+  }
+  static uint32_t indexOf(uint64_t head) {
+    return static_cast<uint32_t>(head);
+  }
+  static uint32_t generationOf(uint64_t head) {
+    return static_cast<uint32_t>(head >> 32);
+  }
+
+  template<typename ..._Args>
+  std::shared_ptr<_Tp> make(uint32_t index, _Args&&... __args) {
+    static_assert(!RECYCLE_OBJECTS,
+                  "recycled objects are handed out as pool_ptr only");
+    // the cell popped by the caller goes to allocate_shared through its
+    // allocator.
+    return std::allocate_shared<_Tp>(allocator_type(this, takeCell(index)),
+                                     std::forward<_Args>(__args)...);
+  }
+
+  template<typename ..._Args>
+  ptr_type makePtr(void* cell, _Args&&... __args) {
+    using node_type = typename ptr_type::node_type;
+    if constexpr (RECYCLE_OBJECTS) {
+      static_assert(sizeof...(_Args) == 0,
+                    "recycled objects are reset, not constructed again");
+      return ptr_type(node_type::reuse(cell));
+    } else {
+      try {
+        return ptr_type(node_type::create(cell, this,
+                                          std::forward<_Args>(__args)...));
+      } catch (...) {
+        deallocateCell(cell);
+        throw;
+      }
+    }
+  }
+
+  void recycle(void* node) override {
+    static_cast<typename ptr_type::node_type*>(node)
+        ->template retire<RECYCLE_OBJECTS>();
+    deallocateCell(node);
+  }
+
+  unsigned char* cellAt(uint32_t index) const {
+    return mpCells + static_cast<size_t>(index) * CELL_BODY_SIZE;
+  }
+
+  uint32_t waitCell() {
+    uint32_t index = pop();
+    if (index == NIL) {
+      std::unique_lock<std::mutex> _l(mMutex);
+      mWaiters.fetch_add(1);
+      mCond.wait(_l, [this, &index]() { return (index = pop()) != NIL; });
+      mWaiters.fetch_sub(1);
+    }
+    return index;
+  }
+
+  uint32_t pop() {
+    // seq_cst for the waiter, see push().
+    uint64_t head = mHead.load();
+    uint32_t casRetries = 0;
+    while (indexOf(head) != NIL) {
+      // a stale link is harmless, the generation check below rejects it.
+      uint32_t next = mpNext[indexOf(head)].load(std::memory_order_relaxed);
+      if (mHead.compare_exchange_weak(head,
+                                      pack(generationOf(head) + 1, next),
+                                      std::memory_order_acquire,
+                                      std::memory_order_acquire)) {
+        mAvailable.fetch_sub(1, std::memory_order_relaxed);
+        mStats.add(PoolStats::CAS_RETRIES, casRetries);
+        return indexOf(head);
+      }
+      casRetries++;
+    }
+    mStats.add(PoolStats::CAS_RETRIES, casRetries);
+    return NIL;
+  }
+
+  void push(uint32_t index) {
+    mAvailable.fetch_add(1, std::memory_order_relaxed);
+    mStats.add(PoolStats::FREES);
+    uint64_t head = mHead.load(std::memory_order_relaxed);
+    uint32_t casRetries = 0;
+    for (;;) {
+      mpNext[index].store(indexOf(head), std::memory_order_relaxed);
+      // seq_cst pairs with the waiter count, either the waiter pops the
+      // cell when it checks under the lock, or we see the waiter below.
+      if (mHead.compare_exchange_weak(head,
+                                      pack(generationOf(head) + 1, index),
+                                      std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+      casRetries++;
+    }
+    mStats.add(PoolStats::CAS_RETRIES, casRetries);
+    if (mWaiters.load() > 0) {
+      std::unique_lock<std::mutex> _l(mMutex);
+      mCond.notify_one();
+    }
+  }
+
+  // hands out the cell at `index`, popped already.
+  void* takeCell(uint32_t index) {
+    void* p = cellAt(index);
+    POOL_RECORD_EVENT(PoolRecord::ALLOCATE, PoolRecord::OBJECT_POOL,
+                      CELL_BODY_SIZE, p);
+    return p;
+  }
+
+  void* allocateCell() {
+    return takeCell(waitCell());
+  }
+
+  void deallocateCell(void* p) {
+    POOL_RECORD_EVENT(PoolRecord::DEALLOCATE, PoolRecord::OBJECT_POOL,
+                      CELL_BODY_SIZE, p);
+    const size_t offset = static_cast<unsigned char*>(p) - mpCells;
+    assertm(offset % CELL_BODY_SIZE == 0 &&
+            offset < static_cast<size_t>(mCapacity) * CELL_BODY_SIZE,
+            "cell does not belong to this pool");
+    push(static_cast<uint32_t>(offset / CELL_BODY_SIZE));
+  }
+
+ private:
+  const uint32_t mCapacity;
+  unsigned char* const mpCells;
+  std::unique_ptr<std::atomic<uint32_t>[]> mpNext;
+  alignas(64) std::atomic<uint64_t> mHead;
+  alignas(64) std::atomic<size_t> mAvailable;
+  PoolStats mStats;
+  std::atomic<uint32_t> mWaiters = 0;
+  std::mutex mMutex;
+  std::condition_variable mCond;
 };
 
 };
\ No newline at end of file
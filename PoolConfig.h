@@ -1,4 +1,7 @@
+#pragma once
+
 #include "common.h"
+#undef TAG_LOG
 #define TAG_LOG PoolConfig
 
 
@@ -23,18 +26,66 @@ enum class exhaust_action {
   wait,
 
   /**
-   * autimatically allocate new resource
+   * autimatically allocate new resource, how much and how far is decided by
+   * pool_config::grow_policy. once grow_policy::max_size is reached the pool
+   * waits like exhaust_action::wait.
    *
    * @warning the grow implementation can not satisfy all pool using scenario.
    */
   grow,
 };
 
+/**
+ * How the capacity grows each time the pool runs out of resource.
+ */
+enum class grow_mode {
+  /**
+   * add grow_policy::step objects every time.
+   */
+  fixed_step,
+
+  /**
+   * multiply the current capacity by grow_policy::factor.
+   */
+  geometric,
+};
+
+/**
+ * Each growth is allocated as one contiguous chunk. A latency sensitive pool
+ * grows in large batches and ahead of demand (grow_threshold), a memory
+ * sensitive pool sets a small step and a hard max_size.
+ */
+struct grow_policy {
+  ::grow_mode mode = grow_mode::geometric;
+
+  /**
+   * objects added by grow_mode::fixed_step, 0 means pool_size.
+   */
+  size_t step = 0;
+
+  /**
+   * capacity multiplier of grow_mode::geometric, at least 2.
+   */
+  size_t factor = 2;
+
+  /**
+   * hard cap of the capacity, 0 means unlimited.
+   */
+  size_t max_size = 0;
+
+  /**
+   * grow as soon as available objects fall to this number instead of
+   * waiting for the pool to run dry, 0 grows on exhaustion only.
+   */
+  size_t grow_threshold = 0;
+};
+
 enum class ps_type {
   spsc,  /* single producer, single consumer */
   mpsc,  /* multiple producer, single consumer */
   spmc,  /* single producer, multiple consumer */
   mpmc,  /* multiple producer, multiple consumer */
+  single_thread,  /* acquired and released on one thread only */
 };
 
 /**
@@ -50,14 +101,70 @@ struct user_spec {
   /**
    * make sure what kind of producer-consumer the pool user is.
    *
-   * @warning currently ps_type::spmc && spmc::mpmc are not support.
-   *          which means twice or more times of recyling call of a single
-   *          object is not admitted.
+   * @warning twice or more times of recyling call of a single object is
+   *          not admitted.
    */
-  ps_type ps_type;
+  ::ps_type ps_type;
+
+  /**
+   * user promise a released object is fine to be handed out again after
+   * recycle_traits<T>::reset(), so objects are constructed once when the
+   * pool is created and destroyed with the pool. it only applies to
+   * pool_ptr handles (acquire_ptr), and the pool does not grow.
+   */
+  bool is_recycle_object = false;
+};
+
+constexpr bool operator==(const user_spec& a, const user_spec& b) {
+  return a.is_recycle_FIFO == b.is_recycle_FIFO && a.ps_type == b.ps_type &&
+         a.is_recycle_object == b.is_recycle_object;
+}
+
+/**
+ * Engines behind the pool.
+ *   bitmap   : MemoryPool4 arenas, serves any user and can grow
+ *   ring     : head/tail ring, ps_type::spsc (or single_thread) with FIFO
+ *              recycling only
+ *   freelist : lock-free free list with a tagged head, for many threads
+ *              acquiring and releasing (ps_type::spmc, ps_type::mpmc)
+ */
+enum class pool_engine {
+  bitmap,
+  ring,
+  freelist,
+};
+
+/**
+ * user_spec known at compile time. it is a template argument of the pool and
+ * selects the engine by select_engine().
+ */
+template<::ps_type _PsType, bool _RecycleFIFO, bool _RecycleObject = false>
+struct static_user_spec {
+  constexpr static ::ps_type ps_type = _PsType;
+  constexpr static bool is_recycle_FIFO = _RecycleFIFO;
+  constexpr static bool is_recycle_object = _RecycleObject;
 
+  constexpr static ::user_spec value() {
+    return ::user_spec{is_recycle_FIFO, ps_type, is_recycle_object};
+  }
 };
 
+// the bitmap engine, safe whatever the user does.
+using default_user_spec = static_user_spec<ps_type::mpsc, false>;
+
+template<class _Spec>
+constexpr pool_engine select_engine() {
+  if ((_Spec::ps_type == ps_type::spsc ||
+       _Spec::ps_type == ps_type::single_thread) &&
+      _Spec::is_recycle_FIFO) {
+    return pool_engine::ring;
+  }
+  if (_Spec::ps_type == ps_type::spmc || _Spec::ps_type == ps_type::mpmc) {
+    return pool_engine::freelist;
+  }
+  return pool_engine::bitmap;
+}
+
 struct pool_config {
   /**
    * initial pool size when pool object is created.
@@ -65,13 +172,19 @@ struct pool_config {
   size_t pool_size;
 
   /**
-   *
+   * must be the pool's spec, _Spec::value(). the engine is picked from the
+   * template argument at compile time, the pool asserts they agree.
    */
-  user_spec user_spec;
+  ::user_spec user_spec;
 
   /**
    * software flexibility for user to decide what behavior the pool is expected
    * to do when avaialble resource is exhausted.
    */
-  exhaust_action exhaust_action;
+  ::exhaust_action exhaust_action;
+
+  /**
+   * only used by exhaust_action::grow.
+   */
+  ::grow_policy grow_policy = {};
 };
\ No newline at end of file
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "common.h"
+
+namespace strm {
+
+/**
+ * Where a pool_ptr gives its node back when the last reference is dropped.
+ * the object is still alive, the pool destroys it or keeps it for reuse.
+ */
+class pool_owner {
+ public:
+  virtual void recycle(void* node) = 0;
+
+ protected:
+  ~pool_owner() = default;
+};
+
+/**
+ * How a recycled object is made ready for its next user, see
+ * user_spec::is_recycle_object. calls `obj.reset()` by default, specialize it
+ * for types without one.
+ */
+template<class _Tp>
+struct recycle_traits {
+  static void reset(_Tp& obj) {
+    obj.reset();
+  }
+};
+
+/**
+ * What a pool_ptr points to, placed right in the pool cell: the reference
+ * count, the owning pool and the object. the count is a plain integer when
+ * the pool is single threaded (ps_type::single_thread).
+ */
+template<class _Tp, bool _Atomic>
+struct pool_node {
+  using count_type = std::conditional_t<_Atomic, std::atomic<uint32_t>,
+                                        uint32_t>;
+
+  count_type mRefCount;
+  pool_owner* mpOwner;
+  alignas(_Tp) unsigned char mStorage[sizeof(_Tp)];
+
+  _Tp* get() {
+    return std::launder(reinterpret_cast<_Tp*>(mStorage));
+  }
+
+  // constructs the object in `cell`, holding one reference. the cell is
+  // the caller's again when the constructor throws.
+  template<typename ..._Args>
+  static pool_node* create(void* cell, pool_owner* owner, _Args&&... __args) {
+    pool_node* node = new (cell) pool_node;
+    node->mpOwner = owner;
+    try {
+      new (node->mStorage) _Tp(std::forward<_Args>(__args)...);
+    } catch (...) {
+      node->~pool_node();
+      throw;
+    }
+    node->setRefCount(1);
+    return node;
+  }
+
+  // the node kept in `cell` by a recycling pool, holding one reference.
+  static pool_node* reuse(void* cell) {
+    pool_node* node = static_cast<pool_node*>(cell);
+    node->setRefCount(1);
+    return node;
+  }
+
+  // the last reference is gone. the object is reset and kept in the cell
+  // when `_Recycle`, destroyed otherwise.
+  template<bool _Recycle>
+  void retire() {
+    if constexpr (_Recycle) {
+      recycle_traits<_Tp>::reset(*get());
+    } else {
+      destroy();
+    }
+  }
+
+  void destroy() {
+    get()->~_Tp();
+    this->~pool_node();
+  }
+
+ private:
+  void setRefCount(uint32_t count) {
+    // not shared yet, a plain store is enough.
+    if constexpr (_Atomic) {
+      mRefCount.store(count, std::memory_order_relaxed);
+    } else {
+      mRefCount = count;
+    }
+  }
+};
+
+/**
+ * Intrusive reference counted handle of a pooled object, one pointer wide.
+ * unlike shared_ptr there is no separate control block and no weak count,
+ * the last handle hands the node straight back to its pool. `_Atomic`
+ * false makes copies plain increments, only for objects which never leave
+ * their thread.
+ */
+template<class _Tp, bool _Atomic = true>
+class pool_ptr {
+ public:
+  using element_type = _Tp;
+  using node_type = pool_node<_Tp, _Atomic>;
+
+  pool_ptr() noexcept = default;
+  pool_ptr(std::nullptr_t) noexcept {}
+  // adopts the reference the node was created with.
+  explicit pool_ptr(node_type* node) noexcept : mpNode(node) {}
+
+  pool_ptr(const pool_ptr& other) noexcept : mpNode(other.mpNode) {
+    addRef();
+  }
+  pool_ptr(pool_ptr&& other) noexcept : mpNode(other.mpNode) {
+    other.mpNode = nullptr;
+  }
+  ~pool_ptr() {
+    release();
+  }
+
+  pool_ptr& operator=(const pool_ptr& other) noexcept {
+    pool_ptr(other).swap(*this);
+    return *this;
+  }
+  pool_ptr& operator=(pool_ptr&& other) noexcept {
+    pool_ptr(std::move(other)).swap(*this);
+    return *this;
+  }
+  pool_ptr& operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  void reset() noexcept {
+    release();
+    mpNode = nullptr;
+  }
+  void swap(pool_ptr& other) noexcept {
+    std::swap(mpNode, other.mpNode);
+  }
+
+  _Tp* get() const noexcept {
+    return mpNode ? mpNode->get() : nullptr;
+  }
+  _Tp& operator*() const noexcept {
+    return *mpNode->get();
+  }
+  _Tp* operator->() const noexcept {
+    return mpNode->get();
+  }
+  explicit operator bool() const noexcept {
+    return mpNode != nullptr;
+  }
+  // a snapshot when atomic, other threads may change it right away.
+  uint32_t use_count() const noexcept {
+    if (!mpNode) {
+      return 0;
+    }
+    if constexpr (_Atomic) {
+      return mpNode->mRefCount.load(std::memory_order_relaxed);
+    } else {
+      return mpNode->mRefCount;
+    }
+  }
+
+  bool operator==(const pool_ptr& other) const noexcept {
+    return mpNode == other.mpNode;
+  }
+  bool operator!=(const pool_ptr& other) const noexcept {
+    return mpNode != other.mpNode;
+  }
+  bool operator==(std::nullptr_t) const noexcept {
+    return mpNode == nullptr;
+  }
+  bool operator!=(std::nullptr_t) const noexcept {
+    return mpNode != nullptr;
+  }
+
+ private:
+  void addRef() noexcept {
+    if (!mpNode) {
+      return;
+    }
+    if constexpr (_Atomic) {
+      // a new reference comes from an existing one, nothing to order.
+      mpNode->mRefCount.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      ++mpNode->mRefCount;
+    }
+  }
+
+  void release() noexcept {
+    if (!mpNode) {
+      return;
+    }
+    bool last;
+    if constexpr (_Atomic) {
+      // acq_rel: every use through the other handles happens before the
+      // object is destroyed by whoever drops the last one. a count of 1
+      // means we are the only handle, nobody can add one meanwhile and the
+      // read-modify-write is skipped.
+      last = mpNode->mRefCount.load(std::memory_order_acquire) == 1 ||
+             mpNode->mRefCount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    } else {
+      last = --mpNode->mRefCount == 0;
+    }
+    if (last) {
+      mpNode->mpOwner->recycle(mpNode);
+    }
+  }
+
+ private:
+  node_type* mpNode = nullptr;
+};
+
+};
@@ -0,0 +1,258 @@
+#include "PoolRecord.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "BackingStore.h"
+#define TAG_LOG PoolRecord
+
+// file layout: FileHeader, then chunks of one thread each, a ChunkHeader
+// followed by mCount records. chunks of different threads interleave, the
+// records of one thread are in order. see tools/pool_replay.cpp.
+namespace {
+
+constexpr char RECORD_MAGIC[8] = {'P', 'O', 'O', 'L', 'R', 'E', 'C', '1'};
+constexpr uint32_t RECORD_VERSION = 1;
+
+struct FileHeader {
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mRecordSize;
+};
+
+struct ChunkHeader {
+  uint32_t mThread;
+  uint32_t mCount;
+};
+
+uint64_t steadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t written = ::write(fd, p, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+// guards the file and the flushed part of every buffer.
+std::mutex sFileMutex;
+int sFd = -1;
+bool sWriteFailed = false;
+std::atomic<uint64_t> sStartNs = 0;
+// dense index of the recording threads, the file does not need os tids.
+std::atomic<uint32_t> sNextThread = 0;
+
+// set once the buffer of the thread was given back, a pool call from a
+// later key destructor is not recorded.
+thread_local bool tExited = false;
+
+// like PoolTrace, the buffer is given back by a pthread key destructor
+// because registering a thread_local destructor allocates.
+constexpr int KEY_UNSET = 0;
+constexpr int KEY_CREATING = 1;
+constexpr int KEY_READY = 2;
+std::atomic<int> sKeyState = KEY_UNSET;
+pthread_key_t sKey;
+
+}  // namespace
+
+// mapped, not new'd, the pool may be what operator new runs on. never
+// unmapped, the buffer of an exited thread is reused by a later one.
+struct PoolRecord::Buffer {
+  Buffer* mNext;
+  std::atomic<bool> mInUse;
+  uint32_t mThread;
+  // records before it are in the file already, under sFileMutex.
+  uint32_t mFlushed;
+  // written by the owning thread only, the release publishes its records.
+  std::atomic<uint32_t> mCount;
+  Record mRecords[RECORDS_PER_FLUSH];
+};
+
+std::atomic<bool> PoolRecord::sActive = false;
+thread_local PoolRecord::Buffer* PoolRecord::tBuffer = nullptr;
+std::atomic<PoolRecord::Buffer*> PoolRecord::sBuffers = nullptr;
+
+bool PoolRecord::start(const char* path) {
+  std::lock_guard<std::mutex> lock(sFileMutex);
+  if (sFd >= 0) {
+    MY_LOGD("ERROR, already recording");
+    return false;
+  }
+  const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    MY_LOGD("ERROR, failed to open %s", path);
+    return false;
+  }
+  FileHeader header;
+  memcpy(header.mMagic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+  header.mVersion = RECORD_VERSION;
+  header.mRecordSize = sizeof(Record);
+  if (!writeAll(fd, &header, sizeof(header))) {
+    MY_LOGD("ERROR, failed to write %s", path);
+    ::close(fd);
+    return false;
+  }
+  // what the threads kept since the last recording is not part of this one.
+  for (Buffer* buffer = sBuffers.load(std::memory_order_acquire); buffer;
+       buffer = buffer->mNext) {
+    buffer->mFlushed = buffer->mCount.load(std::memory_order_acquire);
+  }
+  sFd = fd;
+  sWriteFailed = false;
+  sStartNs.store(steadyNs(), std::memory_order_relaxed);
+  sActive.store(true, std::memory_order_release);
+  return true;
+}
+
+bool PoolRecord::stop() {
+  sActive.store(false, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(sFileMutex);
+  if (sFd < 0) {
+    return false;
+  }
+  for (Buffer* buffer = sBuffers.load(std::memory_order_acquire); buffer;
+       buffer = buffer->mNext) {
+    flush(*buffer, buffer->mCount.load(std::memory_order_acquire));
+  }
+  const bool ok = ::close(sFd) == 0 && !sWriteFailed;
+  sFd = -1;
+  if (!ok) {
+    MY_LOGD("ERROR, failed to write the recording");
+  }
+  return ok;
+}
+
+void PoolRecord::append(Op op, Source source, size_t size, const void* p) {
+  Buffer* buffer = tBuffer;
+  if (!buffer) {
+    buffer = attachBuffer();
+    if (!buffer) {
+      return;
+    }
+  }
+  const uint32_t count = buffer->mCount.load(std::memory_order_relaxed);
+  Record& record = buffer->mRecords[count];
+  record.mTimestamp =
+      steadyNs() - sStartNs.load(std::memory_order_relaxed);
+  record.mObject = reinterpret_cast<uintptr_t>(p);
+  record.mSize = size > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(size);
+  record.mOp = op;
+  record.mSource = source;
+  record.mReserved = 0;
+  buffer->mCount.store(count + 1, std::memory_order_release);
+  if (count + 1 == RECORDS_PER_FLUSH) {
+    std::lock_guard<std::mutex> lock(sFileMutex);
+    flush(*buffer, count + 1);
+    buffer->mFlushed = 0;
+    buffer->mCount.store(0, std::memory_order_relaxed);
+  }
+}
+
+bool PoolRecord::flush(Buffer& buffer, uint32_t count) {
+  const uint32_t from = buffer.mFlushed;
+  buffer.mFlushed = count;
+  if (sFd < 0 || count <= from) {
+    return true;
+  }
+  ChunkHeader header{buffer.mThread, count - from};
+  const bool ok = writeAll(sFd, &header, sizeof(header)) &&
+                  writeAll(sFd, buffer.mRecords + from,
+                           sizeof(Record) * header.mCount);
+  sWriteFailed |= !ok;
+  return ok;
+}
+
+bool PoolRecord::ensureKey() {
+  int state = sKeyState.load(std::memory_order_acquire);
+  while (state != KEY_READY) {
+    if (state == KEY_UNSET &&
+        sKeyState.compare_exchange_strong(state, KEY_CREATING,
+                                          std::memory_order_acquire)) {
+      if (pthread_key_create(&sKey, &PoolRecord::releaseBuffer) != 0) {
+        sKeyState.store(KEY_UNSET, std::memory_order_release);
+        return false;
+      }
+      sKeyState.store(KEY_READY, std::memory_order_release);
+      return true;
+    }
+    // another thread is creating the key, wait for it rather than drop
+    // the record. pthread_key_create does not allocate, it can not come
+    // back here on the creating thread.
+    std::this_thread::yield();
+    state = sKeyState.load(std::memory_order_acquire);
+  }
+  return true;
+}
+
+PoolRecord::Buffer* PoolRecord::attachBuffer() {
+  if (tExited || !ensureKey()) {
+    return nullptr;
+  }
+  Buffer* buffer = sBuffers.load(std::memory_order_acquire);
+  for (; buffer; buffer = buffer->mNext) {
+    bool inUse = false;
+    if (buffer->mInUse.compare_exchange_strong(inUse, true,
+                                               std::memory_order_acquire)) {
+      break;
+    }
+  }
+  if (!buffer) {
+    const size_t pageSize = BackingStore::getPageSize();
+    const size_t bytes = (sizeof(Buffer) + pageSize - 1) & ~(pageSize - 1);
+    void* p = BackingStore::mapPages(bytes);
+    if (!p) {
+      return nullptr;
+    }
+    // fresh pages are zero, only the links need to be set.
+    buffer = static_cast<Buffer*>(p);
+    buffer->mInUse.store(true, std::memory_order_relaxed);
+    Buffer* head = sBuffers.load(std::memory_order_relaxed);
+    do {
+      buffer->mNext = head;
+    } while (!sBuffers.compare_exchange_weak(head, buffer,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+  }
+  {
+    // a released buffer was flushed empty, the thread index changes under
+    // the lock so stop() never writes records under the wrong thread.
+    std::lock_guard<std::mutex> lock(sFileMutex);
+    buffer->mThread = sNextThread.fetch_add(1, std::memory_order_relaxed);
+  }
+  tBuffer = buffer;
+  pthread_setspecific(sKey, buffer);
+  return buffer;
+}
+
+void PoolRecord::releaseBuffer(void* p) {
+  Buffer* buffer = static_cast<Buffer*>(p);
+  {
+    std::lock_guard<std::mutex> lock(sFileMutex);
+    flush(*buffer, buffer->mCount.load(std::memory_order_relaxed));
+    buffer->mFlushed = 0;
+    buffer->mCount.store(0, std::memory_order_relaxed);
+  }
+  buffer->mInUse.store(false, std::memory_order_release);
+  tBuffer = nullptr;
+  tExited = true;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "common.h"
+
+/**
+ * Records every allocation and free of GlobalMemPool and the ObjectPool
+ * engines to a file, to replay a real workload against the pools offline
+ * with tools/pool_replay. unlike PoolTrace a full buffer is not
+ * overwritten: each thread fills a buffer of its own and appends it to the
+ * file when it is full, at thread exit and at stop(). records are still
+ * lost when a thread can not map its buffer or the pthread key can not be
+ * created, when a write to the file fails (stop() returns false then) and
+ * for calls a thread makes after its buffer was given back at exit.
+ *
+ * compiled in with POOL_RECORD 1 only, POOL_RECORD_EVENT is empty otherwise
+ * and PoolRecord.cpp is not needed. even then nothing is recorded before
+ * start().
+ */
+class PoolRecord {
+ public:
+  enum Op : uint8_t {
+    ALLOCATE = 1,
+    DEALLOCATE,
+  };
+  enum Source : uint8_t {
+    GLOBAL_MEM_POOL = 0,
+    OBJECT_POOL,
+  };
+
+  // 24 bytes. the layout is the file format.
+  struct Record {
+    uint64_t mTimestamp;  // ns since start()
+    // the address. it identifies the object while it is alive, the replay
+    // pairs a free with the latest allocation of the same address.
+    uint64_t mObject;
+    // clamped to UINT32_MAX, larger allocations replay at that size.
+    uint32_t mSize;
+    uint8_t mOp;
+    uint8_t mSource;
+    uint16_t mReserved;
+  };
+  static_assert(sizeof(Record) == 24, "record layout");
+
+#ifndef POOL_RECORD_PER_FLUSH
+#define POOL_RECORD_PER_FLUSH 4096
+#endif
+  constexpr static uint32_t RECORDS_PER_FLUSH = POOL_RECORD_PER_FLUSH;
+
+  // record to `path`, truncating it. false when it can not be opened or a
+  // recording is running already.
+  static bool start(const char* path);
+  // write what the threads buffered so far and close the file. records
+  // made by other threads while it runs may be lost.
+  static bool stop();
+
+  // an allocation is recorded after it succeeded and a free before the
+  // cell is given back, so in time order the free of an address always
+  // comes before its next allocation.
+  static inline void record(Op op, Source source, size_t size,
+                            const void* p) {
+    if (__builtin_expect(sActive.load(std::memory_order_relaxed), 0)) {
+      append(op, source, size, p);
+    }
+  }
+
+ private:
+  struct Buffer;
+
+  static void append(Op op, Source source, size_t size, const void* p);
+  static Buffer* attachBuffer();
+  // appends the records of the thread on exit and gives the buffer back.
+  static void releaseBuffer(void* buffer);
+  static bool ensureKey();
+  // under sFileMutex.
+  static bool flush(Buffer& buffer, uint32_t count);
+
+  static std::atomic<bool> sActive;
+  static thread_local Buffer* tBuffer;
+  // every buffer ever mapped, pushed to the front and never removed.
+  static std::atomic<Buffer*> sBuffers;
+};
+
+#if POOL_RECORD
+#define POOL_RECORD_EVENT(...) PoolRecord::record(__VA_ARGS__)
+#else
+#define POOL_RECORD_EVENT(...)
+#endif
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <memory_resource>
+
+#include "MemoryPool4.h"
+
+namespace strm {
+
+/**
+ * std::pmr::memory_resource over GlobalMemPool, so pmr containers use the
+ * pooled cells without template changes. cells are MemoryPool4::BYTE_ALIGNMENT
+ * aligned, over-aligned requests go to `upstream`.
+ *
+ * every globalpool_resource with the same upstream is interchangeable, they
+ * all share the one GlobalMemPool.
+ */
+class globalpool_resource : public std::pmr::memory_resource {
+ public:
+  explicit globalpool_resource(
+      std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+      : mpUpstream(upstream) {}
+
+  std::pmr::memory_resource* upstream_resource() const {
+    return mpUpstream;
+  }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    if (alignment > MemoryPool4::BYTE_ALIGNMENT) {
+      return mpUpstream->allocate(bytes, alignment);
+    }
+    // a zero sized request still needs a unique pointer.
+    void* p = GlobalMemPool::getInstance().allocate(bytes ? bytes : 1);
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+    if (alignment > MemoryPool4::BYTE_ALIGNMENT) {
+      mpUpstream->deallocate(p, bytes, alignment);
+      return;
+    }
+    GlobalMemPool::getInstance().deallocate(p, bytes ? bytes : 1);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other)
+      const noexcept override {
+    if (this == &other) {
+      return true;
+    }
+    auto* resource = dynamic_cast<const globalpool_resource*>(&other);
+    return resource && resource->mpUpstream->is_equal(*mpUpstream);
+  }
+
+ private:
+  std::pmr::memory_resource* mpUpstream;
+};
+
+/**
+ * std::pmr::memory_resource over a private MemoryPool4 collection of one
+ * cell size, for containers whose nodes all have the same size (list, map,
+ * unordered_map). requests larger than `blockSize` or over-aligned go to
+ * `upstream`.
+ *
+ * @warning the resource must outlive every container using it.
+ */
+class fixedpool_resource : public std::pmr::memory_resource {
+ public:
+  constexpr static uint32_t DEFAULT_BLOCKS_PER_ARENA = 1024;
+
+  explicit fixedpool_resource(
+      size_t blockSize,
+      uint32_t blocksPerArena = DEFAULT_BLOCKS_PER_ARENA,
+      std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+      : mAllocInfo(static_cast<uint32_t>(blockSize ? blockSize : 1),
+                   blocksPerArena, HEADERLESS_CELL)
+      , mpUpstream(upstream) {}
+
+  fixedpool_resource(const fixedpool_resource&) = delete;
+  fixedpool_resource& operator=(const fixedpool_resource&) = delete;
+
+  size_t block_size() const {
+    return mAllocInfo.mCellBodySize;
+  }
+  std::pmr::memory_resource* upstream_resource() const {
+    return mpUpstream;
+  }
+
+ protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    if (!fitsCell(bytes, alignment)) {
+      return mpUpstream->allocate(bytes, alignment);
+    }
+    void* p = MemoryPool4::allocate(mAllocInfo, mArenaCollection);
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+    if (!fitsCell(bytes, alignment)) {
+      mpUpstream->deallocate(p, bytes, alignment);
+      return;
+    }
+    MemoryPool4::deallocate(mAllocInfo, p);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other)
+      const noexcept override {
+    return this == &other;
+  }
+
+ private:
+  bool fitsCell(size_t bytes, size_t alignment) const {
+    return bytes <= mAllocInfo.mCellBodySize &&
+           alignment <= MemoryPool4::BYTE_ALIGNMENT;
+  }
+
+ private:
+  AllocInfo mAllocInfo;
+  MemoryPool4::ArenaCollection mArenaCollection;
+  std::pmr::memory_resource* mpUpstream;
+};
+
+};
@@ -0,0 +1,225 @@
+#include "PoolStats.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define POOL_STATS_HAS_UNIX_SOCKET 1
+#else
+#define POOL_STATS_HAS_UNIX_SOCKET 0
+#endif
+
+#include "common.h"
+#define TAG_LOG PoolStats
+
+namespace {
+
+constexpr const char* UNIX_SOCKET_PREFIX = "unix:";
+
+struct Metric {
+  const char* mName;
+  const char* mType;
+  uint64_t PoolStatsSnapshot::* mValue;
+};
+
+// json keys drop the "pool_" prefix and the "_total" suffix.
+constexpr Metric METRICS[] = {
+  {"pool_allocations_total", "counter", &PoolStatsSnapshot::mAllocations},
+  {"pool_frees_total", "counter", &PoolStatsSnapshot::mFrees},
+  {"pool_cas_retries_total", "counter", &PoolStatsSnapshot::mCasRetries},
+  {"pool_arenas_created_total", "counter", &PoolStatsSnapshot::mArenasCreated},
+  {"pool_arenas_released_total", "counter",
+   &PoolStatsSnapshot::mArenasReleased},
+  {"pool_live_cells", "gauge", &PoolStatsSnapshot::mLiveCells},
+  {"pool_peak_live_cells", "gauge", &PoolStatsSnapshot::mPeakLiveCells},
+  {"pool_bytes_requested_total", "counter",
+   &PoolStatsSnapshot::mBytesRequested},
+  {"pool_bytes_reserved", "gauge", &PoolStatsSnapshot::mBytesReserved},
+};
+
+void append(std::string& out, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void append(std::string& out, const char* fmt, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (n > 0) {
+    out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+  }
+}
+
+// pool names are chosen by the program, quote what json and prometheus
+// label values can not hold as is.
+std::string escape(const std::string& s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+std::string jsonKey(const char* metric) {
+  std::string key(metric + 5);  // "pool_"
+  const size_t suffix = key.rfind("_total");
+  if (suffix != std::string::npos && suffix + 6 == key.size()) {
+    key.resize(suffix);
+  }
+  return key;
+}
+
+std::string formatJson(const std::vector<PoolStatsSnapshot>& snapshots) {
+  std::string out = "{\"pools\":[";
+  for (size_t i = 0; i < snapshots.size(); ++i) {
+    const PoolStatsSnapshot& s = snapshots[i];
+    append(out, "%s{\"pool\":\"%s\",\"cell_size\":%zu", i ? "," : "",
+           escape(s.mPool).c_str(), s.mCellSize);
+    for (const Metric& metric : METRICS) {
+      append(out, ",\"%s\":%" PRIu64, jsonKey(metric.mName).c_str(),
+             s.*metric.mValue);
+    }
+    out += "}";
+  }
+  out += "]}\n";
+  return out;
+}
+
+std::string formatPrometheus(const std::vector<PoolStatsSnapshot>& snapshots) {
+  std::string out;
+  for (const Metric& metric : METRICS) {
+    append(out, "# TYPE %s %s\n", metric.mName, metric.mType);
+    for (const PoolStatsSnapshot& s : snapshots) {
+      append(out, "%s{pool=\"%s\",cell_size=\"%zu\"} %" PRIu64 "\n",
+             metric.mName, escape(s.mPool).c_str(), s.mCellSize,
+             s.*metric.mValue);
+    }
+  }
+  return out;
+}
+
+bool writeFile(const std::string& path, const std::string& text) {
+  // readers never see a half written file.
+  const std::string tmpPath = path + ".tmp";
+  FILE* file = fopen(tmpPath.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+  bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool writeUnixSocket(const std::string& path, const std::string& text) {
+#if POOL_STATS_HAS_UNIX_SOCKET
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = connect(fd, reinterpret_cast<const sockaddr*>(&addr),
+                    sizeof(addr)) == 0;
+  for (size_t sent = 0; ok && sent < text.size();) {
+    ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+    ok = n > 0;
+    sent += ok ? static_cast<size_t>(n) : 0;
+  }
+  close(fd);
+  return ok;
+#else
+  (void)path;
+  (void)text;
+  return false;
+#endif  // POOL_STATS_HAS_UNIX_SOCKET
+}
+
+}  // namespace
+
+std::string formatStats(const std::vector<PoolStatsSnapshot>& snapshots,
+                        StatsFormat format) {
+  return format == StatsFormat::json ? formatJson(snapshots) :
+                                       formatPrometheus(snapshots);
+}
+
+PoolStatsExporter::PoolStatsExporter(std::string target, StatsFormat format)
+  : mTarget(std::move(target))
+  , mFormat(format) {}
+
+PoolStatsExporter::~PoolStatsExporter() {
+  stop();
+}
+
+void PoolStatsExporter::addSource(Source source) {
+  mSources.push_back(std::move(source));
+}
+
+bool PoolStatsExporter::exportNow() {
+  std::vector<PoolStatsSnapshot> snapshots;
+  for (const Source& source : mSources) {
+    std::vector<PoolStatsSnapshot> more = source();
+    snapshots.insert(snapshots.end(), more.begin(), more.end());
+  }
+  return write(formatStats(snapshots, mFormat));
+}
+
+bool PoolStatsExporter::write(const std::string& text) {
+  const size_t prefixLen = strlen(UNIX_SOCKET_PREFIX);
+  bool ok = mTarget.compare(0, prefixLen, UNIX_SOCKET_PREFIX) == 0 ?
+      writeUnixSocket(mTarget.substr(prefixLen), text) :
+      writeFile(mTarget, text);
+  if (!ok) {
+    MY_LOGD("ERROR, failed to export stats to %s", mTarget.c_str());
+  }
+  return ok;
+}
+
+void PoolStatsExporter::start(std::chrono::milliseconds period) {
+  std::unique_lock<std::mutex> _l(mMutex);
+  if (mThread.joinable()) {
+    return;
+  }
+  mStop = false;
+  mThread = std::thread([this, period]() {
+    std::unique_lock<std::mutex> _l(mMutex);
+    while (!mCond.wait_for(_l, period, [this]() { return mStop; })) {
+      _l.unlock();
+      exportNow();
+      _l.lock();
+    }
+  });
+}
+
+void PoolStatsExporter::stop() {
+  std::thread thread;
+  {
+    std::unique_lock<std::mutex> _l(mMutex);
+    mStop = true;
+    thread = std::move(mThread);
+  }
+  mCond.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "BackingStore.h"
+
+// what snapshot() of GlobalMemPool and ObjectPool report, one per size
+// class. mCellSize 0 stands for GlobalMemPool's large mappings.
+struct PoolStatsSnapshot {
+  std::string mPool;
+  size_t mCellSize = 0;
+  uint64_t mAllocations = 0;
+  uint64_t mFrees = 0;
+  uint64_t mCasRetries = 0;
+  uint64_t mArenasCreated = 0;
+  uint64_t mArenasReleased = 0;
+  uint64_t mLiveCells = 0;
+  uint64_t mPeakLiveCells = 0;
+  // summed over all allocations vs. the memory the pool holds now, their
+  // ratio to mAllocations * mCellSize and mLiveCells * mCellSize shows the
+  // internal and external fragmentation.
+  uint64_t mBytesRequested = 0;
+  uint64_t mBytesReserved = 0;
+};
+
+/**
+ * Counters of one size class or one pool, one cache line per possible cpu.
+ * a thread adds to the line of the cpu it runs on, so threads on different
+ * cpus do not write the same line. threads sharing a cpu do, the add stays
+ * atomic for them. reading sums the lines, the result is a snapshot and not
+ * a consistent cut across counters.
+ *
+ * the lines are mapped, not new'd, the pool may be what operator new runs
+ * on. when that fails every thread shares one line.
+ *
+ * compiled out with POOL_STATS 0, every counter then reads 0.
+ */
+class PoolStats {
+ public:
+  enum Counter : uint32_t {
+    ALLOCATIONS,
+    FREES,
+    // failed CAS while claiming or returning a cell, i.e. contention.
+    CAS_RETRIES,
+    ARENAS_CREATED,
+    ARENAS_RELEASED,
+    BYTES_REQUESTED,
+    COUNTER_COUNT,
+  };
+
+  // inline like the counting, a POOL_STATS 0 build needs no PoolStats.cpp
+  // unless it formats or exports snapshots.
+  PoolStats() {
+#if POOL_STATS
+    const uint32_t cpuCount = BackingStore::getCpuCount();
+    if (cpuCount <= 1) {
+      return;
+    }
+    const size_t pageSize = BackingStore::getPageSize();
+    const size_t bytes =
+        (sizeof(Stripe) * cpuCount + pageSize - 1) & ~(pageSize - 1);
+    void* p = BackingStore::mapPages(bytes);
+    if (!p) {
+      MY_LOGD("ERROR, failed to map counters of %u cpus", cpuCount);
+      return;
+    }
+    // fresh pages are zero, like the counters.
+    mpStripes = new (p) Stripe[cpuCount];
+    mStripeCount = cpuCount;
+    mStripesBytes = bytes;
+#endif  // POOL_STATS
+  }
+  ~PoolStats() {
+    if (mStripesBytes) {
+      BackingStore::unmapPages(mpStripes, mStripesBytes);
+    }
+  }
+  PoolStats(const PoolStats&) = delete;
+  PoolStats& operator=(const PoolStats&) = delete;
+
+  void add(Counter counter, uint64_t n = 1) {
+#if POOL_STATS
+    if (n) {
+      mpStripes[BackingStore::getCurrentCpu() % mStripeCount].mValues[counter]
+          .fetch_add(n, std::memory_order_relaxed);
+    }
+#else
+    (void)counter;
+    (void)n;
+#endif  // POOL_STATS
+  }
+
+  uint64_t get(Counter counter) const {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < mStripeCount; ++i) {
+      sum += mpStripes[i].mValues[counter].load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  // allocations minus frees now, raises the high-water mark. frees are read
+  // first, a free racing with the read can not make the count negative.
+  uint64_t sampleLive() {
+    uint64_t frees = get(FREES);
+    uint64_t allocations = get(ALLOCATIONS);
+    uint64_t live = allocations > frees ? allocations - frees : 0;
+    notePeak(live);
+    return live;
+  }
+  // the high-water mark is sampled, by sampleLive() and by callers which
+  // know the live count exactly.
+  void notePeak(uint64_t live) {
+    uint64_t peak = mPeakLive.load(std::memory_order_relaxed);
+    while (live > peak &&
+           !mPeakLive.compare_exchange_weak(peak, live,
+                                            std::memory_order_relaxed)) {
+    }
+  }
+  uint64_t getPeakLive() const {
+    return mPeakLive.load(std::memory_order_relaxed);
+  }
+
+  // the counters together with what the pool knows itself, `live` cells
+  // now and `reservedBytes` held.
+  PoolStatsSnapshot snapshot(std::string pool, size_t cellSize, uint64_t live,
+                             uint64_t reservedBytes) {
+    notePeak(live);
+    PoolStatsSnapshot snapshot;
+    snapshot.mPool = std::move(pool);
+    snapshot.mCellSize = cellSize;
+    snapshot.mAllocations = get(ALLOCATIONS);
+    snapshot.mFrees = get(FREES);
+    snapshot.mCasRetries = get(CAS_RETRIES);
+    snapshot.mArenasCreated = get(ARENAS_CREATED);
+    snapshot.mArenasReleased = get(ARENAS_RELEASED);
+    snapshot.mLiveCells = live;
+    snapshot.mPeakLiveCells = getPeakLive();
+    snapshot.mBytesRequested = get(BYTES_REQUESTED);
+    snapshot.mBytesReserved = reservedBytes;
+    return snapshot;
+  }
+
+ private:
+  struct alignas(64) Stripe {
+    std::array<std::atomic<uint64_t>, COUNTER_COUNT> mValues = {};
+  };
+  // one per possible cpu, or mFallback alone.
+  Stripe* mpStripes = &mFallback;
+  uint32_t mStripeCount = 1;
+  size_t mStripesBytes = 0;
+  Stripe mFallback;
+  std::atomic<uint64_t> mPeakLive = 0;
+};
+
+enum class StatsFormat {
+  json,
+  prometheus,
+};
+
+std::string formatStats(const std::vector<PoolStatsSnapshot>& snapshots,
+                        StatsFormat format);
+
+/**
+ * Writes the snapshots of its sources to `target` every period, from a
+ * thread of its own. the target is a file, replaced atomically each time,
+ * or "unix:<path>", a stream socket the text is sent to on a fresh
+ * connection each time.
+ */
+class PoolStatsExporter {
+ public:
+  using Source = std::function<std::vector<PoolStatsSnapshot>()>;
+
+  PoolStatsExporter(std::string target, StatsFormat format);
+  ~PoolStatsExporter();
+  PoolStatsExporter(const PoolStatsExporter&) = delete;
+  PoolStatsExporter& operator=(const PoolStatsExporter&) = delete;
+
+  // add sources before start().
+  void addSource(Source source);
+  // one export right away, false when the target could not be written.
+  bool exportNow();
+  void start(std::chrono::milliseconds period);
+  void stop();
+
+ private:
+  bool write(const std::string& text);
+
+ private:
+  const std::string mTarget;
+  const StatsFormat mFormat;
+  std::vector<Source> mSources;
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  bool mStop = false;
+};
@@ -0,0 +1,206 @@
+#include "PoolTrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "BackingStore.h"
+#define TAG_LOG PoolTrace
+
+// file layout: FileHeader, then per ring its RingHeader followed by
+// mCount events, oldest first. see tools/pool_trace_decode.cpp.
+namespace {
+
+constexpr char TRACE_MAGIC[8] = {'P', 'O', 'O', 'L', 'T', 'R', 'C', '1'};
+constexpr uint32_t TRACE_VERSION = 1;
+
+struct FileHeader {
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mEventSize;
+  // two (timestamp, steady_clock ns) pairs, taken when the first ring was
+  // attached and at dump time. timestamps are converted to ns linearly.
+  uint64_t mTicks0;
+  uint64_t mNs0;
+  uint64_t mTicks1;
+  uint64_t mNs1;
+};
+
+struct RingHeader {
+  uint64_t mTid;
+  uint64_t mCount;
+};
+
+uint64_t steadyNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t currentTid() {
+#if defined(__linux__)
+  return static_cast<uint64_t>(::syscall(SYS_gettid));
+#else
+  return std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+}
+
+struct Calibration {
+  Calibration() : mTicks(PoolTrace::now()), mNs(steadyNs()) {}
+  uint64_t mTicks;
+  uint64_t mNs;
+};
+
+const Calibration& getCalibration() {
+  static const Calibration sCalibration;
+  return sCalibration;
+}
+
+// set once the ring of the thread was given back, a pool call from a later
+// key destructor is not traced.
+thread_local bool tExited = false;
+
+// the ring is given back by a pthread key destructor rather than a
+// thread_local one. registering a thread_local destructor allocates, which
+// deadlocks when the first event is recorded from malloc during startup.
+// key destructors run after the thread_local ones, whose pool calls are
+// still traced.
+constexpr int KEY_UNSET = 0;
+constexpr int KEY_CREATING = 1;
+constexpr int KEY_READY = 2;
+std::atomic<int> sKeyState = KEY_UNSET;
+pthread_key_t sKey;
+
+}  // namespace
+
+thread_local PoolTrace::Ring* PoolTrace::tRing = nullptr;
+std::atomic<PoolTrace::Ring*> PoolTrace::sRings = nullptr;
+
+void PoolTrace::releaseRing(void* ring) {
+  static_cast<Ring*>(ring)->mInUse.store(false, std::memory_order_release);
+  tRing = nullptr;
+  tExited = true;
+}
+
+bool PoolTrace::ensureKey() {
+  int state = sKeyState.load(std::memory_order_acquire);
+  if (state == KEY_READY) {
+    return true;
+  }
+  if (state == KEY_UNSET &&
+      sKeyState.compare_exchange_strong(state, KEY_CREATING,
+                                        std::memory_order_acquire)) {
+    if (pthread_key_create(&sKey, &PoolTrace::releaseRing) != 0) {
+      sKeyState.store(KEY_UNSET, std::memory_order_release);
+      return false;
+    }
+    sKeyState.store(KEY_READY, std::memory_order_release);
+    return true;
+  }
+  // another thread is creating the key, this event is not traced.
+  return sKeyState.load(std::memory_order_acquire) == KEY_READY;
+}
+
+PoolTrace::Ring* PoolTrace::attachRing() {
+  if (tExited || !ensureKey()) {
+    return nullptr;
+  }
+  getCalibration();
+  Ring* ring = sRings.load(std::memory_order_acquire);
+  for (; ring; ring = ring->mNext) {
+    bool inUse = false;
+    if (ring->mInUse.compare_exchange_strong(inUse, true,
+                                             std::memory_order_acquire)) {
+      // the events of the exited thread are dropped.
+      ring->mHead.store(0, std::memory_order_release);
+      break;
+    }
+  }
+  if (!ring) {
+    const size_t pageSize = BackingStore::getPageSize();
+    const size_t bytes = (sizeof(Ring) + pageSize - 1) & ~(pageSize - 1);
+    void* p = BackingStore::mapPages(bytes);
+    if (!p) {
+      return nullptr;
+    }
+    // fresh pages are zero, only the links need to be set.
+    ring = static_cast<Ring*>(p);
+    ring->mInUse.store(true, std::memory_order_relaxed);
+    Ring* head = sRings.load(std::memory_order_relaxed);
+    do {
+      ring->mNext = head;
+    } while (!sRings.compare_exchange_weak(head, ring,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed));
+  }
+  ring->mTid.store(currentTid(), std::memory_order_relaxed);
+  tRing = ring;
+  pthread_setspecific(sKey, ring);
+  return ring;
+}
+
+bool PoolTrace::dump(const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    MY_LOGD("ERROR, failed to open %s", path);
+    return false;
+  }
+  const Calibration& calibration = getCalibration();
+  FileHeader header;
+  memcpy(header.mMagic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  header.mVersion = TRACE_VERSION;
+  header.mEventSize = sizeof(Event);
+  header.mTicks0 = calibration.mTicks;
+  header.mNs0 = calibration.mNs;
+  header.mTicks1 = now();
+  header.mNs1 = steadyNs();
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  std::vector<Event> events(EVENTS_PER_THREAD);
+  for (Ring* ring = sRings.load(std::memory_order_acquire); ok && ring;
+       ring = ring->mNext) {
+    const uint64_t head = ring->mHead.load(std::memory_order_acquire);
+    uint64_t first = head > EVENTS_PER_THREAD ? head - EVENTS_PER_THREAD : 0;
+    for (uint64_t i = first; i < head; ++i) {
+      const std::atomic<uint64_t>* slot =
+          ring->mSlots[i & (EVENTS_PER_THREAD - 1)].mWords;
+      Event& event = events[i - first];
+      event.mTimestamp = slot[0].load(std::memory_order_relaxed);
+      event.mPtr = slot[1].load(std::memory_order_relaxed);
+      const uint64_t sizeAndIdx = slot[2].load(std::memory_order_relaxed);
+      const uint64_t countAndType = slot[3].load(std::memory_order_relaxed);
+      event.mCellBodySize = static_cast<uint32_t>(sizeAndIdx);
+      event.mCellIdx = static_cast<uint32_t>(sizeAndIdx >> 32);
+      event.mCount = static_cast<uint32_t>(countAndType);
+      event.mType = static_cast<uint16_t>(countAndType >> 32);
+      event.mReserved = 0;
+    }
+    // the writer went on meanwhile, the oldest slots may hold newer events
+    // by now. like a seqlock reader, drop what could have been overwritten,
+    // including the slot of the event being written right now.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t headAfter = ring->mHead.load(std::memory_order_relaxed);
+    const uint64_t firstIntact = headAfter + 1 > EVENTS_PER_THREAD ?
+        headAfter + 1 - EVENTS_PER_THREAD : 0;
+    const uint64_t skip = std::min(head, std::max(first, firstIntact)) - first;
+    RingHeader ringHeader;
+    ringHeader.mTid = ring->mTid.load(std::memory_order_relaxed);
+    ringHeader.mCount = head - first - skip;
+    ok = fwrite(&ringHeader, sizeof(ringHeader), 1, file) == 1 &&
+         fwrite(events.data() + skip, sizeof(Event), ringHeader.mCount,
+                file) == ringHeader.mCount;
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok) {
+    MY_LOGD("ERROR, failed to write %s", path);
+  }
+  return ok;
+}
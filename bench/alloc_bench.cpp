@@ -0,0 +1,561 @@
+/**
+ * Every allocator engine of the repo, glibc malloc and std::make_shared
+ * through the same scenarios, for 1 to N threads:
+ *
+ *   churn     fixed size, each thread replaces a random one of 8 live cells
+ *   mixed     16 to 4096 bytes, small sizes weighted, a window of 256 cells
+ *   prodcons  producer threads allocate, consumer threads free, in pairs
+ *   burst     allocate 1024 cells, free them all, repeat
+ *
+ * each engine, scenario and thread count runs in a forked child, so peak
+ * RSS is that of the run alone and every run starts from fresh pools. one
+ * line per run is printed as CSV, or as JSON lines with -j:
+ *
+ *   engine,scenario,threads,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb
+ *
+ * an op is one allocation or one free. every 16th op is timed, the
+ * percentiles include the cost of reading the clock.
+ *
+ *   g++ -std=c++17 -O2 -pthread -DLOG_LEVEL=0 -I.. alloc_bench.cpp \
+ *       ../MemoryPool.cpp ../MemoryPool2.cpp ../MemoryPool3.cpp \
+ *       ../MemoryPool4.cpp ../BackingStore.cpp ../PoolStats.cpp \
+ *       -o alloc_bench
+ *   ./alloc_bench [-t max threads] [-n ops per thread] [-e engine]
+ *                 [-s scenario] [-j]
+ *
+ * MemoryPool, MemoryPool2 and MemoryPool3 are not thread safe, their calls
+ * are serialized by a mutex. MemoryPool3 holds 8 cells per size, it only
+ * runs churn on one thread. fixed size engines skip mixed. Linux only.
+ */
+#include "ObjectPool.h"
+// the older engines were written to be built alone, their headers define
+// the same macros.
+#undef TAG_LOG
+#include "MemoryPool2.h"
+#undef TAG_LOG
+#undef COUNT_NUM_TRAILING_ZEROES_UINT32
+#undef COUNT_NUM_TRAILING_ZEROES_UINT64
+#undef COUNT_NUM_LEADING_ZEROES_UINT32
+#undef COUNT_NUM_LEADING_ZEROES_UINT64
+#include "MemoryPool3.h"
+// last, it defines MAX_CELL_SIZE_POW2_BASE as a macro.
+#include "MemoryPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t FIXED_SIZE = 64;
+constexpr size_t CHURN_WINDOW = 8;
+constexpr size_t MIXED_WINDOW = 256;
+constexpr size_t QUEUE_CAPACITY = 256;
+constexpr size_t BURST = 1024;
+constexpr uint64_t SAMPLE_EVERY = 16;
+
+struct Payload {
+  char mBytes[FIXED_SIZE];
+};
+
+// xorshift, the scenarios should not time a heavy generator.
+struct Random {
+  explicit Random(uint64_t seed) : mState(seed * 0x9E3779B97F4A7C15ULL | 1) {}
+  uint64_t next() {
+    mState ^= mState << 13;
+    mState ^= mState >> 7;
+    mState ^= mState << 17;
+    return mState;
+  }
+  uint64_t mState;
+};
+
+size_t mixedSize(Random& random) {
+  // three quarters of the cells are 64 bytes or less.
+  static const size_t sSizes[16] = {
+    16, 16, 24, 24, 32, 32, 40, 48, 48, 56, 64, 64, 128, 256, 1024, 4096,
+  };
+  return sSizes[random.next() & 15];
+}
+
+// counts ops and times every SAMPLE_EVERY-th of them.
+class Recorder {
+ public:
+  template<typename _Op>
+  void op(_Op&& operation) {
+    if (++mOps % SAMPLE_EVERY != 0) {
+      operation();
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    operation();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    mSamples.push_back(static_cast<uint32_t>(std::min<int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        UINT32_MAX)));
+  }
+  uint64_t mOps = 0;
+  std::vector<uint32_t> mSamples;
+};
+
+/**
+ * Engines. each has
+ *   Handle                what allocate() hands out, default constructible
+ *                         and movable
+ *   MIXED_SIZES           whether allocate() honours the size
+ *   MAX_LIVE              cells the engine can hold per size, 0 unlimited
+ *   MAX_THREADS           0 unlimited
+ *   Engine(maxLive)       the most cells the scenario keeps at once
+ *   allocate(size), release(handle)
+ */
+struct Block {
+  void* mPtr = nullptr;
+  size_t mSize = 0;
+};
+
+template<typename _Pool>
+class LockedPoolEngine {
+ public:
+  using Handle = Block;
+  constexpr static bool MIXED_SIZES = true;
+  constexpr static size_t MAX_LIVE = 0;
+  constexpr static int MAX_THREADS = 0;
+  explicit LockedPoolEngine(size_t) {}
+  Handle allocate(size_t size) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    Handle handle{_Pool::allocate(size), size};
+    static_cast<char*>(handle.mPtr)[0] = 1;
+    return handle;
+  }
+  void release(Handle& handle) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    _Pool::deallocate(handle.mPtr, handle.mSize);
+    handle.mPtr = nullptr;
+  }
+
+ private:
+  std::mutex mMutex;
+};
+
+// the static allocate()/deallocate() of the older engines, not thread safe.
+using MemoryPoolEngine = LockedPoolEngine<MemoryPool>;
+using MemoryPool2Engine = LockedPoolEngine<MemoryPool2>;
+
+class MemoryPool3Engine : public LockedPoolEngine<MemoryPool3> {
+ public:
+  constexpr static size_t MAX_LIVE = 8;
+  constexpr static int MAX_THREADS = 1;
+  using LockedPoolEngine::LockedPoolEngine;
+};
+
+class GlobalMemPoolEngine {
+ public:
+  using Handle = Block;
+  constexpr static bool MIXED_SIZES = true;
+  constexpr static size_t MAX_LIVE = 0;
+  constexpr static int MAX_THREADS = 0;
+  explicit GlobalMemPoolEngine(size_t) {}
+  Handle allocate(size_t size) {
+    Handle handle{mPool.allocate(size), size};
+    static_cast<char*>(handle.mPtr)[0] = 1;
+    return handle;
+  }
+  void release(Handle& handle) {
+    mPool.deallocate(handle.mPtr, handle.mSize);
+    handle.mPtr = nullptr;
+  }
+
+ private:
+  GlobalMemPool& mPool = GlobalMemPool::getInstance();
+};
+
+class MallocEngine {
+ public:
+  using Handle = Block;
+  constexpr static bool MIXED_SIZES = true;
+  constexpr static size_t MAX_LIVE = 0;
+  constexpr static int MAX_THREADS = 0;
+  explicit MallocEngine(size_t) {}
+  Handle allocate(size_t size) {
+    Handle handle{malloc(size), size};
+    static_cast<char*>(handle.mPtr)[0] = 1;
+    return handle;
+  }
+  void release(Handle& handle) {
+    free(handle.mPtr);
+    handle.mPtr = nullptr;
+  }
+};
+
+// the bitmap engine, any thread may release.
+class ObjectPoolEngine {
+ public:
+  using Pool = strm::ObjectPool<Payload>;
+  using Handle = Pool::ptr_type;
+  constexpr static bool MIXED_SIZES = false;
+  constexpr static size_t MAX_LIVE = 0;
+  constexpr static int MAX_THREADS = 0;
+  explicit ObjectPoolEngine(size_t maxLive)
+      : mPool(pool_config{maxLive, Pool::spec_type::value(),
+                          exhaust_action::wait}) {}
+  Handle allocate(size_t) {
+    Handle handle = mPool.acquire_ptr();
+    handle->mBytes[0] = 1;
+    return handle;
+  }
+  void release(Handle& handle) { handle.reset(); }
+
+ private:
+  Pool mPool;
+};
+
+template<bool _Strm>
+class MakeSharedEngine {
+ public:
+  using Handle = std::shared_ptr<Payload>;
+  constexpr static bool MIXED_SIZES = false;
+  constexpr static size_t MAX_LIVE = 0;
+  constexpr static int MAX_THREADS = 0;
+  explicit MakeSharedEngine(size_t) {}
+  Handle allocate(size_t) {
+    Handle handle = _Strm ? strm::make_shared<Payload>() :
+                            std::make_shared<Payload>();
+    handle->mBytes[0] = 1;
+    return handle;
+  }
+  void release(Handle& handle) { handle.reset(); }
+};
+
+// single producer, single consumer, the consumer frees what it pops.
+template<typename _Handle>
+class Queue {
+ public:
+  bool push(_Handle& handle) {
+    const size_t tail = mTail.load(std::memory_order_relaxed);
+    if (tail - mHead.load(std::memory_order_acquire) == QUEUE_CAPACITY) {
+      return false;
+    }
+    mSlots[tail % QUEUE_CAPACITY] = std::move(handle);
+    mTail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(_Handle& handle) {
+    const size_t head = mHead.load(std::memory_order_relaxed);
+    if (mTail.load(std::memory_order_acquire) == head) {
+      return false;
+    }
+    handle = std::move(mSlots[head % QUEUE_CAPACITY]);
+    mHead.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  alignas(64) std::atomic<size_t> mHead{0};
+  alignas(64) std::atomic<size_t> mTail{0};
+  _Handle mSlots[QUEUE_CAPACITY];
+};
+
+/**
+ * Scenarios. workers() gives the threads started for `threads`, maxLive()
+ * the cells kept at once over all of them, and run() is the body of one
+ * worker doing about `ops` ops.
+ */
+struct Churn {
+  static int workers(int threads) { return threads; }
+  static size_t maxLive(int threads) { return CHURN_WINDOW * threads; }
+  template<typename _Engine>
+  static void run(_Engine& engine, int worker, uint64_t ops,
+                  Recorder& recorder, void*) {
+    typename _Engine::Handle live[CHURN_WINDOW];
+    for (auto& handle : live) {
+      recorder.op([&] { handle = engine.allocate(FIXED_SIZE); });
+    }
+    Random random(worker + 1);
+    for (uint64_t i = CHURN_WINDOW * 2; i < ops; i += 2) {
+      auto& handle = live[random.next() % CHURN_WINDOW];
+      recorder.op([&] { engine.release(handle); });
+      recorder.op([&] { handle = engine.allocate(FIXED_SIZE); });
+    }
+    for (auto& handle : live) {
+      recorder.op([&] { engine.release(handle); });
+    }
+  }
+};
+
+struct Mixed {
+  static int workers(int threads) { return threads; }
+  static size_t maxLive(int threads) { return MIXED_WINDOW * threads; }
+  template<typename _Engine>
+  static void run(_Engine& engine, int worker, uint64_t ops,
+                  Recorder& recorder, void*) {
+    std::vector<typename _Engine::Handle> live(MIXED_WINDOW);
+    Random random(worker + 1);
+    for (auto& handle : live) {
+      recorder.op([&] { handle = engine.allocate(mixedSize(random)); });
+    }
+    for (uint64_t i = MIXED_WINDOW * 2; i < ops; i += 2) {
+      auto& handle = live[random.next() % MIXED_WINDOW];
+      const size_t size = mixedSize(random);
+      recorder.op([&] { engine.release(handle); });
+      recorder.op([&] { handle = engine.allocate(size); });
+    }
+    for (auto& handle : live) {
+      recorder.op([&] { engine.release(handle); });
+    }
+  }
+};
+
+// `threads` pairs, even workers produce into the queue of the pair and odd
+// ones consume from it.
+struct ProdCons {
+  static int workers(int threads) { return threads * 2; }
+  static size_t maxLive(int threads) {
+    return (QUEUE_CAPACITY + 2) * threads;
+  }
+  template<typename _Engine>
+  static void run(_Engine& engine, int worker, uint64_t ops,
+                  Recorder& recorder, void* queues) {
+    using Handle = typename _Engine::Handle;
+    Queue<Handle>& queue = static_cast<Queue<Handle>*>(queues)[worker / 2];
+    const uint64_t cells = ops / 2;
+    Handle handle;
+    for (uint64_t i = 0; i < cells; ++i) {
+      if (worker % 2 == 0) {
+        recorder.op([&] { handle = engine.allocate(FIXED_SIZE); });
+        while (!queue.push(handle)) {
+          std::this_thread::yield();
+        }
+      } else {
+        while (!queue.pop(handle)) {
+          std::this_thread::yield();
+        }
+        recorder.op([&] { engine.release(handle); });
+      }
+    }
+  }
+};
+
+struct Burst {
+  static int workers(int threads) { return threads; }
+  static size_t maxLive(int threads) { return BURST * threads; }
+  template<typename _Engine>
+  static void run(_Engine& engine, int, uint64_t ops, Recorder& recorder,
+                  void*) {
+    std::vector<typename _Engine::Handle> live(BURST);
+    for (uint64_t done = 0; done < ops; done += BURST * 2) {
+      for (auto& handle : live) {
+        recorder.op([&] { handle = engine.allocate(FIXED_SIZE); });
+      }
+      for (auto& handle : live) {
+        recorder.op([&] { engine.release(handle); });
+      }
+    }
+  }
+};
+
+struct Result {
+  uint64_t mOps;
+  double mOpsPerSec;
+  uint32_t mP50;
+  uint32_t mP99;
+  uint32_t mP999;
+};
+
+template<typename _Engine, typename _Scenario>
+bool supports(int threads) {
+  if (!_Engine::MIXED_SIZES && std::is_same_v<_Scenario, Mixed>) {
+    return false;
+  }
+  if (_Engine::MAX_THREADS && threads > _Engine::MAX_THREADS) {
+    return false;
+  }
+  return !_Engine::MAX_LIVE ||
+         _Scenario::maxLive(threads) <= _Engine::MAX_LIVE;
+}
+
+uint32_t percentile(const std::vector<uint32_t>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const size_t idx = static_cast<size_t>(fraction * (sorted.size() - 1));
+  return sorted[idx];
+}
+
+template<typename _Engine, typename _Scenario>
+Result measure(int threads, uint64_t opsPerWorker) {
+  const int workers = _Scenario::workers(threads);
+  _Engine engine(_Scenario::maxLive(threads));
+  std::vector<Queue<typename _Engine::Handle>> queues(threads);
+  std::vector<Recorder> recorders(workers);
+  for (Recorder& recorder : recorders) {
+    recorder.mSamples.reserve(opsPerWorker / SAMPLE_EVERY + CHURN_WINDOW);
+  }
+  std::atomic<bool> go{false};
+  std::vector<std::thread> pool;
+  for (int w = 0; w < workers; ++w) {
+    pool.emplace_back([&, w]() {
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      _Scenario::run(engine, w, opsPerWorker, recorders[w], queues.data());
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true);
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  Result result{};
+  std::vector<uint32_t> samples;
+  for (const Recorder& recorder : recorders) {
+    result.mOps += recorder.mOps;
+    samples.insert(samples.end(), recorder.mSamples.begin(),
+                   recorder.mSamples.end());
+  }
+  std::sort(samples.begin(), samples.end());
+  result.mOpsPerSec = result.mOps / elapsed.count();
+  result.mP50 = percentile(samples, 0.5);
+  result.mP99 = percentile(samples, 0.99);
+  result.mP999 = percentile(samples, 0.999);
+  return result;
+}
+
+struct Options {
+  int mMaxThreads = std::max(1u, std::thread::hardware_concurrency());
+  uint64_t mOps = 1000000;
+  const char* mEngine = nullptr;
+  const char* mScenario = nullptr;
+  bool mJson = false;
+};
+
+// runs one measurement in a child, the parent reads the result from a pipe
+// and the peak RSS from wait4().
+template<typename _Engine, typename _Scenario>
+void runOne(const Options& options, const char* engineName,
+            const char* scenarioName, int threads) {
+  if ((options.mEngine && strcmp(options.mEngine, engineName) != 0) ||
+      (options.mScenario && strcmp(options.mScenario, scenarioName) != 0) ||
+      !supports<_Engine, _Scenario>(threads)) {
+    return;
+  }
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    return;
+  }
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    const Result result =
+        measure<_Engine, _Scenario>(threads, options.mOps);
+    const bool ok = write(fds[1], &result, sizeof(result)) == sizeof(result);
+    _exit(ok ? 0 : 1);
+  }
+  close(fds[1]);
+  Result result;
+  const bool got = read(fds[0], &result, sizeof(result)) == sizeof(result);
+  close(fds[0]);
+  int status = 0;
+  struct rusage usage {};
+  wait4(pid, &status, 0, &usage);
+  if (!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s %s %d threads failed, status %d\n", engineName,
+            scenarioName, threads, status);
+    return;
+  }
+  if (options.mJson) {
+    printf("{\"engine\":\"%s\",\"scenario\":\"%s\",\"threads\":%d,"
+           "\"ops\":%llu,\"ops_per_sec\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,"
+           "\"p999_ns\":%u,\"peak_rss_kb\":%ld}\n",
+           engineName, scenarioName, threads,
+           static_cast<unsigned long long>(result.mOps), result.mOpsPerSec,
+           result.mP50, result.mP99, result.mP999, usage.ru_maxrss);
+  } else {
+    printf("%s,%s,%d,%llu,%.0f,%u,%u,%u,%ld\n", engineName, scenarioName,
+           threads, static_cast<unsigned long long>(result.mOps),
+           result.mOpsPerSec, result.mP50, result.mP99, result.mP999,
+           usage.ru_maxrss);
+  }
+}
+
+template<typename _Engine>
+void runEngine(const Options& options, const char* engineName,
+               int threads) {
+  runOne<_Engine, Churn>(options, engineName, "churn", threads);
+  runOne<_Engine, Mixed>(options, engineName, "mixed", threads);
+  runOne<_Engine, ProdCons>(options, engineName, "prodcons", threads);
+  runOne<_Engine, Burst>(options, engineName, "burst", threads);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    const bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "-t") == 0 && hasValue) {
+      options.mMaxThreads = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "-n") == 0 && hasValue) {
+      options.mOps = std::max(1LL, atoll(argv[++i]));
+    } else if (strcmp(argv[i], "-e") == 0 && hasValue) {
+      options.mEngine = argv[++i];
+    } else if (strcmp(argv[i], "-s") == 0 && hasValue) {
+      options.mScenario = argv[++i];
+    } else if (strcmp(argv[i], "-j") == 0) {
+      options.mJson = true;
+    } else {
+      fprintf(stderr,
+              "usage: %s [-t max threads] [-n ops per thread] [-e engine] "
+              "[-s scenario] [-j]\n"
+              "engines: memorypool memorypool2 memorypool3 globalmempool "
+              "objectpool malloc make_shared strm_make_shared\n"
+              "scenarios: churn mixed prodcons burst\n", argv[0]);
+      return 2;
+    }
+  }
+  if (!options.mJson) {
+    printf("engine,scenario,threads,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,"
+           "peak_rss_kb\n");
+  }
+  // 1, 2, 4, ... and the maximum itself.
+  std::vector<int> threadCounts;
+  for (int threads = 1; threads < options.mMaxThreads; threads *= 2) {
+    threadCounts.push_back(threads);
+  }
+  threadCounts.push_back(options.mMaxThreads);
+  for (int threads : threadCounts) {
+    runEngine<MemoryPoolEngine>(options, "memorypool", threads);
+    runEngine<MemoryPool2Engine>(options, "memorypool2", threads);
+    runEngine<MemoryPool3Engine>(options, "memorypool3", threads);
+    runEngine<GlobalMemPoolEngine>(options, "globalmempool", threads);
+    runEngine<ObjectPoolEngine>(options, "objectpool", threads);
+    runEngine<MallocEngine>(options, "malloc", threads);
+    runEngine<MakeSharedEngine<false>>(options, "make_shared", threads);
+    runEngine<MakeSharedEngine<true>>(options, "strm_make_shared", threads);
+  }
+  return 0;
+}
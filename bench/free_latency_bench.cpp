@@ -0,0 +1,101 @@
+/**
+ * Latency of freeing pooled cells whose headers are no longer in cache, the
+ * sized GlobalMemPool::deallocate(p, size) against the unsized one and the
+ * raw MemoryPool4 arenas with and without masking.
+ *
+ *   g++ -std=c++17 -O2 -pthread -DLOG_LEVEL=0 -I.. free_latency_bench.cpp \
+ *       ../MemoryPool4.cpp ../BackingStore.cpp ../PoolStats.cpp \
+ *       -o free_latency_bench
+ *   ./free_latency_bench [cells]
+ */
+#include "MemoryPool4.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+constexpr size_t CELL_SIZE = 48;
+constexpr int ROUNDS = 5;
+// larger than the last level cache, walking it evicts the cell headers.
+constexpr size_t EVICT_BYTES = 64 << 20;
+
+static std::vector<unsigned char> gEvict(EVICT_BYTES);
+
+static void evictCaches() {
+  for (size_t i = 0; i < gEvict.size(); i += 64) {
+    gEvict[i]++;
+  }
+}
+
+// frees `cells` in random order with cold caches, returns ns per free.
+template<typename _Free>
+static double timeFree(std::vector<void*>& cells, _Free&& freeCell) {
+  static std::mt19937 rng(42);
+  std::shuffle(cells.begin(), cells.end(), rng);
+  evictCaches();
+  auto start = std::chrono::steady_clock::now();
+  for (void* p : cells) {
+    freeCell(p);
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count() / cells.size();
+}
+
+static void report(const char* name, double total, int rounds) {
+  printf("%-36s %8.2f ns/free\n", name, total / rounds);
+}
+
+static void benchGlobal(size_t count) {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  std::vector<void*> cells(count);
+  double sized = 0;
+  double unsized = 0;
+  for (int r = 0; r < ROUNDS; ++r) {
+    for (void*& p : cells) {
+      p = pool.allocate(CELL_SIZE);
+    }
+    sized += timeFree(cells, [&](void* p) { pool.deallocate(p, CELL_SIZE); });
+    pool.flushThreadCache();
+#if !HEADERLESS_CELL
+    for (void*& p : cells) {
+      p = pool.allocate(CELL_SIZE);
+    }
+    unsized += timeFree(cells, [&](void* p) { pool.deallocate(p); });
+    pool.flushThreadCache();
+#endif  // !HEADERLESS_CELL
+  }
+  report("GlobalMemPool sized", sized, ROUNDS);
+#if !HEADERLESS_CELL
+  report("GlobalMemPool unsized", unsized, ROUNDS);
+#endif  // !HEADERLESS_CELL
+}
+
+static void benchArena(const char* name, size_t count, bool alignedArena) {
+  AllocInfo info(CELL_SIZE, MemoryPool4::MAX_CELLS_PER_ARENA, HEADERLESS_CELL,
+                 nullptr, alignedArena);
+  MemoryPool4::ArenaCollection collection;
+  std::vector<void*> cells(count);
+  double total = 0;
+  for (int r = 0; r < ROUNDS; ++r) {
+    for (void*& p : cells) {
+      p = MemoryPool4::allocate(info, collection);
+    }
+    total += timeFree(cells,
+                      [&](void* p) { MemoryPool4::deallocate(info, p); });
+  }
+  report(name, total, ROUNDS);
+}
+
+int main(int argc, char** argv) {
+  const size_t count = argc > 1 ? std::atoi(argv[1]) : 1 << 20;
+  printf("%zu cells of %zu bytes, freed in random order, cold cache\n",
+         count, CELL_SIZE);
+  benchGlobal(count);
+  benchArena("MemoryPool4 header lookup", count, false);
+  benchArena("MemoryPool4 masked lookup", count, true);
+  return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * ObjectPool engines under contention: every thread acquires a few objects
+ * and releases them again, for 1 to 64 threads.
+ *
+ *   g++ -std=c++17 -O2 -pthread -DLOG_LEVEL=0 -I.. objectpool_bench.cpp \
+ *       ../MemoryPool4.cpp ../BackingStore.cpp ../PoolStats.cpp \
+ *       -o objectpool_bench
+ *   ./objectpool_bench [iterations per thread]
+ */
+#include "ObjectPool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+struct Payload {
+  explicit Payload(int id) : mId(id) {}
+  int mId;
+  char mBytes[52];
+};
+
+constexpr int HELD_PER_THREAD = 4;
+
+// `_Handle` is what the pool hands out, shared_ptr or pool_ptr.
+template<class _Pool, class _Handle>
+double run(int threadCount, int iterations) {
+  _Pool pool(pool_config{static_cast<size_t>(threadCount * HELD_PER_THREAD),
+                         _Pool::spec_type::value(), exhaust_action::wait});
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&pool, &go, iterations, t]() {
+      _Handle held[HELD_PER_THREAD];
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      for (int i = 0; i < iterations; ++i) {
+        for (auto& p : held) {
+          if constexpr (std::is_same_v<_Handle, std::shared_ptr<Payload>>) {
+            p = pool.acquire(t);
+          } else {
+            p = pool.acquire_ptr(t);
+          }
+        }
+        for (auto& p : held) {
+          p.reset();
+        }
+      }
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  // one operation = one acquire + one release
+  double ops = static_cast<double>(threadCount) * iterations * HELD_PER_THREAD;
+  return ops / elapsed.count() / 1e6;
+}
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? std::atoi(argv[1]) : 100000;
+  using Bitmap = strm::ObjectPool<Payload>;
+  using FreeList =
+      strm::ObjectPool<Payload, static_user_spec<ps_type::mpmc, false>>;
+  using SharedPtr = std::shared_ptr<Payload>;
+  printf("Mops/s %16s %16s %16s %16s\n", "bitmap", "freelist",
+         "bitmap pool_ptr", "freelist pool_ptr");
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    double bitmap = run<Bitmap, SharedPtr>(threads, iterations);
+    double freeList = run<FreeList, SharedPtr>(threads, iterations);
+    double bitmapPtr = run<Bitmap, Bitmap::ptr_type>(threads, iterations);
+    double freeListPtr =
+        run<FreeList, FreeList::ptr_type>(threads, iterations);
+    printf("%2d thr %16.2f %16.2f %16.2f %16.2f\n", threads,
+           bitmap, freeList, bitmapPtr, freeListPtr);
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * pmr containers on the pool resources against the standard ones.
+ *
+ *   g++ -std=c++17 -O2 -pthread -DLOG_LEVEL=0 -I.. pmr_bench.cpp \
+ *       ../MemoryPool4.cpp ../BackingStore.cpp ../PoolStats.cpp -o pmr_bench
+ *   ./pmr_bench [rounds]
+ */
+#include "PoolResource.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+constexpr int ELEMENTS = 1000;
+
+// every round builds the containers up and tears them down again, the
+// resource sees allocation and deallocation in container order.
+static void workload(std::pmr::memory_resource* resource, int rounds) {
+  for (int r = 0; r < rounds; ++r) {
+    std::pmr::vector<int> vector(resource);
+    std::pmr::list<int> list(resource);
+    std::pmr::unordered_map<int, int> map(resource);
+    std::pmr::vector<std::pmr::string> strings(resource);
+    for (int i = 0; i < ELEMENTS; ++i) {
+      vector.push_back(i);
+      list.push_back(i);
+      map.emplace(i, i);
+      strings.emplace_back("a string longer than the small buffer");
+    }
+    for (int i = 0; i < ELEMENTS; i += 2) {
+      map.erase(i);
+      list.pop_front();
+    }
+  }
+}
+
+static void run(const char* name, std::pmr::memory_resource* resource,
+                int rounds) {
+  workload(resource, 1);  // warm up
+  auto start = std::chrono::steady_clock::now();
+  workload(resource, rounds);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("%-32s %10.2f ms\n", name, elapsed.count());
+}
+
+int main(int argc, char** argv) {
+  const int rounds = argc > 1 ? std::atoi(argv[1]) : 200;
+  run("new_delete_resource", std::pmr::new_delete_resource(), rounds);
+  {
+    std::pmr::unsynchronized_pool_resource resource;
+    run("unsynchronized_pool_resource", &resource, rounds);
+  }
+  {
+    std::pmr::synchronized_pool_resource resource;
+    run("synchronized_pool_resource", &resource, rounds);
+  }
+  {
+    strm::globalpool_resource resource;
+    run("strm::globalpool_resource", &resource, rounds);
+  }
+  {
+    // list and unordered_map nodes fit, the rest goes to GlobalMemPool.
+    strm::globalpool_resource upstream;
+    strm::fixedpool_resource resource(32, 1024, &upstream);
+    run("strm::fixedpool_resource(32)", &resource, rounds);
+  }
+  return 0;
+}
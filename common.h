@@ -1,3 +1,5 @@
+#pragma once
+
 #include <iostream>
 #include <memory>
 #include <string.h>
@@ -7,9 +9,44 @@
 #include <thread>
 #include <sstream>
 
+#ifndef LOG_LEVEL
 #define LOG_LEVEL 1
+#endif
 #define N_DEBUG 1
 
+// cells carry no CellHeader. arenas are aligned to a power of two and
+// deallocate finds the arena by masking the cell pointer, so the size class
+// (or the size passed to deallocate) must be known when freeing.
+#ifndef HEADERLESS_CELL
+#define HEADERLESS_CELL 0
+#endif
+
+// GlobalMemPool keeps one set of arena collections per cpu instead of the
+// per-thread caches. idle memory grows with the cores, not with the threads.
+#ifndef GLOBAL_MEM_POOL_PER_CPU
+#define GLOBAL_MEM_POOL_PER_CPU 0
+#endif
+
+// allocation, free, contention and arena counters of GlobalMemPool and
+// ObjectPool, see PoolStats.h. off by default: the ObjectPool engines count
+// every release and CAS retry with an atomic add, about a tenth of a
+// single-threaded acquire/release. 0 compiles the counting out.
+#ifndef POOL_STATS
+#define POOL_STATS 0
+#endif
+
+// per-thread binary event rings of the pool operations, see PoolTrace.h. 0
+// compiles the tracing out.
+#ifndef POOL_TRACE
+#define POOL_TRACE 0
+#endif
+
+// record every allocation and free to a file for tools/pool_replay, see
+// PoolRecord.h. 0 compiles the recording out.
+#ifndef POOL_RECORD
+#define POOL_RECORD 0
+#endif
+
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 
 #define MY_LOGD(fmt, arg...) if (LOG_LEVEL >= 2) { printf("[%s/%d][%s] " fmt"\n", __FILENAME__, __LINE__, __func__, ##arg); }
@@ -0,0 +1,406 @@
+/**
+ * malloc/free and global operator new/delete replaced by GlobalMemPool, to
+ * compare unchanged programs against the glibc allocator.
+ *
+ *   g++ -std=c++17 -O2 -fPIC -shared -pthread -ftls-model=initial-exec \
+ *       -DLOG_LEVEL=0 -DGLOBAL_MEM_POOL_IMMORTAL -I.. pool_malloc.cpp \
+ *       ../MemoryPool4.cpp ../BackingStore.cpp ../PoolStats.cpp -ldl \
+ *       -o libpoolmalloc.so
+ *   LD_PRELOAD=./libpoolmalloc.so ./service
+ *
+ * POOL_MALLOC_DECAY_MS=<ms> starts the decay thread, so idle arenas give
+ * their pages back like glibc's trimming does.
+ *
+ * built with -DPOOL_STATS=1, POOL_MALLOC_STATS=<file or unix:path> exports
+ * the counters of every size class each POOL_MALLOC_STATS_MS (1000 by
+ * default), as Prometheus text or as JSON with POOL_MALLOC_STATS_FORMAT=json.
+ *
+ * built with -DPOOL_RECORD=1 and ../PoolRecord.cpp, POOL_MALLOC_RECORD=<file>
+ * records every allocation and free of the process for tools/pool_replay.
+ *
+ * free() gets no size, it is read from the cell header, so the library
+ * needs cell headers (HEADERLESS_CELL 0). sizes above the size class table
+ * fall back to GlobalMemPool's own mappings. requests aligned beyond
+ * malloc's alignment take a larger cell and keep the pointer to it in an
+ * AlignedHeader right before the aligned address. memory from before the
+ * library was loaded is not the pool's, free() drops it and realloc() hands
+ * it to the realloc of the next library, glibc's.
+ *
+ * Linux only. fork() while another thread holds a pool lock leaves the
+ * child with that lock taken, like any allocator without atfork handlers.
+ */
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <dlfcn.h>
+
+#include "MemoryPool4.h"
+
+#if HEADERLESS_CELL
+#error "free() needs the size from the cell header, build with HEADERLESS_CELL 0"
+#endif
+#if LOG_LEVEL > 0
+#error "logging allocates, build with -DLOG_LEVEL=0"
+#endif
+
+namespace {
+
+// malloc memory is aligned for any fundamental type. requests are rounded
+// up to a multiple of it, cells of such sizes start at that alignment.
+constexpr size_t MALLOC_ALIGNMENT = alignof(std::max_align_t);
+static_assert(MemoryPool4::CELL_START_ALIGNMENT % MALLOC_ALIGNMENT == 0,
+              "cells must start at malloc alignment");
+
+constexpr uint64_t ALIGNED_MARKER = 0x5A5A0A11C0FFEE5AULL;
+
+// sits right before an over-aligned allocation, the guard at the offset of
+// CellHeader::mGuard tells it apart from a cell.
+struct alignas(MemoryPool4::BYTE_ALIGNMENT) AlignedHeader {
+  void* mpCell = nullptr;
+  uint64_t mGuard = ALIGNED_MARKER;
+};
+static_assert(sizeof(AlignedHeader) == sizeof(MemoryPool4::CellHeader) &&
+              offsetof(AlignedHeader, mGuard) ==
+              offsetof(MemoryPool4::CellHeader, mGuard),
+              "guards of aligned and cell headers must overlap");
+
+inline GlobalMemPool& pool() {
+  return GlobalMemPool::getInstance();
+}
+
+inline bool isPowerOf2(size_t n) {
+  return n && (n & (n - 1)) == 0;
+}
+
+// the size asked from the pool, a zero sized request still needs a unique
+// pointer.
+inline size_t requestSize(size_t size) {
+  return size ? (size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1)
+              : MALLOC_ALIGNMENT;
+}
+
+void* poolMalloc(size_t size) {
+  if (size > SIZE_MAX - MALLOC_ALIGNMENT) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  void* p = pool().allocate(requestSize(size));
+  if (!p) {
+    errno = ENOMEM;
+  }
+  return p;
+}
+
+void* poolAlignedMalloc(size_t alignment, size_t size) {
+  if (alignment <= MALLOC_ALIGNMENT) {
+    return poolMalloc(size);
+  }
+  if (size > SIZE_MAX - alignment - sizeof(AlignedHeader)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  unsigned char* cell = static_cast<unsigned char*>(
+      poolMalloc(size + alignment + sizeof(AlignedHeader)));
+  if (!cell) {
+    return nullptr;
+  }
+  uintptr_t aligned = (reinterpret_cast<uintptr_t>(cell) +
+                       sizeof(AlignedHeader) + alignment - 1) &
+                      ~(alignment - 1);
+  AlignedHeader* header = reinterpret_cast<AlignedHeader*>(aligned) - 1;
+  new (header) AlignedHeader();
+  header->mpCell = cell;
+  return header + 1;
+}
+
+// the cell an allocation lives in, different from `p` when over-aligned.
+inline void* cellOf(void* p) {
+  const AlignedHeader* header = static_cast<const AlignedHeader*>(p) - 1;
+  return header->mGuard == ALIGNED_MARKER ? header->mpCell : p;
+}
+
+void poolFree(void* p) {
+  if (!p) {
+    return;
+  }
+  // memory from before the library was loaded is not ours, it is dropped.
+  pool().deallocate(cellOf(p));
+}
+
+// sized delete, the size picks the size class like in poolMalloc and the
+// cell header is not read. the arena is found by masking the pointer, so
+// memory from before the library was loaded and large allocations take the
+// unsized path.
+void poolSizedFree(void* p, size_t size) {
+  if (!p) {
+    return;
+  }
+  if (!pool().isInArenas(p)) {
+    poolFree(p);
+    return;
+  }
+  pool().deallocate(p, requestSize(size));
+}
+
+size_t poolUsableSize(void* p) {
+  if (!p) {
+    return 0;
+  }
+  void* cell = cellOf(p);
+  size_t cellSize = pool().getUsableSize(cell);
+  if (cellSize == 0) {
+    return 0;
+  }
+  return cellSize - (static_cast<unsigned char*>(p) -
+                     static_cast<unsigned char*>(cell));
+}
+
+using ReallocFn = void* (*)(void*, size_t);
+
+// resolved on the first foreign realloc, dlsym may allocate itself.
+ReallocFn nextRealloc() {
+  static std::atomic<ReallocFn> sNext{nullptr};
+  ReallocFn next = sNext.load(std::memory_order_acquire);
+  if (!next) {
+    next = reinterpret_cast<ReallocFn>(dlsym(RTLD_NEXT, "realloc"));
+    sNext.store(next, std::memory_order_release);
+  }
+  return next;
+}
+
+void* poolRealloc(void* p, size_t size) {
+  if (!p) {
+    return poolMalloc(size);
+  }
+  if (size == 0) {
+    poolFree(p);
+    return nullptr;
+  }
+  const size_t usable = poolUsableSize(p);
+  if (usable == 0) {
+    // not a cell, its size is only known to the allocator it came from.
+    ReallocFn next = nextRealloc();
+    if (!next) {
+      errno = EINVAL;
+      return nullptr;
+    }
+    return next(p, size);
+  }
+  // keep the cell unless it is more than twice the request, the size
+  // classes are finer than that.
+  if (size <= usable && size > usable / 2) {
+    return p;
+  }
+  void* q = poolMalloc(size);
+  if (!q) {
+    return nullptr;
+  }
+  memcpy(q, p, size < usable ? size : usable);
+  poolFree(p);
+  return q;
+}
+
+void* newImpl(size_t size, size_t alignment) {
+  for (;;) {
+    if (void* p = poolAlignedMalloc(alignment, size)) {
+      return p;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+void* newNothrowImpl(size_t size, size_t alignment) noexcept {
+  try {
+    return newImpl(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+__attribute__((constructor)) void startDecay() {
+  const char* period = getenv("POOL_MALLOC_DECAY_MS");
+  if (period && atoi(period) > 0) {
+    pool().startDecayThread(std::chrono::milliseconds(atoi(period)));
+  }
+}
+
+__attribute__((constructor)) void startStats() {
+  const char* target = getenv("POOL_MALLOC_STATS");
+  if (!target || !*target) {
+    return;
+  }
+  const char* format = getenv("POOL_MALLOC_STATS_FORMAT");
+  const char* period = getenv("POOL_MALLOC_STATS_MS");
+  // never destroyed like the pool, the program may still allocate while
+  // static destructors run.
+  alignas(PoolStatsExporter) static unsigned char
+      sStorage[sizeof(PoolStatsExporter)];
+  PoolStatsExporter* exporter = new (sStorage) PoolStatsExporter(
+      target, format && strcmp(format, "json") == 0 ? StatsFormat::json :
+                                                      StatsFormat::prometheus);
+  exporter->addSource([]() { return pool().snapshot(); });
+  exporter->start(std::chrono::milliseconds(
+      period && atoi(period) > 0 ? atoi(period) : 1000));
+}
+
+#if POOL_RECORD
+__attribute__((constructor)) void startRecord() {
+  const char* path = getenv("POOL_MALLOC_RECORD");
+  if (path && *path) {
+    PoolRecord::start(path);
+  }
+}
+
+// runs after the static destructors of the program, what exit handlers
+// registered later free is not recorded.
+__attribute__((destructor)) void stopRecord() {
+  PoolRecord::stop();
+}
+#endif  // POOL_RECORD
+
+}  // namespace
+
+extern "C" {
+
+__attribute__((visibility("default"))) void* malloc(size_t size) {
+  return poolMalloc(size);
+}
+
+__attribute__((visibility("default"))) void free(void* p) {
+  poolFree(p);
+}
+
+__attribute__((visibility("default"))) void* calloc(size_t n, size_t size) {
+  if (size && n > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  // cells are reused without clearing, only fresh pages read as zero.
+  void* p = poolMalloc(n * size);
+  if (p) {
+    memset(p, 0, n * size);
+  }
+  return p;
+}
+
+__attribute__((visibility("default"))) void* realloc(void* p, size_t size) {
+  return poolRealloc(p, size);
+}
+
+__attribute__((visibility("default"))) int posix_memalign(
+    void** out, size_t alignment, size_t size) {
+  if (!isPowerOf2(alignment) || alignment % sizeof(void*) != 0) {
+    return EINVAL;
+  }
+  void* p = poolAlignedMalloc(alignment, size);
+  if (!p) {
+    return ENOMEM;
+  }
+  *out = p;
+  return 0;
+}
+
+__attribute__((visibility("default"))) void* aligned_alloc(
+    size_t alignment, size_t size) {
+  if (!isPowerOf2(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return poolAlignedMalloc(alignment, size);
+}
+
+__attribute__((visibility("default"))) void* memalign(
+    size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+__attribute__((visibility("default"))) void* valloc(size_t size) {
+  return poolAlignedMalloc(BackingStore::getPageSize(), size);
+}
+
+__attribute__((visibility("default"))) void* pvalloc(size_t size) {
+  const size_t pageSize = BackingStore::getPageSize();
+  return poolAlignedMalloc(pageSize, (size + pageSize - 1) & ~(pageSize - 1));
+}
+
+__attribute__((visibility("default"))) size_t malloc_usable_size(void* p) {
+  return poolUsableSize(p);
+}
+
+}  // extern "C"
+
+void* operator new(size_t size) {
+  return newImpl(size, MALLOC_ALIGNMENT);
+}
+void* operator new[](size_t size) {
+  return newImpl(size, MALLOC_ALIGNMENT);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return newNothrowImpl(size, MALLOC_ALIGNMENT);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return newNothrowImpl(size, MALLOC_ALIGNMENT);
+}
+void* operator new(size_t size, std::align_val_t alignment) {
+  return newImpl(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return newImpl(size, static_cast<size_t>(alignment));
+}
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return newNothrowImpl(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return newNothrowImpl(size, static_cast<size_t>(alignment));
+}
+
+// the aligned forms free like free(), the header knows where the cell is.
+void operator delete(void* p) noexcept {
+  poolFree(p);
+}
+void operator delete[](void* p) noexcept {
+  poolFree(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  poolFree(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  poolFree(p);
+}
+void operator delete(void* p, size_t size) noexcept {
+  poolSizedFree(p, size);
+}
+void operator delete[](void* p, size_t size) noexcept {
+  poolSizedFree(p, size);
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+  poolFree(p);
+}
+void operator delete[](void* p, std::align_val_t) noexcept {
+  poolFree(p);
+}
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  poolFree(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  poolFree(p);
+}
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  poolFree(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  poolFree(p);
+}
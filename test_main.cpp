@@ -9,6 +9,11 @@
 #include <iostream>
 #include <ctime>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <algorithm>
 
 #include "common.h"
 #define LOG_TAG MAIN
@@ -62,6 +67,677 @@ static void make_shared_strm() {
   }
 }
 
+struct Frame {
+  Frame() : mValid(true) {}
+  void reset() {}
+  bool mValid;
+};
+
+// more objects than one arena holds, every cell handed out must hold one
+// of the objects built with the pool.
+static void test_recycle_across_arenas() {
+  using Spec = static_user_spec<ps_type::mpsc, false, true>;
+  strm::ObjectPool<Frame, Spec> pool(
+      pool_config{5000, Spec::value(), exhaust_action::wait});
+  const size_t capacity = pool.capacity();
+  assertm(capacity >= 5000, "recycling pool holds at least pool_size");
+  std::vector<strm::ObjectPool<Frame, Spec>::ptr_type> frames;
+  for (size_t i = 0; i < capacity; ++i) {
+    frames.push_back(pool.acquire_ptr());
+    assertm(frames.back()->mValid, "object was not constructed");
+  }
+  assertm(!pool.try_acquire_ptr(), "pool should be exhausted");
+  frames.clear();
+  assertm(pool.available() == capacity, "objects not given back");
+}
+
+struct Slot {
+  Slot() : mValue(0) { sConstructed++; }
+  Slot(int value) : mValue(value) { sConstructed++; }
+  ~Slot() { sDestroyed++; }
+  void reset() {
+    mValue = 0;
+    sResets++;
+  }
+  int mValue;
+
+  static std::atomic<int> sConstructed;
+  static std::atomic<int> sDestroyed;
+  static std::atomic<int> sResets;
+};
+std::atomic<int> Slot::sConstructed = 0;
+std::atomic<int> Slot::sDestroyed = 0;
+std::atomic<int> Slot::sResets = 0;
+
+static void reset_slot_counts() {
+  Slot::sConstructed = 0;
+  Slot::sDestroyed = 0;
+  Slot::sResets = 0;
+}
+
+using WaitSpec = default_user_spec;
+using RingSpec = static_user_spec<ps_type::spsc, true>;
+using FreeListSpec = static_user_spec<ps_type::mpmc, false>;
+
+static void test_wait_and_timeout() {
+  strm::ObjectPool<Slot, WaitSpec> pool(
+      pool_config{2, WaitSpec::value(), exhaust_action::wait});
+  auto a = pool.acquire(1);
+  auto b = pool.acquire(2);
+  assertm(pool.available() == 0, "pool should be exhausted");
+  assertm(!pool.try_acquire(3), "exhausted pool handed out an object");
+
+  auto start = std::chrono::steady_clock::now();
+  assertm(!pool.acquire_for(std::chrono::milliseconds(20), 3),
+          "acquire_for should time out");
+  assertm(std::chrono::steady_clock::now() - start >=
+          std::chrono::milliseconds(20), "acquire_for returned too early");
+
+  // a release on another thread wakes the waiting acquire().
+  std::thread releaser([&a]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    a.reset();
+  });
+  auto c = pool.acquire(3);
+  releaser.join();
+  assertm(c && c->mValue == 3, "woken acquire got no object");
+
+  std::thread releaser2([&b]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    b.reset();
+  });
+  auto d = pool.acquire_for(std::chrono::seconds(5), 4);
+  releaser2.join();
+  assertm(d && d->mValue == 4, "acquire_for missed the release");
+  c.reset();
+  d.reset();
+  assertm(pool.available() == 2, "objects not given back");
+}
+
+static void test_grow() {
+  // arenas hold pool_size cells, so steps are not rounded up here.
+  {
+    grow_policy policy;
+    policy.mode = grow_mode::fixed_step;
+    policy.step = 4;
+    policy.max_size = 10;
+    strm::ObjectPool<Slot, WaitSpec> pool(
+        pool_config{4, WaitSpec::value(), exhaust_action::grow, policy});
+    std::vector<std::shared_ptr<Slot>> held;
+    for (int i = 0; i < 5; ++i) {
+      held.push_back(pool.acquire(i));
+    }
+    assertm(pool.capacity() == 8, "fixed step should add 4");
+    for (int i = 5; i < 10; ++i) {
+      held.push_back(pool.acquire(i));
+    }
+    assertm(pool.capacity() == 10, "growth should stop at max_size");
+    assertm(!pool.try_acquire(10), "grew beyond max_size");
+    assertm(!pool.acquire_for(std::chrono::milliseconds(1), 10),
+            "grew beyond max_size");
+    for (int i = 0; i < 10; ++i) {
+      assertm(held[i]->mValue == i, "objects overlap");
+    }
+  }
+  {
+    grow_policy policy;
+    policy.mode = grow_mode::geometric;
+    policy.factor = 2;
+    strm::ObjectPool<Slot, WaitSpec> pool(
+        pool_config{4, WaitSpec::value(), exhaust_action::grow, policy});
+    std::vector<std::shared_ptr<Slot>> held;
+    for (int i = 0; i < 5; ++i) {
+      held.push_back(pool.acquire(i));
+    }
+    assertm(pool.capacity() == 8, "geometric growth should double");
+    for (int i = 5; i < 9; ++i) {
+      held.push_back(pool.acquire(i));
+    }
+    assertm(pool.capacity() == 16, "geometric growth should double");
+  }
+  {
+    grow_policy policy;
+    policy.mode = grow_mode::fixed_step;
+    policy.grow_threshold = 1;
+    strm::ObjectPool<Slot, WaitSpec> pool(
+        pool_config{4, WaitSpec::value(), exhaust_action::grow, policy});
+    auto a = pool.acquire(0);
+    auto b = pool.acquire(1);
+    assertm(pool.capacity() == 4, "grew before the threshold");
+    auto c = pool.acquire(2);
+    assertm(pool.capacity() == 8, "should grow at the threshold");
+    assertm(pool.available() == 5, "grown objects not available");
+  }
+}
+
+static void test_ring_full_and_empty() {
+  strm::ObjectPool<Slot, RingSpec> pool(
+      pool_config{4, RingSpec::value(), exhaust_action::wait});
+  assertm(pool.available() == 4, "empty ring should be all available");
+  std::vector<strm::ObjectPool<Slot, RingSpec>::ptr_type> held;
+  for (int i = 0; i < 4; ++i) {
+    held.push_back(pool.acquire_ptr(i));
+  }
+  assertm(pool.available() == 0, "ring should be full");
+  assertm(!pool.try_acquire_ptr(4), "full ring handed out an object");
+  assertm(!pool.try_acquire(4), "full ring handed out an object");
+  assertm(!pool.acquire_for(std::chrono::milliseconds(1), 4),
+          "full ring handed out an object");
+  // released in FIFO order, the oldest cell is free again.
+  held.erase(held.begin());
+  assertm(pool.available() == 1, "released cell not available");
+  held.push_back(pool.acquire_ptr(4));
+  for (int i = 0; i < 4; ++i) {
+    assertm(held[i]->mValue == i + 1, "objects overlap");
+  }
+  held.clear();
+  assertm(pool.available() == 4, "objects not given back");
+
+  // producer and consumer on their own threads, the consumer releases in
+  // the order the producer acquired.
+  const int count = 10000;
+  std::mutex mutex;
+  std::deque<strm::ObjectPool<Slot, RingSpec>::ptr_type> queue;
+  std::thread consumer([&]() {
+    for (int expected = 0; expected < count;) {
+      strm::ObjectPool<Slot, RingSpec>::ptr_type p;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!queue.empty()) {
+          p = std::move(queue.front());
+          queue.pop_front();
+        }
+      }
+      if (!p) {
+        std::this_thread::yield();
+        continue;
+      }
+      assertm(p->mValue == expected, "ring broke the FIFO order");
+      ++expected;
+    }
+  });
+  for (int i = 0; i < count; ++i) {
+    auto p = pool.acquire_ptr(i);
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(std::move(p));
+  }
+  consumer.join();
+  assertm(pool.available() == 4, "objects not given back");
+}
+
+static void test_freelist_mpmc() {
+  const size_t capacity = 4;
+  strm::ObjectPool<Slot, FreeListSpec> pool(
+      pool_config{capacity, FreeListSpec::value(), exhaust_action::wait});
+  std::atomic<int> nextId = 1;
+  // two holders of the same cell would overwrite each other's value.
+  auto worker = [&pool, &nextId]() {
+    const int id = nextId++;
+    auto sp = pool.acquire(id);
+    auto p = pool.acquire_ptr(-id);
+    std::this_thread::yield();
+    assertm(sp->mValue == id && p->mValue == -id, "cell handed out twice");
+    sp->mValue = 0;
+    p->mValue = 0;
+  };
+  // each worker holds two objects, 3 threads never deadlock on 4 cells.
+  run(3, 5000, worker);
+  assertm(pool.available() == capacity, "objects lost");
+
+  std::vector<strm::ObjectPool<Slot, FreeListSpec>::ptr_type> held;
+  while (auto p = pool.try_acquire_ptr(0)) {
+    held.push_back(std::move(p));
+  }
+  assertm(held.size() == capacity && pool.available() == 0,
+          "released objects not available");
+}
+
+static void test_recycle() {
+  reset_slot_counts();
+  {
+    using Spec = static_user_spec<ps_type::mpmc, false, true>;
+    strm::ObjectPool<Slot, Spec> pool(
+        pool_config{4, Spec::value(), exhaust_action::wait});
+    assertm(Slot::sConstructed == 4, "objects not built with the pool");
+    for (int i = 0; i < 100; ++i) {
+      auto p = pool.acquire_ptr();
+      assertm(p->mValue == 0, "object not reset");
+      p->mValue = i + 1;
+    }
+    assertm(Slot::sConstructed == 4, "recycled objects built again");
+    assertm(Slot::sResets == 100, "released objects not reset");
+    assertm(Slot::sDestroyed == 0, "recycled objects destroyed");
+  }
+  assertm(Slot::sDestroyed == 4, "objects not destroyed with the pool");
+
+  reset_slot_counts();
+  {
+    using Spec = static_user_spec<ps_type::mpsc, false, true>;
+    strm::ObjectPool<Slot, Spec> pool(
+        pool_config{4, Spec::value(), exhaust_action::wait});
+    const int built = Slot::sConstructed;
+    assertm(built == static_cast<int>(pool.capacity()),
+            "objects not built with the pool");
+    std::vector<strm::ObjectPool<Slot, Spec>::ptr_type> held;
+    for (size_t i = 0; i < pool.capacity(); ++i) {
+      held.push_back(pool.acquire_ptr());
+    }
+    assertm(!pool.try_acquire_ptr(), "recycling pool should not grow");
+    held.clear();
+    assertm(Slot::sConstructed == built, "recycled objects built again");
+  }
+  assertm(Slot::sDestroyed == Slot::sConstructed,
+          "objects not destroyed with the pool");
+}
+
+template<class _Spec>
+static void test_pool_ptr_refcount() {
+  reset_slot_counts();
+  {
+    strm::ObjectPool<Slot, _Spec> pool(
+        pool_config{2, _Spec::value(), exhaust_action::wait});
+    using ptr_type = typename strm::ObjectPool<Slot, _Spec>::ptr_type;
+    ptr_type a = pool.acquire_ptr(7);
+    assertm(a.use_count() == 1 && pool.available() == 1, "fresh pool_ptr");
+    {
+      ptr_type b = a;
+      assertm(a.use_count() == 2 && b == a, "copy shares the object");
+      ptr_type c = std::move(b);
+      assertm(!b && c.use_count() == 2, "move keeps the count");
+      c = nullptr;
+      assertm(a.use_count() == 1, "reset drops a reference");
+    }
+    assertm(pool.available() == 1 && Slot::sDestroyed == 0,
+            "object released while referenced");
+    ptr_type d = pool.acquire_ptr(8);
+    d = a;
+    assertm(Slot::sDestroyed == 1 && pool.available() == 1,
+            "assignment did not release the old object");
+    assertm(d->mValue == 7 && a.use_count() == 2, "assignment shares");
+    a.reset();
+    d.reset();
+    assertm(Slot::sDestroyed == 2 && pool.available() == 2,
+            "last reference did not release the object");
+    assertm(a.use_count() == 0, "empty pool_ptr has no count");
+  }
+  assertm(Slot::sConstructed == Slot::sDestroyed, "objects leaked");
+}
+
+// blocks of every backing kind are aligned. mapped ones read zero when
+// fresh and again after a discard, a freed one is handed out again.
+static void test_backing_store() {
+  const BackingKind kinds[] = {BackingKind::heap, BackingKind::mmap,
+                               BackingKind::mmap_thp,
+                               BackingKind::mmap_hugetlb};
+  const size_t alignment = 64 << 10;
+  const size_t size = 256 << 10;
+  for (BackingKind kind : kinds) {
+    BackingStore store(kind, 4 << 20);
+    unsigned char* p =
+        static_cast<unsigned char*>(store.allocate(size, alignment));
+    assertm(p && reinterpret_cast<uintptr_t>(p) % alignment == 0,
+            "block not aligned");
+    assertm(store.contains(p) == (kind != BackingKind::heap),
+            "store does not know its block");
+    if (kind != BackingKind::heap) {
+      assertm(p[0] == 0 && p[size - 1] == 0, "fresh block not zero");
+      wirte_data(p, size);
+      BackingStore::discard(p, size);
+      assertm(p[0] == 0 && p[size - 1] == 0, "discarded range not zero");
+      store.deallocate(p, size, alignment);
+      void* q = store.allocate(size, alignment);
+      assertm(q == p, "freed block not reused");
+    }
+    wirte_data(p, size);
+    store.deallocate(p, size, alignment);
+  }
+  int onStack = 0;
+  BackingStore store(BackingKind::mmap);
+  assertm(!store.contains(&onStack), "foreign pointer in the store");
+}
+
+// the node of a thread is one of the machine's, read on a cpu of it.
+static void test_numa_node() {
+  const uint32_t nodeCount = BackingStore::getNumaNodeCount();
+  assertm(nodeCount >= 1, "no numa node");
+  uint32_t cpu = ~0u;
+  assertm(BackingStore::getCurrentNumaNode(&cpu) < nodeCount,
+          "thread on an unknown node");
+  assertm(cpu < BackingStore::getCpuCount(), "node read on an unknown cpu");
+  const size_t pageSize = BackingStore::getPageSize();
+  void* p = BackingStore::mapPages(pageSize);
+  BackingStore::bindToNumaNode(p, pageSize, nodeCount - 1);
+  wirte_data(p, pageSize);
+  BackingStore::unmapPages(p, pageSize);
+}
+
+// per cpu, threads migrating between cpus share the shards. every thread
+// checks its cells kept their value while the others churn.
+static void test_cpu_shards() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  std::atomic<uintptr_t> nextId = 1;
+  auto worker = [&pool, &nextId]() {
+    assertm(BackingStore::getCurrentCpu() < BackingStore::getCpuCount(),
+            "thread on an unknown cpu");
+    const uintptr_t id = nextId++;
+    std::vector<uintptr_t*> cells;
+    for (int round = 0; round < 20; ++round) {
+      for (size_t i = 0; i < 100; ++i) {
+        cells.push_back(static_cast<uintptr_t*>(pool.allocate(8 + i * 8)));
+        *cells.back() = id;
+      }
+      std::this_thread::yield();
+      for (size_t i = 0; i < cells.size(); ++i) {
+        assertm(*cells[i] == id, "cell handed out twice");
+        pool.deallocate(cells[i], 8 + i * 8);
+      }
+      cells.clear();
+    }
+  };
+  run(8, 1, worker);
+}
+
+// a freed cell is handed out again from the thread cache, and cells freed
+// by another thread are never handed out twice.
+static void test_thread_cache() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+#if !GLOBAL_MEM_POOL_PER_CPU
+  void* p = pool.allocate(24);
+  pool.deallocate(p, 24);
+  assertm(pool.allocate(24) == p, "freed cell not reused from the cache");
+  pool.deallocate(p, 24);
+#endif
+  const size_t count = 1000;
+  const int threadCount = 4;
+  std::vector<std::vector<int*>> cells(threadCount);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&pool, &cells, t]() {
+      for (size_t i = 0; i < count; ++i) {
+        int* cell = static_cast<int*>(pool.allocate(sizeof(int)));
+        *cell = t;
+        cells[t].push_back(cell);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+  // each thread frees what the next one allocated.
+  for (int t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&pool, &cells, t]() {
+      for (int* cell : cells[(t + 1) % threadCount]) {
+        assertm(*cell == (t + 1) % threadCount, "cell handed out twice");
+        pool.deallocate(cell, sizeof(int));
+      }
+      pool.flushThreadCache();
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+// bytes GlobalMemPool holds for cells of `cellSize`, released arenas
+// excluded.
+static size_t reserved_bytes(size_t cellSize) {
+  for (const PoolStatsSnapshot& s : GlobalMemPool::getInstance().snapshot()) {
+    if (s.mCellSize == cellSize) {
+      return s.mBytesReserved;
+    }
+  }
+  return 0;
+}
+
+// cells of an arena sit one stride apart, a cell header in front of each
+// unless HEADERLESS_CELL. with headers the size is read back from it and
+// an unsized free works.
+static void test_cell_headers() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  const size_t size = 64;
+  const size_t count = 64;
+  std::vector<void*> cells(count);
+  assertm(pool.allocateBulk(size, count, cells.data()) == count,
+          "bulk allocation fell short");
+  std::vector<void*> sorted(cells);
+  std::sort(sorted.begin(), sorted.end());
+  size_t stride = SIZE_MAX;
+  for (size_t i = 1; i < count; ++i) {
+    stride = std::min<size_t>(stride, static_cast<char*>(sorted[i]) -
+                                      static_cast<char*>(sorted[i - 1]));
+  }
+#if HEADERLESS_CELL
+  assertm(stride == size, "headerless cells not packed");
+  pool.deallocateBulk(cells.data(), count, size);
+#else
+  assertm(stride == size + sizeof(MemoryPool4::CellHeader),
+          "cell header missing");
+  for (void* cell : cells) {
+    assertm(pool.getUsableSize(cell) == size, "size not in the header");
+    pool.deallocate(cell);
+  }
+  char foreign[64] = {};
+  assertm(pool.getUsableSize(foreign + 32) == 0,
+          "foreign pointer taken for a cell");
+#endif
+}
+
+// a class with one cell per arena and no thread cache: a cell freed in one
+// of several full arenas is found again without a new arena.
+static void test_non_full_arena() {
+#if !GLOBAL_MEM_POOL_PER_CPU
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  const size_t size = 96 << 10;
+  std::vector<void*> cells;
+  for (int i = 0; i < 10; ++i) {
+    cells.push_back(pool.allocate(size));
+  }
+  const size_t reserved = reserved_bytes(pool.getCellSize(size));
+  pool.deallocate(cells[2], size);
+  assertm(pool.allocate(size) == cells[2], "freed cell not found again");
+  assertm(reserved_bytes(pool.getCellSize(size)) == reserved,
+          "arena created while one had a free cell");
+  for (void* cell : cells) {
+    pool.deallocate(cell, size);
+  }
+#endif
+}
+
+// more cells than one arena and one bitmap leaf hold, freed in a scattered
+// pattern and claimed again. every cell is distinct and keeps its value.
+static void test_many_arenas() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  const size_t size = 16;
+  const size_t count = 20000;
+  std::vector<size_t*> cells;
+  for (size_t i = 0; i < count; ++i) {
+    cells.push_back(static_cast<size_t*>(pool.allocate(size)));
+    *cells.back() = i;
+  }
+  for (size_t i = 0; i < count; i += 3) {
+    pool.deallocate(cells[i], size);
+    cells[i] = nullptr;
+  }
+  pool.flushThreadCache();
+  for (size_t i = 0; i < count; i += 3) {
+    cells[i] = static_cast<size_t*>(pool.allocate(size));
+    *cells[i] = i;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    assertm(*cells[i] == i, "cell handed out twice");
+  }
+  std::vector<size_t*> sorted(cells);
+  std::sort(sorted.begin(), sorted.end());
+  assertm(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end(),
+          "cell handed out twice");
+  for (size_t* cell : cells) {
+    pool.deallocate(cell, size);
+  }
+}
+
+// arenas emptied by frees give their pages back after a few decay passes
+// and are usable again afterwards.
+static void test_decay() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  const size_t size = 3000;
+  const size_t cellSize = pool.getCellSize(size);
+  std::vector<void*> cells;
+  for (int i = 0; i < 400; ++i) {
+    cells.push_back(pool.allocate(size));
+    wirte_data(cells.back(), size);
+  }
+  const size_t reserved = reserved_bytes(cellSize);
+  assertm(reserved >= cells.size() * cellSize, "arenas not reserved");
+  for (void* cell : cells) {
+    pool.deallocate(cell, size);
+  }
+  pool.flushThreadCache();
+  size_t released = 0;
+  for (int i = 0; i < 4; ++i) {
+    released += pool.decay();
+  }
+  assertm(released > 0, "decay released nothing");
+  assertm(reserved_bytes(cellSize) < reserved / 2,
+          "empty arenas not released");
+  for (void*& cell : cells) {
+    cell = pool.allocate(size);
+    wirte_data(cell, size);
+  }
+  for (void* cell : cells) {
+    pool.deallocate(cell, size);
+  }
+}
+
+// 8 byte classes up to 32, then 4 classes per doubling up to 4MB. walks
+// every class boundary, the size right above one wastes the most.
+static void test_size_classes() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  const size_t boundaries[][2] = {
+      {1, 8}, {8, 8}, {9, 16}, {32, 32}, {33, 40}, {64, 64}, {65, 80},
+      {81, 96}, {129, 160}, {1024, 1024}, {1025, 1280}, {1281, 1536},
+      {(1 << 20) + 1, 1280 << 10}, {4 << 20, 4 << 20}};
+  for (const auto& boundary : boundaries) {
+    assertm(pool.getCellSize(boundary[0]) == boundary[1],
+            "wrong size class");
+  }
+  assertm(pool.getCellSize(0) == 0 && pool.getCellSize((4 << 20) + 1) == 0,
+          "size not pooled has no class");
+  for (size_t cell = 8; cell < (4 << 20); cell = pool.getCellSize(cell + 1)) {
+    const size_t next = pool.getCellSize(cell + 1);
+    assertm(pool.getCellSize(cell) == cell && next > cell,
+            "class does not hold its own size");
+    assertm(cell < 32 || (next - cell - 1) * 4 <= cell + 1,
+            "rounding wastes more than 25%");
+#if !HEADERLESS_CELL
+    void* p = pool.allocate(cell + 1);
+    assertm(pool.getUsableSize(p) == next, "cell of the wrong class");
+    pool.deallocate(p, cell + 1);
+#endif
+  }
+}
+
+// sizes above the largest class get a mapping of their own, a freed one is
+// kept and handed out again to a request of about the same size.
+static void test_large_allocation() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  pool.trimLargeCache();
+  const size_t size = (4 << 20) + 1;
+  void* p = pool.allocate(size + 8192);
+  assertm(p && !pool.isInArenas(p), "large allocation not mapped");
+  wirte_data(p, size + 8192);
+#if !HEADERLESS_CELL
+  assertm(pool.getUsableSize(p) >= size + 8192, "large allocation too small");
+#endif
+  pool.deallocate(p, size + 8192);
+  void* q = pool.allocate(size);
+  assertm(q == p, "large mapping not reused from the cache");
+  wirte_data(q, size);
+  pool.deallocate(q, size);
+  // twice the size does not fit the cached mapping.
+  void* r = pool.allocate(size * 2);
+  assertm(r && r != q, "cached mapping too small for the request");
+  wirte_data(r, size * 2);
+  pool.deallocate(r, size * 2);
+  pool.trimLargeCache();
+}
+
+// bulk calls hand out `count` distinct cells and free all but the null
+// entries, which the caller still owns.
+static void test_bulk() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  const size_t size = 48;
+  const size_t count = 300;
+  std::vector<void*> cells(count);
+  assertm(pool.allocateBulk(size, count, cells.data()) == count,
+          "bulk allocation fell short");
+  for (size_t i = 0; i < count; ++i) {
+    *static_cast<size_t*>(cells[i]) = i;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    assertm(*static_cast<size_t*>(cells[i]) == i, "cell handed out twice");
+  }
+  void* kept[] = {cells[0], cells[count / 2], cells[count - 1]};
+  cells[0] = cells[count / 2] = cells[count - 1] = nullptr;
+#if POOL_STATS
+  auto frees = [&pool, size]() {
+    for (const PoolStatsSnapshot& s : pool.snapshot()) {
+      if (s.mCellSize == pool.getCellSize(size)) {
+        return s.mFrees;
+      }
+    }
+    return uint64_t(0);
+  };
+  const uint64_t freesBefore = frees();
+#endif
+  pool.deallocateBulk(cells.data(), count, size);
+#if POOL_STATS
+  assertm(frees() - freesBefore == count - 3, "null entries counted");
+#endif
+  // the kept cells are still allocated, a new bulk never hands them out.
+  assertm(pool.allocateBulk(size, count, cells.data()) == count,
+          "bulk allocation fell short");
+  for (void* cell : kept) {
+    assertm(std::find(cells.begin(), cells.end(), cell) == cells.end(),
+            "kept cell handed out again");
+    pool.deallocate(cell, size);
+  }
+  pool.deallocateBulk(cells.data(), count, size);
+
+  // large sizes go one by one through the large path.
+  void* large[3] = {};
+  assertm(pool.allocateBulk((4 << 20) + 1, 2, large) == 2,
+          "large bulk allocation fell short");
+  pool.deallocateBulk(large, 3, (4 << 20) + 1);
+}
+
+// a sized free of the malloc library masks the pointer only when
+// isInArenas() holds, foreign and large pointers must not pass it. cells of
+// every size are freed by size.
+static void test_sized_free() {
+  GlobalMemPool& pool = GlobalMemPool::getInstance();
+  int onStack = 0;
+  std::unique_ptr<int> onHeap(new int(0));
+  static int sStatic = 0;
+  assertm(!pool.isInArenas(nullptr) && !pool.isInArenas(&onStack) &&
+          !pool.isInArenas(onHeap.get()) && !pool.isInArenas(&sStatic),
+          "foreign pointer taken for a cell");
+  void* large = pool.allocate((4 << 20) + 1);
+  assertm(!pool.isInArenas(large), "large mapping taken for a cell");
+  pool.deallocate(large, (4 << 20) + 1);
+
+  std::vector<void*> cells;
+  for (size_t size = 8; size <= 64 << 10; size *= 2) {
+    cells.push_back(pool.allocate(size));
+    assertm(pool.isInArenas(cells.back()), "cell not in the arenas");
+  }
+  size_t size = 8;
+  for (void* cell : cells) {
+    pool.deallocate(cell, size);
+    size *= 2;
+  }
+}
+
 int main() {
   struct A {
     // std::shared_ptr<int> m;
@@ -128,5 +804,26 @@ int main() {
     std::shared_ptr<A> p = strm::make_shared2<A>(debugA, 10);
   }
 
+  test_wait_and_timeout();
+  test_grow();
+  test_ring_full_and_empty();
+  test_freelist_mpmc();
+  test_recycle();
+  test_recycle_across_arenas();
+  test_pool_ptr_refcount<WaitSpec>();
+  test_pool_ptr_refcount<static_user_spec<ps_type::single_thread, false>>();
+  test_backing_store();
+  test_numa_node();
+  test_thread_cache();
+  test_cpu_shards();
+  test_cell_headers();
+  test_non_full_arena();
+  test_many_arenas();
+  test_decay();
+  test_size_classes();
+  test_large_allocation();
+  test_bulk();
+  test_sized_free();
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,373 @@
+/**
+ * Replays a recording written by PoolRecord against one byte allocator.
+ * every recorded thread gets a replay thread doing the same allocations and
+ * frees of the same sizes. by default the threads take turns in the
+ * recorded time order, so the interleaving is the original one. with -r
+ * they run freely and a free only waits for the allocation it pairs with.
+ *
+ *   g++ -std=c++17 -O2 -pthread -DLOG_LEVEL=0 -I.. pool_replay.cpp \
+ *       ../MemoryPool.cpp ../MemoryPool2.cpp ../MemoryPool4.cpp \
+ *       ../BackingStore.cpp ../PoolStats.cpp -o pool_replay
+ *   ./pool_replay [-e engine] [-s source] [-r] [-j] recording.bin
+ *
+ * engines: globalmempool (default), memorypool, memorypool2 and malloc.
+ * MemoryPool and MemoryPool2 are not thread safe, their calls are
+ * serialized by a mutex. MemoryPool3 holds 8 cells per size and the
+ * ObjectPool engines hand out one type each, neither can take a recorded
+ * workload.
+ *
+ * sources: globalmempool (default) replays what was allocated from
+ * GlobalMemPool. objectpool replays the cells of the ObjectPool engines
+ * as allocations of the cell size, all replays both.
+ *
+ * objects are identified by address. a free is paired with the latest
+ * allocation of its address, frees of objects allocated before the
+ * recording started are skipped and what is still alive at the end is
+ * freed after the timing. peak RSS includes the loaded recording.
+ */
+#include "MemoryPool4.h"
+// the older engines were written to be built alone, their headers define
+// the same macros.
+#undef TAG_LOG
+#include "MemoryPool2.h"
+// last, it defines MAX_CELL_SIZE_POW2_BASE as a macro.
+#include "MemoryPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace {
+
+// keep in sync with PoolRecord.h/.cpp
+struct FileHeader {
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mRecordSize;
+};
+
+struct ChunkHeader {
+  uint32_t mThread;
+  uint32_t mCount;
+};
+
+constexpr uint8_t OP_ALLOCATE = 1;
+constexpr uint8_t OP_DEALLOCATE = 2;
+
+constexpr int SOURCE_GLOBAL_MEM_POOL = 0;
+constexpr int SOURCE_OBJECT_POOL = 1;
+constexpr int SOURCE_ALL = -1;
+
+struct Record {
+  uint64_t mTimestamp;
+  uint64_t mObject;
+  uint32_t mSize;
+  uint8_t mOp;
+  uint8_t mSource;
+  uint16_t mReserved;
+};
+
+struct Step {
+  uint64_t mSeq;   // position in the recorded time order
+  uint32_t mId;    // dense object id
+  uint32_t mSize;  // size of the allocation, also for its free
+  uint8_t mOp;
+};
+
+struct Engine {
+  const char* mName;
+  void* (*mAllocate)(size_t size);
+  void (*mDeallocate)(void* p, size_t size);
+};
+
+std::mutex gLegacyMutex;
+
+const Engine ENGINES[] = {
+  {"globalmempool",
+   [](size_t size) { return GlobalMemPool::getInstance().allocate(size); },
+   [](void* p, size_t size) {
+     GlobalMemPool::getInstance().deallocate(p, size);
+   }},
+  {"memorypool",
+   [](size_t size) {
+     std::lock_guard<std::mutex> lock(gLegacyMutex);
+     return MemoryPool::allocate(size);
+   },
+   [](void* p, size_t size) {
+     std::lock_guard<std::mutex> lock(gLegacyMutex);
+     MemoryPool::deallocate(p, size);
+   }},
+  {"memorypool2",
+   [](size_t size) {
+     std::lock_guard<std::mutex> lock(gLegacyMutex);
+     return MemoryPool2::allocate(size);
+   },
+   [](void* p, size_t size) {
+     std::lock_guard<std::mutex> lock(gLegacyMutex);
+     MemoryPool2::deallocate(p, size);
+   }},
+  {"malloc",
+   [](size_t size) { return malloc(size); },
+   [](void* p, size_t) { free(p); }},
+};
+
+struct Replay {
+  // steps of every recorded thread, in its own order.
+  std::vector<std::vector<Step>> mThreads;
+  uint32_t mObjectCount = 0;
+  uint64_t mSkippedFrees = 0;
+};
+
+bool load(const char* path, std::vector<std::vector<Record>>& threads) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "can not open %s\n", path);
+    return false;
+  }
+  FileHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.mMagic, "POOLREC1", 8) == 0 &&
+            header.mVersion == 1 && header.mRecordSize == sizeof(Record);
+  if (!ok) {
+    fprintf(stderr, "%s is not a pool recording\n", path);
+  }
+  ChunkHeader chunk;
+  while (ok && fread(&chunk, sizeof(chunk), 1, file) == 1) {
+    if (chunk.mThread >= threads.size()) {
+      threads.resize(chunk.mThread + 1);
+    }
+    std::vector<Record>& records = threads[chunk.mThread];
+    const size_t first = records.size();
+    records.resize(first + chunk.mCount);
+    if (fread(records.data() + first, sizeof(Record), chunk.mCount, file) !=
+        chunk.mCount) {
+      fprintf(stderr, "%s is truncated\n", path);
+      ok = false;
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+// merges the threads in time order and turns addresses into object ids.
+// records of other sources than `source` are left out.
+Replay prepare(const std::vector<std::vector<Record>>& threads, int source) {
+  struct Ref {
+    uint64_t mTimestamp;
+    uint32_t mThread;
+    uint32_t mIdx;
+    uint8_t mOp;
+  };
+  std::vector<Ref> order;
+  for (uint32_t t = 0; t < threads.size(); ++t) {
+    for (uint32_t i = 0; i < threads[t].size(); ++i) {
+      if (source != SOURCE_ALL && threads[t][i].mSource != source) {
+        continue;
+      }
+      order.push_back({threads[t][i].mTimestamp, t, i, threads[t][i].mOp});
+    }
+  }
+  // a free is recorded before its cell is given back and the next
+  // allocation of the address after, on a tie the free goes first.
+  std::stable_sort(order.begin(), order.end(),
+                   [](const Ref& a, const Ref& b) {
+                     if (a.mTimestamp != b.mTimestamp) {
+                       return a.mTimestamp < b.mTimestamp;
+                     }
+                     return a.mOp == OP_DEALLOCATE && b.mOp != OP_DEALLOCATE;
+                   });
+
+  Replay replay;
+  replay.mThreads.resize(threads.size());
+  // live address -> (object id, size)
+  std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> live;
+  uint64_t seq = 0;
+  for (const Ref& ref : order) {
+    const Record& record = threads[ref.mThread][ref.mIdx];
+    Step step;
+    step.mOp = record.mOp;
+    if (record.mOp == OP_ALLOCATE) {
+      step.mId = replay.mObjectCount++;
+      step.mSize = std::max<uint32_t>(record.mSize, 1);
+      live[record.mObject] = {step.mId, step.mSize};
+    } else {
+      auto it = live.find(record.mObject);
+      if (it == live.end()) {
+        replay.mSkippedFrees++;
+        continue;
+      }
+      step.mId = it->second.first;
+      step.mSize = it->second.second;
+      live.erase(it);
+    }
+    step.mSeq = seq++;
+    replay.mThreads[ref.mThread].push_back(step);
+  }
+  return replay;
+}
+
+void waitTurn(const std::atomic<uint64_t>& turn, uint64_t seq) {
+  for (int spins = 0; turn.load(std::memory_order_acquire) != seq; ++spins) {
+    if (spins > 64) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+// returns the seconds the replay took.
+double run(const Replay& replay, const Engine& engine, bool ordered,
+           std::vector<std::atomic<void*>>& objects) {
+  std::atomic<uint64_t> turn{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (const std::vector<Step>& steps : replay.mThreads) {
+    if (steps.empty()) {
+      continue;
+    }
+    threads.emplace_back([&, ordered]() {
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      for (const Step& step : steps) {
+        if (ordered) {
+          waitTurn(turn, step.mSeq);
+        }
+        if (step.mOp == OP_ALLOCATE) {
+          void* p = engine.mAllocate(step.mSize);
+          if (!p) {
+            fprintf(stderr, "%s failed to allocate %u bytes\n",
+                    engine.mName, step.mSize);
+            abort();
+          }
+          objects[step.mId].store(p, std::memory_order_release);
+        } else {
+          void* p = objects[step.mId].load(std::memory_order_acquire);
+          // only without turns, the allocation may run on another thread.
+          while (!p) {
+            std::this_thread::yield();
+            p = objects[step.mId].load(std::memory_order_acquire);
+          }
+          engine.mDeallocate(p, step.mSize);
+          objects[step.mId].store(nullptr, std::memory_order_relaxed);
+        }
+        if (ordered) {
+          turn.store(step.mSeq + 1, std::memory_order_release);
+        }
+      }
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  go.store(true);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* engineName = "globalmempool";
+  const char* sourceName = "globalmempool";
+  const char* path = nullptr;
+  bool ordered = true;
+  bool json = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      engineName = argv[++i];
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      sourceName = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0) {
+      ordered = false;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      json = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  const Engine* engine = nullptr;
+  for (const Engine& candidate : ENGINES) {
+    if (strcmp(candidate.mName, engineName) == 0) {
+      engine = &candidate;
+    }
+  }
+  int source = SOURCE_GLOBAL_MEM_POOL;
+  if (strcmp(sourceName, "objectpool") == 0) {
+    source = SOURCE_OBJECT_POOL;
+  } else if (strcmp(sourceName, "all") == 0) {
+    source = SOURCE_ALL;
+  } else if (strcmp(sourceName, "globalmempool") != 0) {
+    engine = nullptr;
+  }
+  if (!path || !engine) {
+    fprintf(stderr,
+            "usage: %s [-e engine] [-s source] [-r] [-j] recording.bin\n"
+            "engines: globalmempool memorypool memorypool2 malloc\n"
+            "sources: globalmempool objectpool all\n",
+            argv[0]);
+    return 2;
+  }
+
+  Replay replay;
+  {
+    std::vector<std::vector<Record>> records;
+    if (!load(path, records)) {
+      return 1;
+    }
+    replay = prepare(records, source);
+  }
+  uint64_t ops = 0;
+  size_t threadCount = 0;
+  for (const std::vector<Step>& steps : replay.mThreads) {
+    ops += steps.size();
+    threadCount += !steps.empty();
+  }
+  std::vector<std::atomic<void*>> objects(replay.mObjectCount);
+  const double seconds = run(replay, *engine, ordered, objects);
+  struct rusage usage {};
+  getrusage(RUSAGE_SELF, &usage);
+  uint64_t leftAlive = 0;
+  for (uint32_t t = 0; t < replay.mThreads.size(); ++t) {
+    for (const Step& step : replay.mThreads[t]) {
+      void* p = objects[step.mId].exchange(nullptr);
+      if (step.mOp == OP_ALLOCATE && p) {
+        engine->mDeallocate(p, step.mSize);
+        leftAlive++;
+      }
+    }
+  }
+
+  const char* mode = ordered ? "ordered" : "free";
+  if (json) {
+    printf("{\"engine\":\"%s\",\"mode\":\"%s\",\"threads\":%zu,"
+           "\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.0f,"
+           "\"skipped_frees\":%llu,\"left_alive\":%llu,"
+           "\"peak_rss_kb\":%ld}\n",
+           engine->mName, mode, threadCount,
+           static_cast<unsigned long long>(ops), seconds, ops / seconds,
+           static_cast<unsigned long long>(replay.mSkippedFrees),
+           static_cast<unsigned long long>(leftAlive), usage.ru_maxrss);
+  } else {
+    printf("engine,mode,threads,ops,seconds,ops_per_sec,skipped_frees,"
+           "left_alive,peak_rss_kb\n");
+    printf("%s,%s,%zu,%llu,%.6f,%.0f,%llu,%llu,%ld\n", engine->mName, mode,
+           threadCount, static_cast<unsigned long long>(ops), seconds,
+           ops / seconds,
+           static_cast<unsigned long long>(replay.mSkippedFrees),
+           static_cast<unsigned long long>(leftAlive), usage.ru_maxrss);
+  }
+  return 0;
+}
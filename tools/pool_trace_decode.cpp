@@ -0,0 +1,147 @@
+/**
+ * Prints a trace written by PoolTrace::dump(), the events of all threads
+ * merged in time order, or with -s a summary per event type and cell size.
+ *
+ *   g++ -std=c++17 -O2 pool_trace_decode.cpp -o pool_trace_decode
+ *   ./pool_trace_decode [-s] trace.bin
+ *
+ * reads the file layout only, it does not need the pool sources.
+ */
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// keep in sync with PoolTrace.h/.cpp
+struct FileHeader {
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mEventSize;
+  uint64_t mTicks0;
+  uint64_t mNs0;
+  uint64_t mTicks1;
+  uint64_t mNs1;
+};
+
+struct RingHeader {
+  uint64_t mTid;
+  uint64_t mCount;
+};
+
+struct Event {
+  uint64_t mTimestamp;
+  uint64_t mPtr;
+  uint32_t mCellBodySize;
+  uint32_t mCellIdx;
+  uint32_t mCount;
+  uint16_t mType;
+  uint16_t mReserved;
+};
+
+struct ThreadEvent {
+  uint64_t mTid;
+  Event mEvent;
+};
+
+const char* typeName(uint16_t type) {
+  static const char* const sNames[] = {
+    "?", "alloc", "free", "alloc_bulk", "free_bulk",
+    "arena_new", "arena_release",
+  };
+  return type < sizeof(sNames) / sizeof(sNames[0]) ? sNames[type] : "?";
+}
+
+bool readTrace(const char* path, FileHeader& header,
+               std::vector<ThreadEvent>& events) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "can not open %s\n", path);
+    return false;
+  }
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.mMagic, "POOLTRC1", 8) == 0 &&
+            header.mVersion == 1 && header.mEventSize == sizeof(Event);
+  if (!ok) {
+    fprintf(stderr, "%s is not a pool trace\n", path);
+  }
+  RingHeader ring;
+  while (ok && fread(&ring, sizeof(ring), 1, file) == 1) {
+    for (uint64_t i = 0; i < ring.mCount; ++i) {
+      ThreadEvent event;
+      event.mTid = ring.mTid;
+      if (fread(&event.mEvent, sizeof(Event), 1, file) != 1) {
+        fprintf(stderr, "%s is truncated\n", path);
+        ok = false;
+        break;
+      }
+      events.push_back(event);
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool summary = false;
+  const char* path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-s") == 0) {
+      summary = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (!path) {
+    fprintf(stderr, "usage: %s [-s] trace.bin\n", argv[0]);
+    return 2;
+  }
+  FileHeader header;
+  std::vector<ThreadEvent> events;
+  if (!readTrace(path, header, events)) {
+    return 1;
+  }
+  std::stable_sort(events.begin(), events.end(),
+                   [](const ThreadEvent& a, const ThreadEvent& b) {
+                     return a.mEvent.mTimestamp < b.mEvent.mTimestamp;
+                   });
+
+  if (summary) {
+    // (type, cell size) -> (events, cells)
+    std::map<std::pair<uint16_t, uint32_t>, std::pair<uint64_t, uint64_t>>
+        counts;
+    for (const ThreadEvent& e : events) {
+      auto& count = counts[{e.mEvent.mType, e.mEvent.mCellBodySize}];
+      count.first++;
+      count.second += e.mEvent.mCount;
+    }
+    printf("%-14s %10s %12s %12s\n", "type", "cell_size", "events", "cells");
+    for (const auto& [key, count] : counts) {
+      printf("%-14s %10u %12" PRIu64 " %12" PRIu64 "\n", typeName(key.first),
+             key.second, count.first, count.second);
+    }
+    return 0;
+  }
+
+  // ticks to ns by the two calibration points of the header.
+  const double nsPerTick = header.mTicks1 > header.mTicks0 ?
+      static_cast<double>(header.mNs1 - header.mNs0) /
+          (header.mTicks1 - header.mTicks0) : 1.0;
+  const uint64_t start = events.empty() ? 0 : events[0].mEvent.mTimestamp;
+  printf("%14s %8s %-14s %9s %6s %6s %s\n",
+         "ns", "tid", "type", "cell_size", "cell", "count", "ptr");
+  for (const ThreadEvent& e : events) {
+    printf("%14.0f %8" PRIu64 " %-14s %9u %6u %6u 0x%" PRIx64 "\n",
+           (e.mEvent.mTimestamp - start) * nsPerTick, e.mTid,
+           typeName(e.mEvent.mType), e.mEvent.mCellBodySize,
+           e.mEvent.mCellIdx, e.mEvent.mCount, e.mEvent.mPtr);
+  }
+  return 0;
+}